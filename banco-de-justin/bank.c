@@ -19,6 +19,10 @@
  */
 
 #include "common.h"
+#include "ledger.h"
+#include "stats.h"
+#include "trace.h"
+#include "wal.h"
 #include "proton/message.h"
 #include "proton/messenger.h"
 #include "proton/error.h"
@@ -29,22 +33,134 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
 #include <uuid/uuid.h>
 
 typedef struct {
     const char *address;
     const char *gateway_addr;
     unsigned int delay;       // seconds
-    int balance;
+    int balance;              // opening balance of each account
+    unsigned int window;      // incoming window: max unsettled transactions
+    unsigned int partitions;  // ledger worker threads
+    const char *durable_dir;  // enables the write-ahead log
+    unsigned int batch;       // max transactions per group commit
+    unsigned int snapshot;    // transactions between snapshots
+    int report;               // seconds between statistics reports
+    unsigned int trace;       // # transactions kept in the trace buffer
 } Options_t;
 
+// trace stages recorded by the bank.  The customer's put time is
+// carried in the message, see TRACE_PUT_PROPERTY.
+enum {
+    STAGE_PUT,
+    STAGE_RECV,
+    STAGE_DECODE,
+    STAGE_APPLY,
+    STAGE_DISPOSITION,
+    STAGE_COUNT
+};
+static const char * const stage_names[STAGE_COUNT] = {
+    "customer put", "bank recv", "decode", "apply", "disposition"
+};
+#define TRACE_PUT_PROPERTY "put-usec"
+
+// live statistics, see stats-top
+enum {
+    STAT_TRANSACTIONS,
+    STAT_ACCEPTED,
+    STAT_REJECTED,
+    STAT_INVALID,
+    STAT_BATCHES,
+    STAT_COMMITS,
+    STAT_FSYNC_USEC,
+    STAT_PENDING,
+    STAT_ACCOUNTS,
+    STAT_COUNT
+};
+static const StatsDef_t stat_defs[STAT_COUNT] = {
+    { "transactions", STATS_COUNTER },
+    { "accepted", STATS_COUNTER },
+    { "rejected", STATS_COUNTER },
+    { "invalid", STATS_COUNTER },
+    { "batches", STATS_COUNTER },
+    { "commits", STATS_COUNTER },
+    { "fsync-usec", STATS_COUNTER },
+    { "pending", STATS_GAUGE },
+    { "accounts", STATS_GAUGE }
+};
+
+static volatile sig_atomic_t dump_requested;
+static volatile sig_atomic_t stop_requested;
+
+// the log record for an applied transaction.  The resulting balance
+// is stored so replay is idempotent.
+typedef struct {
+    uint64_t sequence;
+    uint64_t account;
+    int32_t transaction;
+    int32_t balance;
+} BankRecord_t;
+
+// snapshot: a BankSnapshot_t followed by 'accounts' BankSnapshotEntry_t
+typedef struct {
+    uint64_t sequence;
+    uint64_t accounts;
+} BankSnapshot_t;
+
+typedef struct {
+    uint64_t account;
+    int64_t balance;
+} BankSnapshotEntry_t;
+
+// transactions whose dispositions are held until the batch has been
+// applied (and logged)
+typedef struct {
+    LedgerTx_t *txs;
+    pn_tracker_t *trackers;
+    uint64_t **traces;        // trace record of each, if tracing
+    unsigned int count;
+    uint64_t ticket;          // of LedgerSubmit()
+} Batch_t;
+
+typedef struct {
+    Options_t *opts;
+    Ledger_t *ledger;
+    Wal_t *wal;
+    uint64_t sequence;        // of the last applied transaction
+    Batch_t batches[2];
+    Batch_t *filling;         // being received
+    Batch_t *applying;        // submitted to the ledger, not yet settled
+    unsigned int pending_limit;
+    char *snapshot;           // buffer for building snapshots
+    size_t snapshot_size;
+    uint64_t transactions;    // since last report
+    uint64_t last_commits;
+    uint64_t last_sync_usec;
+    uint64_t *last_partition_tx;
+    pn_timestamp_t last_report;
+    Trace_t *trace;
+    Stats_t *stats;
+    uint64_t *stat;
+} Bank_t;
+
 static void usage(int rc)
 {
-    printf("Usage: f-server [OPTIONS] <starting-balance>\n"
+    printf("Usage: bank [OPTIONS] <starting-balance>\n"
            " -a <addr> \tAddress to listen on [amqp://~0.0.0.0]\n"
            " -g <gateway> \tGateway for sending all reply messages\n"
            " -d <seconds> \tSimulate delay by sleeping <seconds> before replying [0]\n"
+           " -w # \tIncoming window - transactions settled per batch (half with -P) [1024]\n"
+           " -P # \tPartition the ledger across # worker threads, 0=none [0]\n"
+           " -D <dir> \tDurable mode: keep a write-ahead log and snapshots in <dir>\n"
+           " -b # \tDurable mode: max transactions per group commit [64]\n"
+           " -S # \tDurable mode: transactions between snapshots [100000]\n"
+           " -R <seconds> \tSeconds between statistics reports, 0=never [10 in durable mode, else 0]\n"
+           " -T # \tTrace the stages of the last # transactions.  A latency histogram\n"
+           "      \tis printed on SIGUSR1 and at exit (SIGINT/SIGTERM) [0=off]\n"
            " -V \tEnable debug logging\n"
+           "Each account is opened with <starting-balance>.  In durable mode saved\n"
+           "balances take precedence.\n"
            );
     exit(rc);
 }
@@ -55,8 +171,12 @@ static void parse_options( int argc, char **argv, Options_t *opts )
     opterr = 0;
 
     memset( opts, 0, sizeof(*opts) );
+    opts->window = 1024;
+    opts->batch = 64;
+    opts->snapshot = 100000;
+    opts->report = -1;
 
-    while ((c = getopt(argc, argv, "a:g:d:V")) != -1) {
+    while ((c = getopt(argc, argv, "a:g:d:w:P:D:b:S:R:T:V")) != -1) {
         switch (c) {
         case 'a': opts->address = optarg; break;
         case 'g': opts->gateway_addr = optarg; break;
@@ -66,6 +186,43 @@ static void parse_options( int argc, char **argv, Options_t *opts )
                 usage(1);
             }
             break;
+        case 'w':
+            if (sscanf( optarg, "%u", &opts->window ) != 1 || opts->window == 0) {
+                fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'P':
+            if (sscanf( optarg, "%u", &opts->partitions ) != 1) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'D': opts->durable_dir = optarg; break;
+        case 'b':
+            if (sscanf( optarg, "%u", &opts->batch ) != 1 || opts->batch == 0) {
+                fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'S':
+            if (sscanf( optarg, "%u", &opts->snapshot ) != 1) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'R':
+            if (sscanf( optarg, "%d", &opts->report ) != 1 || opts->report < 0) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'T':
+            if (sscanf( optarg, "%u", &opts->trace ) != 1) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
         case 'V': enable_logging(); break;
 
         default:
@@ -74,6 +231,9 @@ static void parse_options( int argc, char **argv, Options_t *opts )
     }
 
     if (!opts->address) opts->address = "amqp://~0.0.0.0";
+    if (opts->report < 0) opts->report = opts->durable_dir ? 10 : 0;
+    // transactions pending settlement must not be overwritten in the trace
+    if (opts->trace && opts->trace < 2 * opts->window) opts->trace = 2 * opts->window;
     if (optind >= argc || sscanf( argv[optind], "%d", &opts->balance ) != 1) {
         usage(1);
     }
@@ -81,11 +241,326 @@ static void parse_options( int argc, char **argv, Options_t *opts )
 }
 
 
+// Transaction message body formats:
+//   [ulong account, int amount]  - a list
+//   int amount                   - legacy: account 0
+//
+static bool decode_transaction( pn_message_t *message, LedgerTx_t *tx )
+{
+    pn_data_t *body = pn_message_body( message );
+
+    LOG("pn_data_size = %lu\n", (unsigned long)pn_data_size( body ));
+
+    if (!pn_data_next( body )) return false;
+    switch (pn_data_type( body )) {
+    case PN_INT:
+        tx->account = 0;
+        tx->amount = pn_data_get_int( body );
+        return true;
+    case PN_LIST:
+        if (pn_data_get_list( body ) != 2) return false;
+        pn_data_enter( body );
+        if (!pn_data_next( body ) || pn_data_type( body ) != PN_ULONG) return false;
+        tx->account = pn_data_get_ulong( body );
+        if (!pn_data_next( body ) || pn_data_type( body ) != PN_INT) return false;
+        tx->amount = pn_data_get_int( body );
+        pn_data_exit( body );
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// the customer's put timestamp, from the application properties
+static uint64_t get_put_usec( pn_message_t *message )
+{
+    pn_data_t *props = pn_message_properties( message );
+    uint64_t put_usec = 0;
+
+    pn_data_rewind( props );
+    if (!pn_data_next( props ) || pn_data_type( props ) != PN_MAP) return 0;
+    pn_data_enter( props );
+    while (pn_data_next( props )) {
+        bool match = false;
+        if (pn_data_type( props ) == PN_STRING) {
+            pn_bytes_t key = pn_data_get_string( props );
+            match = (key.size == sizeof(TRACE_PUT_PROPERTY) - 1
+                     && memcmp( key.start, TRACE_PUT_PROPERTY, key.size ) == 0);
+        }
+        if (!pn_data_next( props )) break;
+        if (match && pn_data_type( props ) == PN_ULONG) {
+            put_usec = pn_data_get_ulong( props );
+            break;
+        }
+    }
+    pn_data_exit( props );
+    return put_usec;
+}
+
+static void on_signal( int signum )
+{
+    if (signum == SIGUSR1) dump_requested = 1;
+    else stop_requested = 1;
+}
+
+
+static void replay_snapshot( void *handle, const void *data, size_t length )
+{
+    Bank_t *bank = (Bank_t *) handle;
+    BankSnapshot_t snap;
+    BankSnapshotEntry_t entry;
+    const char *p = (const char *) data;
+    uint64_t i;
+
+    check( length >= sizeof(snap), "Unexpected snapshot format" );
+    memcpy( &snap, p, sizeof(snap) );
+    check( length == sizeof(snap) + snap.accounts * sizeof(entry), "Unexpected snapshot format" );
+    p += sizeof(snap);
+    for (i = 0; i < snap.accounts; ++i) {
+        memcpy( &entry, p, sizeof(entry) );
+        LedgerSet( bank->ledger, entry.account, (int32_t) entry.balance );
+        p += sizeof(entry);
+    }
+    bank->sequence = snap.sequence;
+}
+
+static void replay_record( void *handle, const void *data, size_t length )
+{
+    Bank_t *bank = (Bank_t *) handle;
+    BankRecord_t rec;
+    check( length == sizeof(rec), "Unexpected log record format" );
+    memcpy( &rec, data, sizeof(rec) );
+    // records older than the snapshot remain if we crashed before the
+    // log was truncated
+    if (rec.sequence > bank->sequence) {
+        bank->sequence = rec.sequence;
+        LedgerSet( bank->ledger, rec.account, rec.balance );
+    }
+}
+
+static void snapshot_account( void *handle, uint64_t account, int32_t balance )
+{
+    char **p = (char **) handle;
+    BankSnapshotEntry_t entry;
+    entry.account = account;
+    entry.balance = balance;
+    memcpy( *p, &entry, sizeof(entry) );
+    *p += sizeof(entry);
+}
+
+static void write_snapshot( Bank_t *bank )
+{
+    BankSnapshot_t snap;
+    size_t size;
+    char *p;
+    int rc;
+
+    snap.sequence = bank->sequence;
+    snap.accounts = LedgerAccounts( bank->ledger );
+    size = sizeof(snap) + snap.accounts * sizeof(BankSnapshotEntry_t);
+    if (size > bank->snapshot_size) {
+        bank->snapshot = (char *) realloc( bank->snapshot, size );
+        check( bank->snapshot, "Out of memory" );
+        bank->snapshot_size = size;
+    }
+    memcpy( bank->snapshot, &snap, sizeof(snap) );
+    p = bank->snapshot + sizeof(snap);
+    LedgerForEach( bank->ledger, snapshot_account, &p );
+
+    LOG( "Writing snapshot at transaction %lu\n", (unsigned long) bank->sequence );
+    rc = WalSnapshot( bank->wal, bank->snapshot, size );
+    check( rc == 0, "Failed to write snapshot" );
+}
+
+static void report_statistics( Bank_t *bank, pn_timestamp_t now )
+{
+    double secs = (now - bank->last_report) / 1000.0;
+    unsigned int i;
+
+    fprintf( stdout, "%.1f tx/sec, %lu accounts",
+             bank->transactions / secs,
+             (unsigned long) LedgerAccounts( bank->ledger ) );
+    if (bank->wal) {
+        const WalStats_t *stats = WalGetStats( bank->wal );
+        uint64_t commits = stats->commits - bank->last_commits;
+        uint64_t sync_usec = stats->sync_usec_total - bank->last_sync_usec;
+        fprintf( stdout, ", batch size %.1f, fsync latency avg %.1f usec max %lu usec",
+                 commits ? (double) bank->transactions / commits : 0.0,
+                 commits ? (double) sync_usec / commits : 0.0,
+                 (unsigned long) stats->sync_usec_max );
+        bank->last_commits = stats->commits;
+        bank->last_sync_usec = stats->sync_usec_total;
+    }
+    fprintf( stdout, "\n" );
+
+    // skewed account access shows up as uneven partition load
+    if (LedgerPartitions( bank->ledger ) > 1) {
+        fprintf( stdout, "  partition tx/sec:" );
+        for (i = 0; i < LedgerPartitions( bank->ledger ); ++i) {
+            uint64_t tx = LedgerPartitionTransactions( bank->ledger, i );
+            fprintf( stdout, " %.1f", (tx - bank->last_partition_tx[i]) / secs );
+            bank->last_partition_tx[i] = tx;
+        }
+        fprintf( stdout, "\n" );
+    }
+    fflush( stdout );
+
+    bank->transactions = 0;
+    bank->last_report = now;
+}
+
+// Wait for a submitted batch to be applied, then release the
+// dispositions of its transactions.  In durable mode the applied
+// transactions are first made durable with a single fdatasync.
+// Rejections are held as well, since the balance they were checked
+// against may include deposits that were not yet durable.
+//
+// Rejected transactions are updated individually, then everything
+// else in the batch is accepted with one cumulative update: Messenger
+// only applies a cumulative update to deliveries that have no local
+// state yet, so the rejections are preserved.  Finally the whole batch
+// is settled at once, freeing the window for the next batch.  Any later
+// batch was received after this one, so the cumulative updates do not
+// reach it.
+//
+static void finish_batch( Bank_t *bank, pn_messenger_t *messenger, Batch_t *b )
+{
+    unsigned int i;
+    int rc;
+    bool have_accepted = false;
+    pn_tracker_t last_accepted = 0;
+
+    LedgerWait( bank->ledger, b->ticket );
+    if (bank->trace) {
+        uint64_t now = _now_usec();
+        for (i = 0; i < b->count; ++i)
+            b->traces[i][STAGE_APPLY] = now;
+    }
+
+    for (i = 0; i < b->count; ++i) {
+        LedgerTx_t *tx = &b->txs[i];
+        StatsAdd( bank->stat, !tx->valid ? STAT_INVALID
+                  : tx->accepted ? STAT_ACCEPTED : STAT_REJECTED, 1 );
+        if (tx->valid) {
+            LOG("Account %lu: %s %d dollars %s - balance = %d dollars\n",
+                (unsigned long) tx->account,
+                (tx->amount < 0) ? "Withdrawal" : "Deposit", abs(tx->amount),
+                tx->accepted ? "complete" : "failed, would overdraw account",
+                tx->balance);
+        }
+        if (tx->accepted && bank->wal) {
+            BankRecord_t rec;
+            rec.sequence = ++bank->sequence;
+            rec.account = tx->account;
+            rec.transaction = tx->amount;
+            rec.balance = tx->balance;
+            WalAppend( bank->wal, &rec, sizeof(rec) );
+        }
+    }
+
+    if (bank->wal) {
+        rc = WalCommit( bank->wal );
+        check( rc == 0, "Failed to write the transaction log" );
+    }
+
+    for (i = 0; i < b->count; ++i) {
+        if (b->txs[i].accepted) {
+            last_accepted = b->trackers[i];
+            have_accepted = true;
+        } else {
+            rc = pn_messenger_reject( messenger, b->trackers[i], 0 );
+            check( rc == 0, "pn_messenger_reject() failed" );
+        }
+    }
+    if (have_accepted) {
+        rc = pn_messenger_accept( messenger, last_accepted, PN_CUMULATIVE );
+        check( rc == 0, "pn_messenger_accept() failed" );
+    }
+    rc = pn_messenger_settle( messenger, b->trackers[b->count - 1], PN_CUMULATIVE );
+    check( rc == 0, "pn_messenger_settle() failed" );
+    if (bank->trace) {
+        uint64_t now = _now_usec();
+        for (i = 0; i < b->count; ++i)
+            b->traces[i][STAGE_DISPOSITION] = now;
+    }
+
+    bank->transactions += b->count;
+    StatsAdd( bank->stat, STAT_TRANSACTIONS, b->count );
+    StatsAdd( bank->stat, STAT_BATCHES, 1 );
+    if (bank->wal) {
+        const WalStats_t *stats = WalGetStats( bank->wal );
+        StatsSet( bank->stat, STAT_COMMITS, stats->commits );
+        StatsSet( bank->stat, STAT_FSYNC_USEC, stats->sync_usec_total );
+    }
+    StatsSet( bank->stat, STAT_ACCOUNTS, LedgerAccounts( bank->ledger ) );
+    b->count = 0;
+
+    if (bank->opts->report) {
+        pn_timestamp_t now = _now();
+        if (now - bank->last_report >= bank->opts->report * 1000)
+            report_statistics( bank, now );
+    }
+}
+
+static void finish_applying( Bank_t *bank, pn_messenger_t *messenger )
+{
+    if (bank->applying) {
+        finish_batch( bank, messenger, bank->applying );
+        bank->applying = NULL;
+    }
+}
+
+// A snapshot must only hold logged transactions, so it is written when
+// no batch is pending in the ledger.
+//
+static void snapshot_if_due( Bank_t *bank, pn_messenger_t *messenger )
+{
+    if (bank->wal && bank->opts->snapshot
+        && WalGetStats( bank->wal )->records_since_snapshot >= bank->opts->snapshot) {
+        finish_applying( bank, messenger );
+        write_snapshot( bank );
+    }
+}
+
+// Hand the received batch to the ledger, then finish the previous one.
+// The partitions apply this batch while the previous one is logged and
+// settled and the next one is received; the receiving thread only waits
+// for a batch when it is about to settle it.  Without partitions the
+// batch has already been applied, and is finished at once.
+//
+static void submit_batch( Bank_t *bank, pn_messenger_t *messenger )
+{
+    Batch_t *b = bank->filling;
+
+    if (!b->count) return;
+    snapshot_if_due( bank, messenger );
+
+    b->ticket = LedgerSubmit( bank->ledger, b->txs, b->count );
+    finish_applying( bank, messenger );
+    if (bank->opts->partitions) {
+        bank->applying = b;
+        bank->filling = (b == &bank->batches[0]) ? &bank->batches[1] : &bank->batches[0];
+    } else {
+        finish_batch( bank, messenger, b );
+    }
+}
+
+// settle everything received so far, before waiting for more
+static void flush_batches( Bank_t *bank, pn_messenger_t *messenger )
+{
+    submit_batch( bank, messenger );
+    finish_applying( bank, messenger );
+    snapshot_if_due( bank, messenger );
+}
+
+
 
 int main(int argc, char** argv)
 {
     Options_t opts;
     int rc;
+    unsigned int i;
 
     pn_message_t *request_msg = pn_message();
     check( request_msg, "Failed to allocate a Message");
@@ -94,8 +569,47 @@ int main(int argc, char** argv)
 
     parse_options( argc, argv, &opts );
 
-    pn_messenger_set_incoming_window( messenger, 1 );
-    pn_messenger_set_timeout( messenger, -1 );
+    Bank_t bank;
+    memset( &bank, 0, sizeof(bank) );
+    bank.opts = &opts;
+    bank.ledger = LedgerNew( opts.partitions, opts.balance );
+    bank.last_partition_tx = (uint64_t *) calloc( LedgerPartitions( bank.ledger ), sizeof(uint64_t) );
+    check( bank.last_partition_tx, "Out of memory" );
+    // dispositions are held until a batch is settled, and with
+    // partitions the next batch is received meanwhile: the incoming
+    // window must cover both
+    bank.pending_limit = opts.window;
+    if (opts.partitions && opts.window > 1) bank.pending_limit = opts.window / 2;
+    bank.last_report = _now();
+    bank.stats = StatsNew( "bank", stat_defs, STAT_COUNT, 1 );
+    bank.stat = StatsSlot( bank.stats, 0 );
+    if (opts.trace) {
+        bank.trace = TraceNew( STAGE_COUNT, stage_names, opts.trace );
+
+        signal( SIGUSR1, on_signal );
+        signal( SIGINT, on_signal );
+        signal( SIGTERM, on_signal );
+    }
+    if (opts.durable_dir) {
+        bank.wal = WalOpen( opts.durable_dir, "bank", replay_snapshot, replay_record, &bank );
+        check( bank.wal, "Failed to open the transaction log" );
+        if (opts.batch < bank.pending_limit) bank.pending_limit = opts.batch;
+        fprintf( stdout, "Recovered %lu transactions, %lu accounts\n",
+                 (unsigned long) bank.sequence,
+                 (unsigned long) LedgerAccounts( bank.ledger ) );
+    }
+    for (i = 0; i < 2; ++i) {
+        Batch_t *b = &bank.batches[i];
+        b->txs = (LedgerTx_t *) calloc( bank.pending_limit, sizeof(LedgerTx_t) );
+        b->trackers = (pn_tracker_t *) calloc( bank.pending_limit, sizeof(pn_tracker_t) );
+        b->traces = (uint64_t **) calloc( bank.pending_limit, sizeof(uint64_t *) );
+        check( b->txs && b->trackers && b->traces, "Out of memory" );
+    }
+    bank.filling = &bank.batches[0];
+
+    pn_messenger_set_incoming_window( messenger, opts.window );
+    // when tracing, wake up periodically to check for signals
+    pn_messenger_set_timeout( messenger, bank.trace ? 1000 : -1 );
 
     if (opts.gateway_addr) {
         LOG( "routing all messages via %s\n", opts.gateway_addr );
@@ -110,10 +624,17 @@ int main(int argc, char** argv)
     pn_subscription_t *subscription = pn_messenger_subscribe(messenger, opts.address);
     if (!subscription) check_messenger( messenger );
 
-    for (;;) {
+    while (!stop_requested) {
         LOG("Waiting for a transaction...\n");
         rc = pn_messenger_recv(messenger, -1);
-        if (rc) check_messenger( messenger );
+        if (rc == PN_TIMEOUT && bank.trace) rc = 0;
+        else if (rc) check_messenger( messenger );
+        uint64_t recv_usec = bank.trace ? _now_usec() : 0;
+
+        if (dump_requested) {
+            dump_requested = 0;
+            TraceDump( bank.trace, stdout );
+        }
 
         if (opts.delay) {
             LOG("Sleeping to delay response...\n");
@@ -126,39 +647,53 @@ int main(int argc, char** argv)
             rc = pn_messenger_get( messenger, request_msg );
             check(rc == 0, "pn_messenger_get() failed");
 
-            pn_tracker_t tracker = pn_messenger_incoming_tracker( messenger );
-
-            pn_data_t *body = pn_message_body( request_msg );
-
-            LOG("pn_data_size = %lu\n", (unsigned long)pn_data_size( body ));
+            Batch_t *b = bank.filling;
+            LedgerTx_t *tx = &b->txs[b->count];
+            memset( tx, 0, sizeof(*tx) );
+            b->trackers[b->count] = pn_messenger_incoming_tracker( messenger );
 
-            if (!pn_data_next( body ) || pn_data_type( body ) != PN_INT) {
+            tx->valid = decode_transaction( request_msg, tx );
+            if (!tx->valid) {
                 LOG("Transaction failed - invalid message format!\n");
-                rc = pn_messenger_reject( messenger, tracker, 0 );
-            } else {
-                int transaction = pn_data_get_int( body );
-
-                LOG("Client request: %s %d dollars\n",
-                    (transaction < 0) ? "Withdrawal" : "Deposit",
-                    abs(transaction));
-
-                if (transaction < 0 && -transaction > opts.balance) {
-                    LOG("Transaction failed - would result in overdrawn account!\n");
-                    rc = pn_messenger_reject( messenger, tracker, 0 );
-                } else {
-                    opts.balance += transaction;
-                    rc = pn_messenger_accept( messenger, tracker, 0);
-                    LOG("Transaction complete - current balance = %d dollars\n", opts.balance);
-                }
             }
-            // Now what?
+
+            if (bank.trace) {
+                uint64_t *t = TraceNext( bank.trace );
+                t[STAGE_PUT] = get_put_usec( request_msg );
+                t[STAGE_RECV] = recv_usec;
+                t[STAGE_DECODE] = _now_usec();
+                b->traces[b->count] = t;
+            }
+
+            if (++b->count == bank.pending_limit)
+                submit_batch( &bank, messenger );
+            StatsSet( bank.stat, STAT_PENDING, bank.filling->count );
         }
+
+        // apply, commit and settle whatever arrived in this receive batch
+        flush_batches( &bank, messenger );
+        StatsSet( bank.stat, STAT_PENDING, 0 );
     }
 
+    flush_batches( &bank, messenger );
+    if (bank.trace) TraceDump( bank.trace, stdout );
+
     rc = pn_messenger_stop(messenger);
     check(rc == 0, "pn_messenger_stop() failed");
     check_messenger(messenger);
 
+    TraceFree( bank.trace );
+    StatsFree( bank.stats );
+    WalClose( bank.wal );
+    LedgerFree( bank.ledger );
+    for (i = 0; i < 2; ++i) {
+        free( bank.batches[i].txs );
+        free( bank.batches[i].trackers );
+        free( bank.batches[i].traces );
+    }
+    free( bank.snapshot );
+    free( bank.last_partition_tx );
+
     pn_messenger_free(messenger);
     pn_message_free( request_msg );
 
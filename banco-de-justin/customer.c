@@ -18,7 +18,10 @@
  *
  */
 
+#define _XOPEN_SOURCE 600
+
 #include "common.h"
+#include "trace.h"
 #include "proton/message.h"
 #include "proton/messenger.h"
 #include "proton/error.h"
@@ -27,7 +30,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 
@@ -38,8 +45,37 @@ typedef struct {
     unsigned int ttl;
     int timeout;  // milliseconds
     int transaction;  // +deposit/-withdrawal
+    unsigned int count;   // # of transactions to perform
+    unsigned int depth;   // max transactions in flight
+    uint64_t account;     // account used when accounts == 0
+    unsigned int accounts;  // spread transactions across this many accounts
+    double skew;          // Zipf exponent for choosing accounts, 0=uniform
+    unsigned int trace;   // # transactions kept in the trace buffer
 } Options_t;
 
+// trace stages recorded by the customer.  The put time is also sent to
+// the bank (see bank.c) so it can trace the stages in between.
+enum {
+    STAGE_PUT,
+    STAGE_OBSERVED,
+    STAGE_COUNT
+};
+static const char * const stage_names[STAGE_COUNT] = {
+    "customer put", "status observed"
+};
+#define TRACE_PUT_PROPERTY "put-usec"
+
+static volatile sig_atomic_t dump_requested;
+
+// Zipf distributed account selection: account k (0 based) is chosen
+// with probability proportional to 1/(k+1)^skew.  The cumulative
+// distribution is precomputed, so each choice is a binary search.
+typedef struct {
+    double *cdf;
+    unsigned int count;
+    unsigned short seed[3];
+} AccountPicker_t;
+
 static void usage(int rc)
 {
     printf("Usage: customer [OPTIONS] -- <-withdrawal/+deposit>\n"
@@ -48,6 +84,13 @@ static void usage(int rc)
            " -g <gateway> \tGateway to use to reach the bank server\n"
            " -t # \tTimeout in seconds [10]\n"
            " -l <secs> \tTTL to set in message, 0 = no TTL [0]\n"
+           " -n # \tNumber of times to perform the transaction [1]\n"
+           " -p # \tMax transactions in flight (pipelined mode) [1]\n"
+           " -c <id> \tAccount to use [0]\n"
+           " -A # \tSpread transactions across accounts 0..#-1 (overrides -c)\n"
+           " -z <s> \tWith -A: Zipf skew of account selection, 0=uniform [0]\n"
+           " -T # \tTrace the last # transactions, print a latency histogram at exit\n"
+           "      \tor on SIGUSR1 [0=off]\n"
            " -V \tEnable debug logging\n"
            );
     exit(rc);
@@ -60,8 +103,10 @@ static void parse_options( int argc, char **argv, Options_t *opts )
 
     memset( opts, 0, sizeof(*opts) );
     opts->timeout = 10;
+    opts->count = 1;
+    opts->depth = 1;
 
-    while ((c = getopt(argc, argv, "a:g:t:l:V")) != -1) {
+    while ((c = getopt(argc, argv, "a:g:t:l:n:p:c:A:z:T:V")) != -1) {
         switch (c) {
         case 'a': opts->address = optarg; break;
         case 'g': opts->gateway_addr = optarg; break;
@@ -77,6 +122,42 @@ static void parse_options( int argc, char **argv, Options_t *opts )
                 usage(1);
             }
             break;
+        case 'n':
+            if (sscanf( optarg, "%u", &opts->count ) != 1 || opts->count == 0) {
+                fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'p':
+            if (sscanf( optarg, "%u", &opts->depth ) != 1 || opts->depth == 0) {
+                fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'c':
+            if (sscanf( optarg, "%" SCNu64, &opts->account ) != 1) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'A':
+            if (sscanf( optarg, "%u", &opts->accounts ) != 1) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'z':
+            if (sscanf( optarg, "%lf", &opts->skew ) != 1 || opts->skew < 0) {
+                fprintf(stderr, "Option -%c requires a non-negative number.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'T':
+            if (sscanf( optarg, "%u", &opts->trace ) != 1) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
         case 'V': enable_logging(); break;
 
         default:
@@ -86,6 +167,8 @@ static void parse_options( int argc, char **argv, Options_t *opts )
 
     if (!opts->address) opts->address = "amqp://0.0.0.0";
     if (opts->timeout > 0) opts->timeout *= 1000;
+    // transactions in flight must not be overwritten in the trace
+    if (opts->trace && opts->trace < 2 * opts->depth) opts->trace = 2 * opts->depth;
 
     if (optind >= argc || sscanf( argv[optind], "%d", &opts->transaction ) != 1) {
         usage(1);
@@ -93,6 +176,162 @@ static void parse_options( int argc, char **argv, Options_t *opts )
 }
 
 
+static void picker_init( AccountPicker_t *picker, unsigned int count, double skew )
+{
+    unsigned int i;
+    double total = 0.0;
+
+    picker->count = count;
+    picker->cdf = (double *) malloc( count * sizeof(double) );
+    check( picker->cdf, "Out of memory" );
+    for (i = 0; i < count; ++i) {
+        total += (skew > 0.0) ? 1.0 / pow( i + 1, skew ) : 1.0;
+        picker->cdf[i] = total;
+    }
+    for (i = 0; i < count; ++i)
+        picker->cdf[i] /= total;
+
+    picker->seed[0] = (unsigned short) getpid();
+    picker->seed[1] = (unsigned short) _now();
+    picker->seed[2] = (unsigned short) (_now() >> 16);
+}
+
+static uint64_t picker_next( AccountPicker_t *picker )
+{
+    double u = erand48( picker->seed );
+    unsigned int lo = 0;
+    unsigned int hi = picker->count - 1;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (picker->cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// [ulong account, int amount]
+static void build_transaction( pn_message_t *message, uint64_t account, int amount )
+{
+    pn_data_t *body = pn_message_body( message );
+    pn_data_clear( body );
+    int rc = pn_data_fill( body, "[Li]", account, amount );
+    check( rc == 0, "Failure to create request message" );
+}
+
+
+// record the put time in the message, for the bank's trace
+static uint64_t stamp_put( pn_message_t *message )
+{
+    uint64_t now = _now_usec();
+    pn_data_t *props = pn_message_properties( message );
+    pn_data_clear( props );
+    int rc = pn_data_fill( props, "{SL}", TRACE_PUT_PROPERTY, now );
+    check( rc == 0, "Failure to create request message" );
+    return now;
+}
+
+static void on_signal( int signum )
+{
+    dump_requested = 1;
+}
+
+
+typedef struct {
+    unsigned int accepted;
+    unsigned int rejected;
+    unsigned int failed;     // any other outcome, or timed out
+} Results_t;
+
+static bool is_final( pn_status_t status )
+{
+    return status != PN_STATUS_UNKNOWN && status != PN_STATUS_PENDING;
+}
+
+static void record_status( Results_t *results, pn_status_t status )
+{
+    switch (status) {
+    case PN_STATUS_ACCEPTED: results->accepted++; break;
+    case PN_STATUS_REJECTED: results->rejected++; break;
+    default:
+        LOG( "Unexpected outcome for transaction: %d\n", (int) status );
+        results->failed++;
+        break;
+    }
+}
+
+// Keep up to opts->depth transactions in flight.  Trackers are kept in
+// a ring in send order, and are retired from the head as soon as the
+// bank's disposition for them arrives, so the final status of every
+// transaction is checked.
+//
+static void run_pipelined( pn_messenger_t *messenger, pn_message_t *message,
+                           Options_t *opts, AccountPicker_t *picker,
+                           Trace_t *trace, Results_t *results )
+{
+    pn_tracker_t *ring = (pn_tracker_t *) calloc( opts->depth, sizeof(pn_tracker_t) );
+    uint64_t **traces = (uint64_t **) calloc( opts->depth, sizeof(uint64_t *) );
+    check( ring && traces, "Out of memory" );
+    unsigned int head = 0;
+    unsigned int in_flight = 0;
+    unsigned int sent = 0;
+    pn_timestamp_t last_progress = _now();
+    int rc;
+
+    while (sent < opts->count || in_flight) {
+
+        while (sent < opts->count && in_flight < opts->depth) {
+            if (picker)
+                build_transaction( message, picker_next( picker ), opts->transaction );
+            if (trace) {
+                uint64_t *t = TraceNext( trace );
+                t[STAGE_PUT] = stamp_put( message );
+                traces[(head + in_flight) % opts->depth] = t;
+            }
+            rc = pn_messenger_put( messenger, message );
+            check( rc == 0, "pn_messenger_put() failed" );
+            ring[(head + in_flight) % opts->depth] = pn_messenger_outgoing_tracker( messenger );
+            in_flight++;
+            sent++;
+        }
+
+        // push out the new transactions without blocking, unless the
+        // window is full (or all are sent) - then wait for outcomes
+        bool full = (in_flight == opts->depth || sent == opts->count);
+        rc = pn_messenger_work( messenger, full ? opts->timeout : 0 );
+        if (rc < 0 && rc != PN_TIMEOUT) check_messenger( messenger );
+
+        bool progress = false;
+        while (in_flight) {
+            pn_status_t status = pn_messenger_status( messenger, ring[head] );
+            if (!is_final( status )) break;
+            record_status( results, status );
+            if (trace) traces[head][STAGE_OBSERVED] = _now_usec();
+            pn_messenger_settle( messenger, ring[head], 0 );
+            head = (head + 1) % opts->depth;
+            in_flight--;
+            progress = true;
+        }
+
+        if (dump_requested) {
+            dump_requested = 0;
+            if (trace) TraceDump( trace, stdout );
+        }
+
+        if (progress) {
+            last_progress = _now();
+        } else if (full && opts->timeout >= 0
+                   && _now() - last_progress >= opts->timeout) {
+            LOG( "Timed out waiting for the bank, %u transactions outstanding\n", in_flight );
+            results->failed += in_flight + (opts->count - sent);
+            break;
+        }
+    }
+
+    free( ring );
+    free( traces );
+}
+
+
 
 int main(int argc, char** argv)
 {
@@ -106,7 +345,7 @@ int main(int argc, char** argv)
 
     parse_options( argc, argv, &opts );
 
-    pn_messenger_set_outgoing_window( messenger, 1 );
+    pn_messenger_set_outgoing_window( messenger, opts.depth );
     pn_messenger_set_timeout( messenger, opts.timeout );
 
     if (opts.gateway_addr) {
@@ -125,28 +364,64 @@ int main(int argc, char** argv)
     pn_message_set_delivery_count( request_msg, 0 );
     if (opts.ttl)
         pn_message_set_ttl( request_msg, opts.ttl * 1000 );
-    pn_data_t *body = pn_message_body( request_msg );
-    pn_data_clear( body );
-    rc = pn_data_put_int( body, opts.transaction );
-    check( rc == 0, "Failure to create request message" );
+    build_transaction( request_msg, opts.account, opts.transaction );
+
+    Trace_t *trace = NULL;
+    if (opts.trace) {
+        trace = TraceNew( STAGE_COUNT, stage_names, opts.trace );
+        signal( SIGUSR1, on_signal );
+    }
+
+    AccountPicker_t picker;
+    if (opts.accounts) {
+        picker_init( &picker, opts.accounts, opts.skew );
+        fprintf( stdout, "Using %u accounts, the busiest receives %.1f%% of transactions\n",
+                 opts.accounts, 100.0 * picker.cdf[0] );
+    }
 
     // and send it
     //
-    pn_status_t status = deliver_message( messenger, request_msg );
+    if (opts.count == 1 && opts.depth == 1) {
+        if (opts.accounts)
+            build_transaction( request_msg, picker_next( &picker ), opts.transaction );
+        uint64_t *t = trace ? TraceNext( trace ) : NULL;
+        if (t) t[STAGE_PUT] = stamp_put( request_msg );
+        pn_status_t status = deliver_message( messenger, request_msg );
+        if (t) t[STAGE_OBSERVED] = _now_usec();
 
-    if (status == PN_STATUS_ACCEPTED) {
-        fprintf( stdout, "%s of %d dollars succeeded!\n",
-                 opts.transaction < 0 ? "Widthdrawal" : "Deposit",
-                 opts.transaction );
+        if (status == PN_STATUS_ACCEPTED) {
+            fprintf( stdout, "%s of %d dollars succeeded!\n",
+                     opts.transaction < 0 ? "Widthdrawal" : "Deposit",
+                     opts.transaction );
+        } else {
+            fprintf( stdout, "%s of %d dollars FAILED!  Error code=%d\n",
+                     opts.transaction < 0 ? "Widthdrawal" : "Deposit",
+                     opts.transaction, (int) status );
+        }
     } else {
-        fprintf( stdout, "%s of %d dollars FAILED!  Error code=%d\n",
-                 opts.transaction < 0 ? "Widthdrawal" : "Deposit",
-                 opts.transaction, rc );
+        Results_t results;
+        memset( &results, 0, sizeof(results) );
+
+        pn_timestamp_t start = _now();
+        run_pipelined( messenger, request_msg, &opts,
+                       opts.accounts ? &picker : NULL, trace, &results );
+        double secs = (_now() - start) / 1000.0;
+
+        fprintf( stdout, "%u transactions of %d dollars: %u accepted, %u rejected, %u failed\n",
+                 opts.count, opts.transaction,
+                 results.accepted, results.rejected, results.failed );
+        fprintf( stdout, "Total time %f sec (%f tx/sec)\n",
+                 secs, secs > 0 ? opts.count / secs : 0.0 );
     }
 
     rc = pn_messenger_stop(messenger);
     check(rc == 0, "pn_messenger_stop() failed");
 
+    if (trace) {
+        TraceDump( trace, stdout );
+        TraceFree( trace );
+    }
+    if (opts.accounts) free( picker.cdf );
     pn_messenger_free(messenger);
     pn_message_free( request_msg );
 
@@ -0,0 +1,333 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "common.h"
+#include "ledger.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+typedef struct {
+    uint64_t id;       // hash table key
+    int32_t balance;
+} Account_t;
+
+typedef struct {
+    struct Ledger_s *ledger;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    bool stop;
+    GHashTable *accounts;
+    volatile size_t account_count;
+    // queued by the submitting thread, under the lock
+    LedgerTx_t **queue;
+    unsigned int queued;
+    unsigned int queue_size;
+    uint64_t submitted;     // total ever queued, only written by the submitter
+    // taken from the queue by the worker
+    LedgerTx_t **work;
+    unsigned int work_size;
+    uint64_t applied;       // total applied, under the ledger lock
+} Partition_t;
+
+typedef struct Ledger_s {
+    Partition_t *partitions;
+    unsigned int count;     // # of partitions
+    bool threaded;
+    int32_t opening_balance;
+    pthread_mutex_t lock;
+    pthread_cond_t done;    // a partition has applied more transactions
+    uint64_t tickets;       // batches submitted
+    // for each pending batch, the 'submitted' count of every partition
+    // once it was queued: the batch is applied when each partition's
+    // 'applied' count reaches it
+    uint64_t *marks;
+    unsigned int *route;    // partition of each transaction of a batch
+    unsigned int route_size;
+} Ledger_t;
+
+
+static unsigned int partition_of( Ledger_t *ledger, uint64_t account )
+{
+    // mix the bits so consecutive account ids spread across partitions
+    uint64_t h = account * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int) ((h >> 32) % ledger->count);
+}
+
+static Account_t *get_account( Partition_t *p, uint64_t id )
+{
+    Account_t *a = (Account_t *) g_hash_table_lookup( p->accounts, &id );
+    if (!a) {
+        a = (Account_t *) malloc( sizeof(Account_t) );
+        check( a, "Out of memory." );
+        a->id = id;
+        a->balance = p->ledger->opening_balance;
+        g_hash_table_insert( p->accounts, &a->id, a );
+        __sync_add_and_fetch( &p->account_count, 1 );
+    }
+    return a;
+}
+
+static void apply_transactions( Partition_t *p, LedgerTx_t **txs, unsigned int count )
+{
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        LedgerTx_t *tx = txs[i];
+        Account_t *a = get_account( p, tx->account );
+        if (tx->amount < 0 && -tx->amount > a->balance) {
+            tx->accepted = false;
+        } else {
+            a->balance += tx->amount;
+            tx->accepted = true;
+        }
+        tx->balance = a->balance;
+    }
+}
+
+static void applied( Partition_t *p, unsigned int count )
+{
+    Ledger_t *ledger = p->ledger;
+    pthread_mutex_lock( &ledger->lock );
+    p->applied += count;
+    pthread_cond_signal( &ledger->done );
+    pthread_mutex_unlock( &ledger->lock );
+}
+
+// Take whatever has been queued, possibly several batches, and apply it
+// without holding the lock, so the next batch can be queued meanwhile.
+//
+static void *partition_main( void *arg )
+{
+    Partition_t *p = (Partition_t *) arg;
+
+    for (;;) {
+        pthread_mutex_lock( &p->lock );
+        while (!p->queued && !p->stop)
+            pthread_cond_wait( &p->ready, &p->lock );
+        if (!p->queued) {
+            pthread_mutex_unlock( &p->lock );
+            break;
+        }
+        LedgerTx_t **work = p->queue;
+        unsigned int size = p->queue_size;
+        unsigned int count = p->queued;
+        p->queue = p->work;
+        p->queue_size = p->work_size;
+        p->queued = 0;
+        p->work = work;
+        p->work_size = size;
+        pthread_mutex_unlock( &p->lock );
+
+        apply_transactions( p, work, count );
+        applied( p, count );
+    }
+    return NULL;
+}
+
+
+Ledger_t *LedgerNew( unsigned int partitions, int32_t opening_balance )
+{
+    unsigned int i;
+    Ledger_t *ledger = (Ledger_t *) calloc( 1, sizeof(Ledger_t) );
+    check( ledger, "Out of memory." );
+
+    ledger->threaded = partitions > 0;
+    ledger->count = partitions ? partitions : 1;
+    ledger->opening_balance = opening_balance;
+    ledger->partitions = (Partition_t *) calloc( ledger->count, sizeof(Partition_t) );
+    ledger->marks = (uint64_t *) calloc( LEDGER_MAX_PENDING * ledger->count, sizeof(uint64_t) );
+    check( ledger->partitions && ledger->marks, "Out of memory." );
+    pthread_mutex_init( &ledger->lock, NULL );
+    pthread_cond_init( &ledger->done, NULL );
+
+    for (i = 0; i < ledger->count; ++i) {
+        Partition_t *p = &ledger->partitions[i];
+        p->ledger = ledger;
+        p->accounts = g_hash_table_new( g_int64_hash, g_int64_equal );
+        check( p->accounts, "Failed to initialize account table." );
+        pthread_mutex_init( &p->lock, NULL );
+        pthread_cond_init( &p->ready, NULL );
+        if (ledger->threaded) {
+            int rc = pthread_create( &p->thread, NULL, partition_main, p );
+            check( rc == 0, "Failed to start partition thread." );
+        }
+    }
+    return ledger;
+}
+
+void LedgerFree( Ledger_t *ledger )
+{
+    unsigned int i;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!ledger) return;
+    for (i = 0; i < ledger->count; ++i) {
+        Partition_t *p = &ledger->partitions[i];
+        if (ledger->threaded) {
+            // the worker applies anything still queued before it stops
+            pthread_mutex_lock( &p->lock );
+            p->stop = true;
+            pthread_cond_signal( &p->ready );
+            pthread_mutex_unlock( &p->lock );
+            pthread_join( p->thread, NULL );
+        }
+        g_hash_table_iter_init( &iter, p->accounts );
+        while (g_hash_table_iter_next( &iter, &key, &value )) {
+            g_hash_table_iter_remove( &iter );
+            free( value );
+        }
+        g_hash_table_unref( p->accounts );
+        pthread_mutex_destroy( &p->lock );
+        pthread_cond_destroy( &p->ready );
+        free( p->queue );
+        free( p->work );
+    }
+    pthread_mutex_destroy( &ledger->lock );
+    pthread_cond_destroy( &ledger->done );
+    free( ledger->marks );
+    free( ledger->route );
+    free( ledger->partitions );
+    free( ledger );
+}
+
+static void enqueue( Partition_t *p, LedgerTx_t *tx )
+{
+    if (p->queued == p->queue_size) {
+        p->queue_size = p->queue_size ? 2 * p->queue_size : 64;
+        p->queue = (LedgerTx_t **) realloc( p->queue, p->queue_size * sizeof(LedgerTx_t *) );
+        check( p->queue, "Out of memory." );
+    }
+    p->queue[p->queued++] = tx;
+}
+
+// Route the batch first, so each partition's lock is taken only once.
+// The worker swaps its queue out under the lock, so it may be applying
+// an earlier batch while this one is queued.
+//
+uint64_t LedgerSubmit( Ledger_t *ledger, LedgerTx_t *txs, unsigned int count )
+{
+    unsigned int i, j;
+    uint64_t ticket = ledger->tickets + 1;
+
+    // the marks of the oldest pending batch are about to be reused
+    if (ticket > LEDGER_MAX_PENDING)
+        LedgerWait( ledger, ticket - LEDGER_MAX_PENDING );
+
+    if (count > ledger->route_size) {
+        ledger->route_size = count;
+        ledger->route = (unsigned int *) realloc( ledger->route, count * sizeof(unsigned int) );
+        check( ledger->route, "Out of memory." );
+    }
+    for (i = 0; i < count; ++i)
+        ledger->route[i] = txs[i].valid ? partition_of( ledger, txs[i].account ) : ledger->count;
+
+    uint64_t *marks = &ledger->marks[((ticket - 1) % LEDGER_MAX_PENDING) * ledger->count];
+    for (j = 0; j < ledger->count; ++j) {
+        Partition_t *p = &ledger->partitions[j];
+        unsigned int before;
+        pthread_mutex_lock( &p->lock );
+        before = p->queued;
+        for (i = 0; i < count; ++i) {
+            if (ledger->route[i] == j) enqueue( p, &txs[i] );
+        }
+        p->submitted += p->queued - before;
+        if (p->queued > before) pthread_cond_signal( &p->ready );
+        pthread_mutex_unlock( &p->lock );
+        marks[j] = p->submitted;
+
+        if (!ledger->threaded && p->queued) {
+            apply_transactions( p, p->queue, p->queued );
+            applied( p, p->queued );
+            p->queued = 0;
+        }
+    }
+    ledger->tickets = ticket;
+    return ticket;
+}
+
+void LedgerWait( Ledger_t *ledger, uint64_t ticket )
+{
+    unsigned int i;
+
+    // older batches than those with marks have been waited for already
+    if (!ticket || ticket + LEDGER_MAX_PENDING <= ledger->tickets) return;
+    const uint64_t *marks = &ledger->marks[((ticket - 1) % LEDGER_MAX_PENDING) * ledger->count];
+
+    pthread_mutex_lock( &ledger->lock );
+    for (i = 0; i < ledger->count; ) {
+        if (ledger->partitions[i].applied < marks[i])
+            pthread_cond_wait( &ledger->done, &ledger->lock );
+        else
+            ++i;
+    }
+    pthread_mutex_unlock( &ledger->lock );
+}
+
+void LedgerApply( Ledger_t *ledger, LedgerTx_t *txs, unsigned int count )
+{
+    LedgerWait( ledger, LedgerSubmit( ledger, txs, count ) );
+}
+
+void LedgerSet( Ledger_t *ledger, uint64_t account, int32_t balance )
+{
+    get_account( &ledger->partitions[partition_of( ledger, account )], account )->balance = balance;
+}
+
+size_t LedgerAccounts( Ledger_t *ledger )
+{
+    size_t total = 0;
+    unsigned int i;
+    for (i = 0; i < ledger->count; ++i)
+        total += ledger->partitions[i].account_count;
+    return total;
+}
+
+void LedgerForEach( Ledger_t *ledger, LedgerVisitor_t *visitor, void *handle )
+{
+    unsigned int i;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    for (i = 0; i < ledger->count; ++i) {
+        g_hash_table_iter_init( &iter, ledger->partitions[i].accounts );
+        while (g_hash_table_iter_next( &iter, &key, &value )) {
+            Account_t *a = (Account_t *) value;
+            visitor( handle, a->id, a->balance );
+        }
+    }
+}
+
+unsigned int LedgerPartitions( Ledger_t *ledger )
+{
+    return ledger->count;
+}
+
+uint64_t LedgerPartitionTransactions( Ledger_t *ledger, unsigned int partition )
+{
+    uint64_t applied;
+    pthread_mutex_lock( &ledger->lock );
+    applied = ledger->partitions[partition].applied;
+    pthread_mutex_unlock( &ledger->lock );
+    return applied;
+}
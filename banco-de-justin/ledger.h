@@ -0,0 +1,82 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef BANK_LEDGER_H
+#define BANK_LEDGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A ledger of account balances, partitioned across worker threads.
+//
+// Each account is owned by exactly one partition (chosen by hashing
+// the account id), and each partition applies its transactions in the
+// order they were submitted, so the overdraft check is serializable
+// per account.  Transactions on accounts owned by different partitions
+// are applied in parallel.
+//
+// Submitting a batch does not wait for it to be applied: the caller
+// can go on receiving the next batch while the partitions work, and
+// only waits for a batch when it needs its results.  A single thread
+// must submit and wait.
+
+typedef struct Ledger_s Ledger_t;
+
+typedef struct {
+    uint64_t account;
+    int32_t amount;     // +deposit/-withdrawal
+    bool valid;         // false: skipped by the ledger (bad message)
+    bool accepted;      // set when applied
+    int32_t balance;    // set when applied: balance after the transaction
+} LedgerTx_t;
+
+typedef void LedgerVisitor_t( void *handle, uint64_t account, int32_t balance );
+
+// batches that may be submitted and not yet waited for
+#define LEDGER_MAX_PENDING 4
+
+// 'partitions' worker threads are started.  If zero, transactions are
+// applied by the thread submitting them.  New accounts are opened with
+// 'opening_balance'.
+Ledger_t *LedgerNew( unsigned int partitions, int32_t opening_balance );
+void LedgerFree( Ledger_t * );
+
+// Queue a batch of transactions to the partitions, returning a ticket
+// for LedgerWait().  The transactions must not be touched until then.
+// If LEDGER_MAX_PENDING batches are pending, waits for the oldest.
+uint64_t LedgerSubmit( Ledger_t *, LedgerTx_t *txs, unsigned int count );
+
+// Wait until the batch of 'ticket' (and all before it) has been applied.
+void LedgerWait( Ledger_t *, uint64_t ticket );
+
+// Apply a batch of transactions, returning once all have been applied.
+void LedgerApply( Ledger_t *, LedgerTx_t *txs, unsigned int count );
+
+// May be called at any time:
+size_t LedgerAccounts( Ledger_t * );
+unsigned int LedgerPartitions( Ledger_t * );
+uint64_t LedgerPartitionTransactions( Ledger_t *, unsigned int partition );
+
+// The following must not be called while a batch is pending:
+void LedgerSet( Ledger_t *, uint64_t account, int32_t balance );
+void LedgerForEach( Ledger_t *, LedgerVisitor_t *visitor, void *handle );
+
+#endif
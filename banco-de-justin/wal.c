@@ -0,0 +1,319 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include "common.h"
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// On disk formats (all integers in host byte order):
+//
+// log:       { uint32 length, uint32 crc32(data), data[length] }*
+// snapshot:  uint32 magic, uint32 length, uint32 crc32(data), data[length]
+//
+// A torn or corrupt record at the end of the log (crash during a
+// write) is discarded on recovery.
+
+#define WAL_SNAPSHOT_MAGIC 0x57414C53   // "WALS"
+#define WAL_HEADER_SIZE (2 * sizeof(uint32_t))
+
+typedef struct Wal_s {
+    int fd;
+    char *log_path;
+    char *snap_path;
+    char *tmp_path;
+    char *dir_path;
+    char *buffer;      // records appended since the last commit
+    size_t buffered;
+    size_t capacity;
+    uint32_t pending;  // # records in buffer
+    WalStats_t stats;
+} Wal_t;
+
+
+static uint32_t crc_table[256];
+
+static void crc32_init()
+{
+    uint32_t i, j, c;
+    for (i = 0; i < 256; ++i) {
+        c = i;
+        for (j = 0; j < 8; ++j)
+            c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32( const void *data, size_t length )
+{
+    const unsigned char *p = (const unsigned char *) data;
+    uint32_t c = 0xFFFFFFFFU;
+    if (!crc_table[1]) crc32_init();
+    while (length--)
+        c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFU;
+}
+
+
+static char *path_join( const char *dir, const char *name, const char *suffix )
+{
+    char *p = (char *) malloc( strlen(dir) + strlen(name) + strlen(suffix) + 2 );
+    check( p, "Out of memory." );
+    sprintf( p, "%s/%s%s", dir, name, suffix );
+    return p;
+}
+
+// write all of buf, retrying partial writes
+static int write_all( int fd, const char *buf, size_t length )
+{
+    while (length) {
+        ssize_t rc = write( fd, buf, length );
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += rc;
+        length -= rc;
+    }
+    return 0;
+}
+
+static void *read_file( const char *path, size_t *length )
+{
+    struct stat st;
+    char *data = NULL;
+    int fd = open( path, O_RDONLY );
+
+    *length = 0;
+    if (fd < 0) return NULL;
+    if (fstat( fd, &st ) == 0 && st.st_size > 0) {
+        data = (char *) malloc( st.st_size );
+        check( data, "Out of memory." );
+        if (read( fd, data, st.st_size ) == st.st_size) {
+            *length = st.st_size;
+        } else {
+            free( data );
+            data = NULL;
+        }
+    }
+    close( fd );
+    return data;
+}
+
+static void load_snapshot( Wal_t *wal, WalReplay_t *snapshot_cb, void *handle )
+{
+    size_t length;
+    uint32_t hdr[3];
+    char *data = (char *) read_file( wal->snap_path, &length );
+
+    if (!data) return;
+    if (length < sizeof(hdr)) {
+        DIE( __FILE__, __LINE__, "Snapshot %s truncated\n", wal->snap_path );
+    }
+    memcpy( hdr, data, sizeof(hdr) );
+    if (hdr[0] != WAL_SNAPSHOT_MAGIC || hdr[1] != length - sizeof(hdr)
+        || hdr[2] != crc32( data + sizeof(hdr), hdr[1] )) {
+        // the snapshot is replaced via rename(), so it is never
+        // partially written - this is real corruption
+        DIE( __FILE__, __LINE__, "Snapshot %s is corrupt\n", wal->snap_path );
+    }
+    LOG( "Loading snapshot %s (%u bytes)\n", wal->snap_path, hdr[1] );
+    if (snapshot_cb) snapshot_cb( handle, data + sizeof(hdr), hdr[1] );
+    free( data );
+}
+
+// returns the offset of the end of the last intact record
+static size_t replay_log( Wal_t *wal, WalReplay_t *record_cb, void *handle )
+{
+    size_t length;
+    size_t offset = 0;
+    uint32_t hdr[2];
+    char *data = (char *) read_file( wal->log_path, &length );
+
+    if (!data) return 0;
+    while (offset + WAL_HEADER_SIZE <= length) {
+        memcpy( hdr, data + offset, WAL_HEADER_SIZE );
+        if (hdr[0] > length - offset - WAL_HEADER_SIZE
+            || hdr[1] != crc32( data + offset + WAL_HEADER_SIZE, hdr[0] )) {
+            break;
+        }
+        if (record_cb) record_cb( handle, data + offset + WAL_HEADER_SIZE, hdr[0] );
+        offset += WAL_HEADER_SIZE + hdr[0];
+        wal->stats.records_since_snapshot++;
+    }
+    if (offset != length) {
+        LOG( "Discarding %lu bytes of incomplete log data\n",
+             (unsigned long) (length - offset) );
+    }
+    free( data );
+    return offset;
+}
+
+static int sync_directory( Wal_t *wal )
+{
+    int rc;
+    int fd = open( wal->dir_path, O_RDONLY );
+    if (fd < 0) return -1;
+    rc = fsync( fd );
+    close( fd );
+    return rc;
+}
+
+
+Wal_t *WalOpen( const char *directory, const char *name,
+                WalReplay_t *snapshot_cb, WalReplay_t *record_cb,
+                void *handle )
+{
+    Wal_t *wal = (Wal_t *) calloc( 1, sizeof(Wal_t) );
+    check( wal, "Out of memory." );
+
+    wal->dir_path = _strdup( directory );
+    wal->log_path = path_join( directory, name, ".wal" );
+    wal->snap_path = path_join( directory, name, ".snap" );
+    wal->tmp_path = path_join( directory, name, ".snap.tmp" );
+    check( wal->dir_path, "Out of memory." );
+
+    if (mkdir( directory, 0755 ) && errno != EEXIST) {
+        WalClose( wal );
+        return NULL;
+    }
+
+    load_snapshot( wal, snapshot_cb, handle );
+    size_t good = replay_log( wal, record_cb, handle );
+
+    wal->fd = open( wal->log_path, O_WRONLY | O_CREAT, 0644 );
+    if (wal->fd < 0 || ftruncate( wal->fd, good )
+        || lseek( wal->fd, good, SEEK_SET ) < 0) {
+        WalClose( wal );
+        return NULL;
+    }
+    return wal;
+}
+
+void WalClose( Wal_t *wal )
+{
+    if (wal) {
+        if (wal->pending) WalCommit( wal );
+        if (wal->fd > 0) close( wal->fd );
+        free( wal->buffer );
+        free( wal->log_path );
+        free( wal->snap_path );
+        free( wal->tmp_path );
+        free( wal->dir_path );
+        free( wal );
+    }
+}
+
+int WalAppend( Wal_t *wal, const void *record, size_t length )
+{
+    uint32_t hdr[2];
+    size_t need = wal->buffered + WAL_HEADER_SIZE + length;
+
+    if (need > wal->capacity) {
+        size_t capacity = wal->capacity ? wal->capacity : 4096;
+        while (capacity < need) capacity *= 2;
+        wal->buffer = (char *) realloc( wal->buffer, capacity );
+        check( wal->buffer, "Out of memory." );
+        wal->capacity = capacity;
+    }
+    hdr[0] = (uint32_t) length;
+    hdr[1] = crc32( record, length );
+    memcpy( wal->buffer + wal->buffered, hdr, WAL_HEADER_SIZE );
+    memcpy( wal->buffer + wal->buffered + WAL_HEADER_SIZE, record, length );
+    wal->buffered = need;
+    wal->pending++;
+    return 0;
+}
+
+// write all buffered records and wait for them to reach the disk.  On
+// return, every record passed to WalAppend() is durable.
+//
+int WalCommit( Wal_t *wal )
+{
+    if (!wal->pending) return 0;
+
+    uint64_t start = _now_usec();
+    if (write_all( wal->fd, wal->buffer, wal->buffered ) || fdatasync( wal->fd ))
+        return -1;
+    uint64_t elapsed = _now_usec() - start;
+
+    wal->stats.commits++;
+    wal->stats.records += wal->pending;
+    wal->stats.records_since_snapshot += wal->pending;
+    wal->stats.bytes += wal->buffered;
+    wal->stats.sync_usec_total += elapsed;
+    if (elapsed > wal->stats.sync_usec_max) wal->stats.sync_usec_max = elapsed;
+
+    wal->buffered = 0;
+    wal->pending = 0;
+    return 0;
+}
+
+// Replace the snapshot with 'data', then empty the log.  Any records
+// not yet committed are committed first, so 'data' must reflect them.
+//
+int WalSnapshot( Wal_t *wal, const void *data, size_t length )
+{
+    uint32_t hdr[3];
+    int fd;
+
+    if (WalCommit( wal )) return -1;
+
+    fd = open( wal->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if (fd < 0) return -1;
+    hdr[0] = WAL_SNAPSHOT_MAGIC;
+    hdr[1] = (uint32_t) length;
+    hdr[2] = crc32( data, length );
+    if (write_all( fd, (const char *) hdr, sizeof(hdr) )
+        || write_all( fd, (const char *) data, length )
+        || fsync( fd )) {
+        close( fd );
+        return -1;
+    }
+    close( fd );
+
+    if (rename( wal->tmp_path, wal->snap_path ) || sync_directory( wal ))
+        return -1;
+
+    // the snapshot now covers everything in the log.  Should we crash
+    // before the truncate is durable, the old records are replayed on
+    // top of the snapshot - the application must tolerate that.
+    if (ftruncate( wal->fd, 0 ) || lseek( wal->fd, 0, SEEK_SET ) < 0
+        || fdatasync( wal->fd ))
+        return -1;
+
+    wal->stats.snapshots++;
+    wal->stats.records_since_snapshot = 0;
+    return 0;
+}
+
+const WalStats_t *WalGetStats( Wal_t *wal )
+{
+    return &wal->stats;
+}
@@ -0,0 +1,62 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef BANK_WAL_H
+#define BANK_WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// An append-only write-ahead log with group commit.
+//
+// Records are buffered by WalAppend() and made durable together by a
+// single write() and fdatasync() in WalCommit().  WalSnapshot()
+// atomically replaces the snapshot file and empties the log, which
+// bounds recovery time.  Record and snapshot contents are opaque to
+// the log - the application defines them.
+
+typedef struct Wal_s Wal_t;
+
+// invoked during WalOpen() with the contents of the snapshot (if
+// present) and then once for each intact record in the log
+typedef void WalReplay_t( void *handle, const void *data, size_t length );
+
+typedef struct {
+    uint64_t commits;          // number of WalCommit() that synced data
+    uint64_t records;          // records made durable
+    uint64_t bytes;            // bytes written to the log
+    uint64_t sync_usec_total;  // time spent in write+fdatasync
+    uint64_t sync_usec_max;
+    uint64_t snapshots;
+    uint64_t records_since_snapshot;
+} WalStats_t;
+
+Wal_t *WalOpen( const char *directory, const char *name,
+                WalReplay_t *snapshot_cb, WalReplay_t *record_cb,
+                void *handle );
+void WalClose( Wal_t * );
+
+int WalAppend( Wal_t *, const void *record, size_t length );
+int WalCommit( Wal_t * );
+int WalSnapshot( Wal_t *, const void *data, size_t length );
+
+const WalStats_t *WalGetStats( Wal_t * );
+
+#endif
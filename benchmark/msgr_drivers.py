@@ -0,0 +1,415 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+
+"""
+Drivers run the client programs of a benchmark scenario.
+
+A driver knows how to build sender and receiver processes for a
+scenario and how to extract the results from their output.  All the
+drivers produce the same results, so a scenario may be run against any
+implementation:
+
+  messenger - msgr-send/msgr-recv from a Proton source tree, driven via
+              the proton_tests package.
+  perf      - perf-send/perf-recv from this repository, built against an
+              installed Proton.
+  command   - any pair of programs that print a RESULT line (see below),
+              given as command line templates.
+
+The RESULT line is a single line of output of the form:
+
+  RESULT key=value key=value ...
+
+The keys used are 'throughput' (messages/second), 'latency' (average
+latency in seconds) and the latency percentiles 'latency_p50',
+'latency_p90', 'latency_p99' and 'latency_max' (seconds).  Other keys are
+ignored.  Programs that cannot measure latency simply leave these out.
+"""
+
+import os, os.path, re, shlex, socket, subprocess, tempfile, threading, time
+import msgr_resources
+
+
+def free_tcp_ports(count=1):
+    """Return a list of 'count' currently unused TCP ports.
+    """
+    sockets = []
+    ports = []
+    try:
+        for i in range(count):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            s.bind(("0.0.0.0", 0))
+            sockets.append(s)
+            ports.append(s.getsockname()[1])
+    finally:
+        for s in sockets:
+            s.close()
+    return ports
+
+
+def parse_result_line(output):
+    """Parse the last RESULT line in 'output' into a dict.  Numeric values
+    are converted to float.
+    """
+    lines = re.findall(r"^RESULT\s+(.*)$", output, re.MULTILINE)
+    if not lines:
+        raise ValueError("No RESULT line found in output:\n%s" % output)
+    result = {}
+    for field in lines[-1].split():
+        key, _, value = field.partition("=")
+        try:
+            result[key] = float(value)
+        except ValueError:
+            result[key] = value
+    return result
+
+
+class Process(object):
+    """A client program run by a driver.  Provides the same interface as
+    the proton_tests MessengerApp classes, plus the process id ('pid') and
+    the resource usage of the finished process ('usage').
+    """
+    def __init__(self, cmd, timeout=0, ready=None):
+        self.cmd = cmd
+        self.timeout = timeout
+        self.ready = ready
+        self._process = None
+        self._output = None
+        self._timer = None
+        self._timed_out = False
+        self.usage = None
+
+    @property
+    def pid(self):
+        return self._process.pid if self._process else None
+
+    def cmdline(self):
+        return self.cmd
+
+    def start(self, verbose=False):
+        if verbose: print("Starting '%s'" % " ".join(self.cmd))
+        self._output = tempfile.TemporaryFile()
+        self._timed_out = False
+        self.usage = None
+        self._process = subprocess.Popen(self.cmd, stdout=self._output,
+                                         stderr=subprocess.STDOUT)
+        if self.timeout:
+            self._timer = threading.Timer(self.timeout, self._kill)
+            self._timer.daemon = True
+            self._timer.start()
+        if self.ready:
+            # wait until the program is ready to accept connections
+            deadline = time.time() + (self.timeout or 60)
+            while self.ready not in self.stdout():
+                if self._process.poll() is not None or time.time() > deadline:
+                    raise RuntimeError("'%s' failed to start:\n%s" %
+                                       (" ".join(self.cmd), self.stdout()))
+                time.sleep(0.01)
+
+    def _kill(self):
+        self._timed_out = True
+        try:
+            self._process.kill()
+        except OSError:
+            pass
+
+    def wait(self):
+        if self._process.returncode is None:
+            # reap it here to get its exact resource usage
+            self._process.returncode, self.usage = \
+                msgr_resources.wait_usage(self._process.pid)
+        if self._timer:
+            self._timer.cancel()
+            self._timer.join()
+            self._timer = None
+
+    def status(self):
+        if self._timed_out:
+            return "timed out"
+        return self._process.returncode
+
+    def stdout(self):
+        self._output.seek(0)
+        return self._output.read().decode("utf-8", "replace")
+
+
+# RESULT line keys of the latency percentiles, and their metric names
+PERCENTILES = [("latency_p50", "P50"), ("latency_p90", "P90"),
+               ("latency_p99", "P99"), ("latency_max", "PMAX")]
+
+
+class Driver(object):
+    """Base class of all drivers.
+    """
+    name = None
+    program = None      # sender program, used to fingerprint the build
+    rate_limit = False  # True if senders can be limited to a given rate
+
+    def supports(self, scenario):
+        """Return None if the scenario can be run by this driver, else the
+        reason why not.
+        """
+        return None
+
+    def receiver(self, scenario, subscriptions, receive_count, timeout):
+        raise NotImplementedError()
+
+    def sender(self, scenario, targets, send_count, timeout, rate=None):
+        """Create a sender.  If 'rate' is given, the sender is limited to
+        that many messages per second (only if rate_limit is True).
+        """
+        raise NotImplementedError()
+
+    def result(self, app):
+        """Return (latency, throughput) of a finished sender or receiver.
+        Latency is in seconds, or None if not measured.
+        """
+        raise NotImplementedError()
+
+    def percentiles(self, app):
+        """Return the latency percentiles measured by a finished sender or
+        receiver as a map of metric name (see PERCENTILES) to seconds.
+        Empty if not measured.
+        """
+        return {}
+
+
+class MessengerApp(object):
+    """Wraps a proton_tests MessengerApp, adding the 'pid' and 'usage' of
+    the Process interface.  The app reads the program's output when it
+    waits for it, so cannot be reaped with wait4(): its usage is that of
+    the children reaped during the wait.
+    """
+    def __init__(self, app):
+        self.app = app
+        self.usage = None
+
+    @property
+    def pid(self):
+        return self.app._process.pid if self.app._process else None
+
+    def cmdline(self):
+        return self.app.cmdline()
+
+    def start(self, verbose=False):
+        self.usage = None
+        self.app.start(verbose)
+
+    def wait(self):
+        self.usage = msgr_resources.wait_child_usage(self.app.wait)
+
+    def status(self):
+        return self.app.status()
+
+    def stdout(self):
+        return self.app.stdout()
+
+
+class MessengerDriver(Driver):
+    """Drives msgr-send and msgr-recv from the Proton source tree.
+    """
+    name = "messenger"
+    program = "msgr-send"
+
+    def __init__(self):
+        # only available when run from a Proton source tree
+        from proton_tests.common import MessengerSenderC, MessengerReceiverC
+        self._sender = MessengerSenderC
+        self._receiver = MessengerReceiverC
+
+    def receiver(self, scenario, subscriptions, receive_count, timeout):
+        receiver = self._receiver()
+        receiver.subscriptions = subscriptions
+        receiver.receive_count = receive_count
+        receiver.send_reply = scenario.reply
+        receiver.timeout = timeout
+        receiver.recv_count = scenario.recv_batch
+        if scenario.settlement == "explicit":
+            receiver.incoming_window = scenario.recv_batch
+        return MessengerApp(receiver)
+
+    def sender(self, scenario, targets, send_count, timeout, rate=None):
+        sender = self._sender()
+        sender.targets = targets
+        sender.send_count = send_count
+        sender.get_reply = scenario.reply
+        sender.send_batch = scenario.send_batch
+        sender.msg_size = scenario.size
+        sender.timeout = timeout
+        if scenario.settlement == "explicit":
+            sender.outgoing_window = scenario.send_batch
+        return MessengerApp(sender)
+
+    def result(self, app):
+        return parse_msgr_output(app.stdout())
+
+
+def parse_msgr_output( output ):
+    """
+    Parses the output from the msgr-send/msgr-receive tools, extracting the
+    throughput and average latency values.
+    Expects output to be in the following pattern:
+        Messages sent: %d recv: %d\n
+        Total time: %f sec\n
+        Throughput: %f msgs/sec\n
+        Latency (sec): %f min %f max %f avg\n
+    Extracts the values for throughput and average latency, and returns them as
+    floats in a tuple of the form (<average_latency>, <throughput>).
+    """
+    regexp_float = "([-+]?\d+\.\d*)?"
+    regexp_throughput = "^Throughput: %s msgs/sec" % regexp_float
+    regexp_latency = "^Latency \(sec\): %s min %s max %s avg" % (regexp_float,
+                                                                 regexp_float,
+                                                                 regexp_float)
+    try:
+        l = re.search( regexp_latency, output, re.MULTILINE )
+        t = re.search( regexp_throughput, output, re.MULTILINE )
+        return (float(l.groups()[2]), float(t.groups()[0]))
+    except:
+        print( "Unable to parse output from msgr-send/msgr-recv!\n"
+               "  Has the format of the output changed???" )
+        raise
+
+
+class CommandDriver(Driver):
+    """Runs arbitrary sender and receiver programs, given as command line
+    templates.  The templates are expanded with str.format(), using the
+    scenario parameters (e.g. {size}, {send_batch}, {settlement}) and:
+
+      {targets}        - the sender's target addresses, space separated
+      {subscriptions}  - the receiver's listen addresses, space separated
+      {count}          - messages to send (sender) or receive (receiver)
+      {timeout}        - the test timeout in seconds
+      {rate}           - the sender's rate limit in msgs/sec, 0 if none
+
+    Both programs must print a RESULT line.  The receiver template may
+    include a {ready} argument: its value is printed by the program once
+    it is listening, and the driver waits for it before starting senders.
+    """
+    name = "command"
+
+    READY = "RECEIVER-READY"
+
+    def __init__(self, sender_cmd, receiver_cmd):
+        self.sender_cmd = sender_cmd
+        self.receiver_cmd = receiver_cmd
+        self.program = shlex.split(sender_cmd)[0]
+        self.rate_limit = "{rate}" in sender_cmd
+
+    def _expand(self, template, scenario, **kw):
+        values = dict(scenario.params)
+        values.update(kw)
+        values["ready"] = self.READY
+        return shlex.split(template.format(**values))
+
+    def receiver(self, scenario, subscriptions, receive_count, timeout):
+        cmd = self._expand(self.receiver_cmd, scenario,
+                           subscriptions=" ".join(subscriptions),
+                           count=receive_count, timeout=timeout)
+        ready = self.READY if "{ready}" in self.receiver_cmd else None
+        return Process(cmd, timeout, ready)
+
+    def sender(self, scenario, targets, send_count, timeout, rate=None):
+        cmd = self._expand(self.sender_cmd, scenario, targets=" ".join(targets),
+                           count=send_count, timeout=timeout, rate=rate or 0)
+        return Process(cmd, timeout)
+
+    def result(self, app):
+        r = parse_result_line(app.stdout())
+        if "throughput" not in r:
+            raise ValueError("RESULT line of '%s' has no throughput" %
+                             " ".join(app.cmdline()))
+        return (r.get("latency"), r["throughput"])
+
+    def percentiles(self, app):
+        r = parse_result_line(app.stdout())
+        return dict((metric, r[key]) for key, metric in PERCENTILES if key in r)
+
+
+class PerfDriver(CommandDriver):
+    """Drives perf-send and perf-recv from this repository.  These do not
+    support replies.  Latency is measured by the receiver, so senders and
+    receivers must share a clock (i.e. run on the same host).
+    """
+    name = "perf"
+
+    def __init__(self, bindir=None):
+        send = os.path.join(bindir, "perf-send") if bindir else "perf-send"
+        recv = os.path.join(bindir, "perf-recv") if bindir else "perf-recv"
+        CommandDriver.__init__(self, send, recv)
+        self.rate_limit = True
+
+    def supports(self, scenario):
+        if scenario.reply:
+            return "perf-send/perf-recv do not support replies"
+        return None
+
+    def receiver(self, scenario, subscriptions, receive_count, timeout):
+        cmd = [self.receiver_cmd, "-c", str(receive_count),
+               "-r", str(scenario.recv_batch), "-X", self.READY]
+        for s in subscriptions:
+            cmd.extend(["-a", s])
+        if scenario.settlement == "explicit":
+            cmd.extend(["-w", str(scenario.recv_batch)])
+        return Process(cmd, timeout, self.READY)
+
+    def sender(self, scenario, targets, send_count, timeout, rate=None):
+        cmd = [self.sender_cmd, "-c", str(send_count), "-s", str(scenario.size),
+               "-b", str(scenario.send_batch)]
+        for t in targets:
+            cmd.extend(["-a", t])
+        if scenario.settlement == "explicit":
+            cmd.extend(["-w", str(scenario.send_batch)])
+        if rate:
+            cmd.extend(["-r", str(rate)])
+        return Process(cmd, timeout)
+
+
+DRIVERS = ["messenger", "perf", "command"]
+
+
+def create(name, bindir=None, sender_cmd=None, receiver_cmd=None):
+    """Create the driver called 'name'.
+    """
+    if name == "messenger":
+        return MessengerDriver()
+    if name == "perf":
+        return PerfDriver(bindir)
+    if name == "command":
+        if not (sender_cmd and receiver_cmd):
+            raise ValueError("the command driver requires sender and receiver commands")
+        return CommandDriver(sender_cmd, receiver_cmd)
+    raise ValueError("unknown driver '%s' (one of %s)" % (name, ", ".join(DRIVERS)))
+
+
+__all__ = [
+    "DRIVERS",
+    "PERCENTILES",
+    "Driver",
+    "MessengerApp",
+    "MessengerDriver",
+    "CommandDriver",
+    "PerfDriver",
+    "Process",
+    "create",
+    "free_tcp_ports",
+    "parse_msgr_output",
+    "parse_result_line"
+    ]
@@ -0,0 +1,237 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+
+"""
+Resource usage of the benchmark client processes.
+
+CPU user and system time and voluntary and involuntary context switches
+are exact: they are taken from the rusage of each client process when it
+is reaped (see wait_usage() and wait_child_usage()).  The peak resident
+set size and the read/write system calls are sampled from /proc by a
+background thread while the test runs, using the last sample taken before
+the process exits, so read/write calls made during the final sampling
+interval may be missed.  (The ru_maxrss of a child also counts the memory
+of the parent it was forked from, so it cannot be used for the peak RSS.)
+
+If the usage of a process is known neither from its rusage nor from
+/proc, the usage of all children, as reported by
+getrusage(RUSAGE_CHILDREN), is used instead.  This gives the totals for
+the whole test but not the per-process break down.
+"""
+
+import os, resource, threading, time
+
+try:
+    _CLK_TCK = float(os.sysconf("SC_CLK_TCK"))
+except (ValueError, OSError, AttributeError):
+    _CLK_TCK = 100.0
+
+
+class Usage(object):
+    """Resource usage of one process, or the sum over several.  Values
+    that could not be obtained are None.
+    """
+    FIELDS = ("utime", "stime", "max_rss", "vol_ctxt", "invol_ctxt", "rw_calls")
+
+    def __init__(self, **kw):
+        for f in self.FIELDS:
+            setattr(self, f, kw.get(f))
+
+    @property
+    def cpu(self):
+        """Total CPU seconds (user + system)."""
+        if self.utime is None or self.stime is None:
+            return None
+        return self.utime + self.stime
+
+    def __add__(self, other):
+        total = Usage()
+        for f in self.FIELDS:
+            a, b = getattr(self, f), getattr(other, f)
+            if a is not None and b is not None:
+                setattr(total, f, a + b)
+        return total
+
+    def __repr__(self):
+        return "Usage(%s)" % ", ".join("%s=%r" % (f, getattr(self, f))
+                                       for f in self.FIELDS)
+
+
+def _read(path):
+    with open(path) as f:
+        return f.read()
+
+
+def sample_proc(pid):
+    """Sample the resource usage of process 'pid' from /proc.  Returns
+    None if the process no longer exists or /proc is not available.
+    """
+    base = "/proc/%d/" % pid
+    try:
+        stat = _read(base + "stat")
+        status = _read(base + "status")
+    except (IOError, OSError):
+        return None
+
+    # the command name may contain spaces: fields start after the last ')'
+    fields = stat[stat.rfind(")") + 2:].split()
+    usage = Usage(utime=int(fields[11]) / _CLK_TCK,
+                  stime=int(fields[12]) / _CLK_TCK)
+    for line in status.splitlines():
+        key, _, value = line.partition(":")
+        if key == "VmHWM":
+            usage.max_rss = int(value.split()[0]) * 1024
+        elif key == "voluntary_ctxt_switches":
+            usage.vol_ctxt = int(value)
+        elif key == "nonvoluntary_ctxt_switches":
+            usage.invol_ctxt = int(value)
+    if usage.max_rss is None:
+        # zombie - the memory has already been released
+        return None
+
+    try:
+        rw_calls = 0
+        for line in _read(base + "io").splitlines():
+            key, _, value = line.partition(":")
+            if key in ("syscr", "syscw"):
+                rw_calls += int(value)
+        usage.rw_calls = rw_calls
+    except (IOError, OSError):
+        pass    # not permitted, or kernel built without task I/O accounting
+    return usage
+
+
+def _rusage(r):
+    # ru_maxrss is in kilobytes on Linux
+    return Usage(utime=r.ru_utime, stime=r.ru_stime, max_rss=r.ru_maxrss * 1024,
+                 vol_ctxt=r.ru_nvcsw, invol_ctxt=r.ru_nivcsw)
+
+
+def _children_usage():
+    return _rusage(resource.getrusage(resource.RUSAGE_CHILDREN))
+
+
+def wait_usage(pid):
+    """Wait for the child process 'pid' to exit and reap it.  Returns its
+    exit status, encoded as for Popen.returncode, and its exact Usage as
+    reported by wait4(), without the peak RSS and read/write calls.
+    """
+    _, status, r = os.wait4(pid, 0)
+    if os.WIFSIGNALED(status):
+        code = -os.WTERMSIG(status)
+    else:
+        code = os.WEXITSTATUS(status)
+    usage = _rusage(r)
+    usage.max_rss = None
+    return code, usage
+
+
+def wait_child_usage(wait):
+    """Call 'wait' to reap a single child process whose wait cannot be
+    replaced by wait_usage(), and return the Usage of that child: the
+    change in getrusage(RUSAGE_CHILDREN) over the call, without the peak
+    RSS and read/write calls.  Only exact if no other child is reaped at
+    the same time.
+    """
+    before = _children_usage()
+    wait()
+    after = _children_usage()
+    usage = Usage()
+    for f in ("utime", "stime", "vol_ctxt", "invol_ctxt"):
+        setattr(usage, f, getattr(after, f) - getattr(before, f))
+    return usage
+
+
+def _merge(exact, sampled):
+    if exact is None or sampled is None:
+        return exact or sampled
+    usage = Usage()
+    for f in Usage.FIELDS:
+        value = getattr(exact, f)
+        setattr(usage, f, getattr(sampled, f) if value is None else value)
+    return usage
+
+
+class Monitor(object):
+    """Samples the resource usage of a set of processes until stopped.
+    """
+    def __init__(self, pids, interval=0.05):
+        self.pids = list(pids)
+        self.interval = interval
+        self.usage = dict((pid, None) for pid in self.pids)
+        self._stopped = threading.Event()
+        self._thread = threading.Thread(target=self._run)
+        self._thread.daemon = True
+        self._children = None
+
+    def start(self):
+        self._children = _children_usage()
+        self._thread.start()
+        return self
+
+    def _sample(self):
+        for pid in self.pids:
+            u = sample_proc(pid)
+            if u is not None:
+                self.usage[pid] = u
+
+    def _run(self):
+        while not self._stopped.is_set():
+            self._sample()
+            self._stopped.wait(self.interval)
+
+    def stop(self, exact=None):
+        """Stop sampling.  Must be called after the processes have been
+        waited for.  'exact' maps pids to the Usage obtained when reaping
+        them (see wait_usage()); its values replace the sampled ones.
+        Returns the total usage of all processes.
+        """
+        self._stopped.set()
+        self._thread.join()
+        exact = exact or {}
+        usage = []
+        for pid in self.pids:
+            u = _merge(exact.get(pid), self.usage[pid])
+            if u is None or u.cpu is None:
+                break
+            usage.append(u)
+        else:
+            total = Usage(utime=0.0, stime=0.0, max_rss=0, vol_ctxt=0,
+                          invol_ctxt=0, rw_calls=0)
+            for u in usage:
+                total = total + u
+            return total
+
+        # fall back to the usage of all (reaped) children:
+        after = _children_usage()
+        total = Usage()
+        for f in ("utime", "stime", "vol_ctxt", "invol_ctxt"):
+            setattr(total, f, getattr(after, f) - getattr(self._children, f))
+        total.max_rss = after.max_rss   # largest of any child, ever
+        return total
+
+
+__all__ = [
+    "Usage",
+    "Monitor",
+    "sample_proc",
+    "wait_child_usage",
+    "wait_usage"
+    ]
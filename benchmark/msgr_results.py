@@ -0,0 +1,349 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+
+"""
+Append-only store of benchmark results.
+
+Results are kept as JSON lines in '<db>/results.jsonl', one record per
+test per benchmark run:
+
+  {"label": ..., "test": ..., "timestamp": ...,
+   "params": {scenario parameters},
+   "env": {host, kernel, cpu, build type, commit, ...},
+   "metrics": {"T": {"samples": [...], "n": ..., "min": ..., "mean": ...,
+                     "p50": ..., "p90": ..., "p99": ..., "max": ...},
+               "AL": {...}, ...}}
+
+Records are never rewritten.  A companion index, '<db>/results.idx',
+holds one JSON array per record, [offset, length, label, test], so a
+query for a label reads only the records it needs rather than parsing
+the whole store.  The index is brought up to date automatically if it
+is missing or behind the store.
+"""
+
+import csv, glob, json, os, os.path, platform, re, socket, subprocess, time
+import msgr_stats
+
+try:
+    import fcntl
+except ImportError:
+    fcntl = None
+
+STORE = "results.jsonl"
+INDEX = "results.idx"
+
+_NOW = object()
+
+
+def summarize( samples ):
+    """Return the summary statistics of a list of samples, with the
+    samples themselves.
+    """
+    return {"samples": list(samples),
+            "n": len(samples),
+            "min": min(samples),
+            "mean": msgr_stats.mean(samples),
+            "p50": msgr_stats.percentile(samples, 50),
+            "p90": msgr_stats.percentile(samples, 90),
+            "p99": msgr_stats.percentile(samples, 99),
+            "max": max(samples)}
+
+
+def _run( cmd, cwd=None ):
+    try:
+        p = subprocess.Popen( cmd, cwd=cwd, stdout=subprocess.PIPE,
+                              stderr=subprocess.PIPE )
+        out = p.communicate()[0]
+        if p.returncode == 0:
+            return out.decode("utf-8", "replace").strip()
+    except OSError:
+        pass
+    return None
+
+
+def _which( program ):
+    if os.path.dirname(program):
+        return os.path.realpath(program) if os.path.isfile(program) else None
+    for d in os.environ.get("PATH", "").split(os.pathsep):
+        path = os.path.join(d, program)
+        if os.path.isfile(path) and os.access(path, os.X_OK):
+            return os.path.realpath(path)
+    return None
+
+
+def _cmake_cache( path ):
+    """Find the CMakeCache.txt of the build tree containing 'path', and
+    return its (build type, source directory).
+    """
+    d = os.path.dirname(path)
+    while d and d != os.path.dirname(d):
+        cache = os.path.join(d, "CMakeCache.txt")
+        if os.path.isfile(cache):
+            build_type = source = None
+            with open(cache) as f:
+                for line in f:
+                    if line.startswith("CMAKE_BUILD_TYPE:"):
+                        build_type = line.split("=", 1)[1].strip() or None
+                    elif line.startswith("CMAKE_HOME_DIRECTORY:"):
+                        source = line.split("=", 1)[1].strip() or None
+            return build_type, source
+        d = os.path.dirname(d)
+    return None, None
+
+
+def environment( program="msgr-send" ):
+    """
+    Fingerprint the environment the benchmark runs in.  The build type
+    and commit are taken from the build tree of 'program' as found on the
+    PATH, if it was built with cmake from a git checkout.
+    """
+    uname = os.uname()
+    env = {"host": socket.gethostname(),
+           "kernel": "%s %s" % (uname[2], uname[4]),
+           "python": platform.python_version(),
+           "cpu": None,
+           "cpus": None,
+           "program": _which(program),
+           "build_type": None,
+           "commit": None}
+    try:
+        import multiprocessing
+        env["cpus"] = multiprocessing.cpu_count()
+    except (ImportError, NotImplementedError):
+        pass
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    env["cpu"] = line.split(":", 1)[1].strip()
+                    break
+    except IOError:
+        env["cpu"] = platform.processor() or None
+    if env["program"]:
+        env["build_type"], source = _cmake_cache(env["program"])
+        if source:
+            env["commit"] = _run(["git", "rev-parse", "HEAD"], cwd=source)
+    return env
+
+
+class ResultStore(object):
+    """The result store of the benchmark database in directory 'db'.
+    """
+    def __init__(self, db):
+        self.db = db
+        self.store_path = os.path.join(db, STORE)
+        self.index_path = os.path.join(db, INDEX)
+        self._index = None
+
+    def _lock(self, f):
+        if fcntl:
+            fcntl.flock(f.fileno(), fcntl.LOCK_EX)
+
+    def _load_index(self):
+        """Returns the index entries, and False if the index ends in a
+        torn write.
+        """
+        entries = []
+        if os.path.exists(self.index_path):
+            with open(self.index_path) as f:
+                for line in f:
+                    try:
+                        entries.append(tuple(json.loads(line)))
+                    except ValueError:
+                        return entries, False
+        return entries, True
+
+    def _unindexed(self, entries):
+        """Index the complete records of the store after 'entries'.
+        """
+        end = 0
+        if entries:
+            end = entries[-1][0] + entries[-1][1]
+        missing = []
+        if os.path.exists(self.store_path):
+            with open(self.store_path, "rb") as f:
+                f.seek(end)
+                offset = end
+                for line in f:
+                    if not line.endswith(b"\n"):
+                        break   # partial record still being written
+                    r = json.loads(line.decode("utf-8"))
+                    missing.append((offset, len(line), r["label"], r["test"]))
+                    offset += len(line)
+        return missing
+
+    def index(self):
+        """Load the index, updating it from the end of the store if it is
+        out of date.  Returns a list of (offset, length, label, test).
+        """
+        entries, clean = self._load_index()
+        missing = self._unindexed(entries)
+        if missing or not clean:
+            # update under the store lock, after checking that no other
+            # process did it meanwhile
+            with open(self.store_path, "ab") as lock:
+                self._lock(lock)
+                entries, clean = self._load_index()
+                missing = self._unindexed(entries)
+                if not clean:
+                    # replace a torn index as a whole, never append to it
+                    tmp = self.index_path + ".tmp"
+                    with open(tmp, "w") as f:
+                        for e in entries + missing:
+                            f.write(json.dumps(list(e)) + "\n")
+                    os.rename(tmp, self.index_path)
+                elif missing:
+                    with open(self.index_path, "a") as f:
+                        for e in missing:
+                            f.write(json.dumps(list(e)) + "\n")
+            entries.extend(missing)
+        self._index = entries
+        return entries
+
+    def append(self, label, test, metrics, params=None, env=None,
+               timestamp=_NOW, **extra):
+        """Append the results of one test.  'metrics' maps each metric
+        name to its list of samples, or to an already computed summary.
+        """
+        record = {"label": label,
+                  "test": test,
+                  "timestamp": time.time() if timestamp is _NOW else timestamp,
+                  "params": params or {},
+                  "env": env or {},
+                  "metrics": {}}
+        record.update(extra)
+        for name, value in metrics.items():
+            if isinstance(value, dict):
+                record["metrics"][name] = value
+            elif value:
+                record["metrics"][name] = summarize(value)
+        line = (json.dumps(record, sort_keys=True) + "\n").encode("utf-8")
+        if not os.path.exists(self.db):
+            os.makedirs(self.db)
+        with open(self.store_path, "ab") as f:
+            self._lock(f)
+            f.write(line)
+        self._index = None
+
+    def labels(self):
+        """All labels in the store, in the order they were first added.
+        """
+        seen = []
+        for e in self._index if self._index is not None else self.index():
+            if e[2] not in seen:
+                seen.append(e[2])
+        return seen
+
+    def records(self, label=None, test=None):
+        """Iterate over the records, optionally only those of a given
+        label and/or test.
+        """
+        entries = self._index if self._index is not None else self.index()
+        wanted = [e for e in entries
+                  if (label is None or e[2] == label) and
+                     (test is None or e[3] == test)]
+        if not wanted:
+            return
+        with open(self.store_path, "rb") as f:
+            for offset, length, _, _ in wanted:
+                f.seek(offset)
+                yield json.loads(f.read(length).decode("utf-8"))
+
+    def samples(self, label):
+        """Return a map of (metric, test) to the list of raw samples
+        stored under 'label'.  If a label was saved more than once the
+        samples are pooled.
+        """
+        results = {}
+        for r in self.records(label=label):
+            for metric, m in r["metrics"].items():
+                if m.get("samples"):
+                    results.setdefault((metric, r["test"]), []).extend(m["samples"])
+        return results
+
+
+def csv_test_name( test ):
+    """
+    The test name as used in the CSV file names: sanitized so it may be
+    used as a filename.
+    """
+    return re.sub('[)( ]', '_', test)
+
+
+def import_csv( db, store, tests=() ):
+    """
+    Import the results of the old database format: the '<metric>_<test>.csv'
+    summary files (label,low,mean,high) and, where present, the matching
+    '.raw' sample files.  The file names only hold the sanitized test
+    name, so those of 'tests' (the scenario names) are mapped back, so
+    imported records line up with the ones stored by new runs.  Label/test
+    pairs already in the store are skipped, so the import may safely be
+    repeated.  Returns the number of records added.
+    """
+    names = dict((csv_test_name(t), t) for t in tests)
+    present = set((e[2], e[3]) for e in store.index())
+    found = {}     # (label, test) -> {metric: summary}
+    order = []
+
+    def entry(label, test):
+        if (label, test) not in found:
+            found[(label, test)] = {}
+            order.append((label, test))
+        return found[(label, test)]
+
+    for path in sorted(glob.glob(os.path.join(db, "*_*.csv"))):
+        metric, _, test = os.path.basename(path)[:-len(".csv")].partition("_")
+        test = names.get(test, test)
+        with open(path) as f:
+            for row in csv.reader(f):
+                if len(row) != 4:
+                    continue
+                low, avg, high = [float(x) for x in row[1:]]
+                entry(row[0], test)[metric] = {"samples": None, "n": None,
+                                               "min": low, "mean": avg,
+                                               "max": high}
+
+    for path in sorted(glob.glob(os.path.join(db, "*_*.raw"))):
+        metric, _, test = os.path.basename(path)[:-len(".raw")].partition("_")
+        test = names.get(test, test)
+        samples = {}
+        with open(path) as f:
+            for row in csv.reader(f):
+                if len(row) > 1:
+                    samples.setdefault(row[0], []).extend(float(x) for x in row[1:])
+        for label, values in samples.items():
+            entry(label, test)[metric] = summarize(values)
+
+    added = 0
+    for key in order:
+        if key in present:
+            continue
+        store.append(key[0], key[1], found[key], timestamp=None, imported=True)
+        added += 1
+    return added
+
+
+__all__ = [
+    "ResultStore",
+    "environment",
+    "csv_test_name",
+    "import_csv",
+    "summarize"
+    ]
@@ -0,0 +1,173 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+
+"""
+Declarative benchmark scenarios.
+
+Scenarios are read from an INI style configuration file.  Each section
+defines one scenario, named by the section.  Any parameter may be given
+a comma separated list of values - the scenario is expanded into the
+cross product of all such lists, one concrete scenario per combination.
+Parameters not given in a section are taken from the [DEFAULT] section,
+or from the built-in defaults below.
+"""
+
+import itertools, re
+
+try:
+    import ConfigParser as configparser
+except ImportError:
+    import configparser
+
+
+def _bool(value):
+    v = value.strip().lower()
+    if v in ("1", "yes", "true", "on"):
+        return True
+    if v in ("0", "no", "false", "off"):
+        return False
+    raise ValueError("expected a boolean (yes/no, on/off): '%s'" % value)
+
+
+def _settlement(value):
+    v = value.strip().lower()
+    if v not in ("presettled", "explicit"):
+        raise ValueError("settlement must be 'presettled' or 'explicit': '%s'" % value)
+    return v
+
+
+def _latency_from(value):
+    v = value.strip().lower()
+    if v not in ("", "sender", "receiver"):
+        raise ValueError("latency_from must be 'sender' or 'receiver': '%s'" % value)
+    return v
+
+
+def _positive(value):
+    v = int(value)
+    if v <= 0:
+        raise ValueError("expected a positive integer: '%s'" % value)
+    return v
+
+
+# name: (converter, default, description)
+PARAMETERS = {
+    "msg_count":   (_positive,   100000, "messages sent by each sender"),
+    "size":        (_positive,   64, "message body size in bytes"),
+    "send_batch":  (_positive,   1024, "messages put by a sender before each send"),
+    "recv_batch":  (_positive,   2048, "messages fetched by a receiver per recv"),
+    "settlement":  (_settlement, "presettled", "'presettled' or 'explicit' (windowed acks)"),
+    "ssl":         (_bool,       False, "use SSL with anonymous ciphers"),
+    "reply":       (_bool,       False, "receivers reply to every message"),
+    "senders":     (_positive,   1, "number of sender processes"),
+    "receivers":   (_positive,   1, "number of receiver processes"),
+    "connections": (_positive,   1, "listening ports per receiver - each sender connects to all of them"),
+    "links":       (_positive,   1, "links per connection"),
+    "latency_from": (_latency_from,        "", "take latency from 'sender' or 'receiver' [sender if reply, else receiver]"),
+    }
+
+
+class Scenario(object):
+    """A single, fully expanded benchmark scenario.
+    """
+    def __init__(self, name, params):
+        self.name = name
+        self.params = params
+
+    def __getattr__(self, key):
+        try:
+            return self.params[key]
+        except KeyError:
+            raise AttributeError(key)
+
+    def __repr__(self):
+        return "Scenario(%r, %r)" % (self.name, self.params)
+
+
+def _split(value):
+    return [v.strip() for v in value.split(",") if v.strip()]
+
+
+def expand(section, items):
+    """Expand one configuration section (a list of (key, value) string
+    pairs) into a list of Scenarios.
+    """
+    lists = []
+    for key, value in items:
+        if key not in PARAMETERS:
+            raise ValueError("[%s]: unknown parameter '%s'" % (section, key))
+        convert = PARAMETERS[key][0]
+        try:
+            values = [convert(v) for v in _split(value)]
+        except ValueError as e:
+            raise ValueError("[%s] %s: %s" % (section, key, e))
+        if not values:
+            raise ValueError("[%s] %s: no value given" % (section, key))
+        lists.append((key, values))
+    lists.sort()
+
+    keys = [k for k, _ in lists]
+    varying = [k for k, v in lists if len(v) > 1]
+    scenarios = []
+    for combination in itertools.product(*[v for _, v in lists]):
+        params = dict((k, d[1]) for k, d in PARAMETERS.items())
+        params.update(zip(keys, combination))
+        name = section
+        if varying:
+            name += " [%s]" % ",".join("%s=%s" % (k, params[k]) for k in varying)
+        scenarios.append(Scenario(name, params))
+    return scenarios
+
+
+def load(path):
+    """Read the configuration file at 'path', returning the list of
+    expanded Scenarios in the order they appear in the file.
+    """
+    config = configparser.RawConfigParser()
+    config.optionxform = str   # keep parameter names as written
+    if not config.read(path):
+        raise IOError("Cannot read scenario configuration '%s'" % path)
+    scenarios = []
+    for section in config.sections():
+        scenarios.extend(expand(section, config.items(section)))
+    names = [s.name for s in scenarios]
+    for n in names:
+        if names.count(n) > 1:
+            raise ValueError("Duplicate scenario name '%s'" % n)
+    return scenarios
+
+
+def select(scenarios, pattern):
+    """Return the scenarios whose name matches the regular expression
+    'pattern'.
+    """
+    if not pattern:
+        return scenarios
+    r = re.compile(pattern)
+    return [s for s in scenarios if r.search(s.name)]
+
+
+__all__ = [
+    "PARAMETERS",
+    "Scenario",
+    "expand",
+    "load",
+    "select"
+    ]
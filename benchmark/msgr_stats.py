@@ -0,0 +1,138 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+
+"""
+Small, dependency free statistics helpers used to compare benchmark
+results.
+"""
+
+import itertools, math
+
+
+def mean(samples):
+    return float(sum(samples)) / len(samples)
+
+
+def median(samples):
+    s = sorted(samples)
+    n = len(s)
+    if n % 2:
+        return float(s[n // 2])
+    return (s[n // 2 - 1] + s[n // 2]) / 2.0
+
+
+def percentile(samples, p):
+    """The p'th percentile (0 <= p <= 100) of the samples, linearly
+    interpolated between the closest ranks.
+    """
+    s = sorted(samples)
+    if len(s) == 1:
+        return float(s[0])
+    k = (len(s) - 1) * p / 100.0
+    lo = int(math.floor(k))
+    hi = min(lo + 1, len(s) - 1)
+    return s[lo] + (s[hi] - s[lo]) * (k - lo)
+
+
+def _ranks(values):
+    """Return the ranks (1 based) of 'values', ties given the average of
+    the ranks they span.  Also returns the tie correction term
+    sum(t^3 - t) over all groups of t tied values.
+    """
+    order = sorted(range(len(values)), key=lambda i: values[i])
+    ranks = [0.0] * len(values)
+    ties = 0.0
+    i = 0
+    while i < len(order):
+        j = i
+        while j + 1 < len(order) and values[order[j + 1]] == values[order[i]]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[order[k]] = (i + j) / 2.0 + 1
+        t = j - i + 1
+        ties += t * t * t - t
+        i = j + 1
+    return ranks, ties
+
+
+def _u_statistic(ranks, n1):
+    r1 = sum(ranks[:n1])
+    return r1 - n1 * (n1 + 1) / 2.0
+
+
+# Above this many total samples the exact test gets expensive - fall back
+# to the normal approximation.
+EXACT_LIMIT = 20
+
+
+def mann_whitney(a, b):
+    """Two sided Mann-Whitney U test of the hypothesis that samples 'a'
+    and 'b' come from the same distribution.  Returns (U, p) where U is
+    the statistic for 'a'.
+
+    For small samples the exact p-value is computed by enumerating every
+    assignment of the pooled ranks to the two groups (this handles ties
+    correctly).  Larger samples use the normal approximation with tie
+    and continuity corrections.
+    """
+    n1, n2 = len(a), len(b)
+    if n1 == 0 or n2 == 0:
+        raise ValueError("mann_whitney requires non-empty samples")
+    pooled = list(a) + list(b)
+    ranks, ties = _ranks(pooled)
+    u = _u_statistic(ranks, n1)
+    expected = n1 * n2 / 2.0
+    observed = abs(u - expected)
+
+    if n1 + n2 <= EXACT_LIMIT:
+        extreme = total = 0
+        rank_sum_base = n1 * (n1 + 1) / 2.0
+        for combo in itertools.combinations(ranks, n1):
+            total += 1
+            if abs(sum(combo) - rank_sum_base - expected) >= observed - 1e-9:
+                extreme += 1
+        return u, float(extreme) / total
+
+    n = n1 + n2
+    variance = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1)))
+    if variance <= 0:
+        return u, 1.0
+    z = max(observed - 0.5, 0.0) / math.sqrt(variance)
+    return u, math.erfc(z / math.sqrt(2))
+
+
+def min_p_value(n1, n2):
+    """The smallest two sided p-value the exact test can produce for
+    samples of these sizes (without ties).  If this is not below the
+    significance level, no difference can ever be detected.
+    """
+    combinations = 1
+    for i in range(n1):
+        combinations = combinations * (n1 + n2 - i) // (i + 1)
+    return 2.0 / combinations
+
+
+__all__ = [
+    "mean",
+    "median",
+    "percentile",
+    "mann_whitney",
+    "min_p_value"
+    ]
@@ -0,0 +1,106 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+
+"""
+Throughput versus latency sweeps.
+
+A sweep runs a scenario at a series of increasing offered rates, from
+well below to beyond the rate at which the system saturates, recording
+the achieved throughput and the latency percentiles at each step.
+
+The 'knee' is the highest offered rate before the system degrades: the
+last step before either the 99th percentile latency departs from its
+baseline (the median p99 of the lowest rate steps) by more than a given
+factor, or the achieved throughput falls short of the offered rate.
+"""
+
+import msgr_stats
+
+# a step is saturated if it achieves less than this fraction of the
+# offered rate
+SATURATION = 0.95
+
+# number of lowest-rate steps used to establish the baseline latency
+BASELINE_STEPS = 3
+
+
+class Step(object):
+    """The result of running a scenario at one offered rate.
+    """
+    def __init__(self, offered, achieved, p50, p90, p99):
+        self.offered = offered      # msgs/sec
+        self.achieved = achieved    # msgs/sec
+        self.p50 = p50              # msecs
+        self.p90 = p90
+        self.p99 = p99
+
+    @property
+    def saturated(self):
+        return self.achieved < self.offered * SATURATION
+
+
+def rates(peak, steps, top=1.5):
+    """Return 'steps' evenly spaced offered rates, ending at 'top' times
+    the peak (unlimited) throughput.
+    """
+    return [max(1, int(peak * top * (i + 1) / steps)) for i in range(steps)]
+
+
+def baseline(steps):
+    """The baseline p99 latency: the median over the lowest rate steps.
+    """
+    lowest = sorted(steps, key=lambda s: s.offered)[:BASELINE_STEPS]
+    return msgr_stats.median([s.p99 for s in lowest])
+
+
+def knee(steps, factor=2.0):
+    """Return the knee: the offered rate of the last step before p99
+    latency exceeds 'factor' times the baseline, or before the achieved
+    rate falls short of the offered rate.  Returns None if the first step
+    already degrades, and the highest rate if none does (the knee lies
+    beyond the sweep).
+    """
+    limit = baseline(steps) * factor
+    return _last_good(steps, lambda s: s.p99 > limit or s.saturated)
+
+
+def max_rate(steps, p99_target):
+    """Return the maximum sustainable rate with p99 latency below
+    'p99_target' msecs, or None if no step meets the target.
+    """
+    return _last_good(steps, lambda s: s.p99 >= p99_target or s.saturated)
+
+
+def _last_good(steps, bad):
+    good = None
+    for s in sorted(steps, key=lambda s: s.offered):
+        if bad(s):
+            break
+        good = s.offered
+    return good
+
+
+__all__ = [
+    "Step",
+    "baseline",
+    "knee",
+    "max_rate",
+    "rates"
+    ]
@@ -28,7 +28,6 @@
 #include <string.h>
 #include <ctype.h>
 #include <getopt.h>
-#include <uuid/uuid.h>
 
 
 
@@ -41,6 +40,7 @@ typedef struct {
     int send_bad_msg;
     unsigned int ttl;
     unsigned int retry;
+    MessageIdFormat_t id_format;
 } Options_t;
 
 static void usage(int rc)
@@ -54,6 +54,7 @@ static void usage(int rc)
            " -t # \tTimeout in seconds [5]\n"
            " -l <secs> \tTTL to set in message, 0 = no TTL [0]\n"
            " -R # \tMessage send retry limit [3]\n"
+           " -i <format> \tMessage id format: ulong|uuid|binary|string [uuid]\n"
            " -V \tEnable debug logging\n"
            " -X \tSend a bad message (forces a failure response from f-server\n"
            );
@@ -68,8 +69,9 @@ static void parse_options( int argc, char **argv, Options_t *opts )
     memset( opts, 0, sizeof(*opts) );
     opts->timeout = 5;
     opts->retry = 3;
+    opts->id_format = MSG_ID_UUID;
 
-    while ((c = getopt(argc, argv, "a:s:g:t:r:l:R:VX")) != -1) {
+    while ((c = getopt(argc, argv, "a:s:g:t:r:l:R:i:VX")) != -1) {
         switch (c) {
         case 'a': opts->address = optarg; break;
         case 's': opts->new_fortune = optarg; break;
@@ -93,6 +95,12 @@ static void parse_options( int argc, char **argv, Options_t *opts )
                 usage(1);
             }
             break;
+        case 'i':
+            if (!MessageIdParseFormat( optarg, &opts->id_format )) {
+                fprintf(stderr, "Unknown message id format: %s\n", optarg);
+                usage(1);
+            }
+            break;
         case 'V': enable_logging(); break;
         case 'X': opts->send_bad_msg = 1; break;
 
@@ -224,17 +232,18 @@ int main(int argc, char** argv)
 
     // set a unique identifier for this message, so remote can
     // de-duplicate when we re-transmit
-    uuid_t uuid;
-    uuid_generate(uuid);
-    char uuid_str[37];
-    uuid_unparse_upper(uuid, uuid_str);
-    pn_data_put_string( pn_message_id( request_msg ),
-                        pn_bytes( sizeof(uuid_str), uuid_str ));
+    MessageId_t msg_id;
+    char id_key[MSG_ID_KEY_SIZE];
+    MessageIdNext( &msg_id );
+    rc = MessageIdPut( pn_message_id( request_msg ), &msg_id, opts.id_format );
+    check( rc == 0, "Failed to set message id" );
+    rc = MessageIdKey( pn_message_id( request_msg ), id_key, sizeof(id_key) );
+    check( rc == 0, "Failed to encode message id" );
 
     // set the correlation id so we can ensure the response matches
-    // our request. (re-use uuid just 'cause it's easy!)
-    pn_data_put_string( pn_message_correlation_id( request_msg ),
-                        pn_bytes( sizeof(uuid_str), uuid_str ));
+    // our request. (re-use the message id just 'cause it's easy!)
+    rc = MessageIdPut( pn_message_correlation_id( request_msg ), &msg_id, opts.id_format );
+    check( rc == 0, "Failed to set correlation id" );
 
     int send_count = 0;
     bool done = false;
@@ -261,8 +270,10 @@ int main(int argc, char** argv)
 
                 LOG("response received!\n");
                 // validate the correlation id
-                pn_bytes_t cid = pn_data_get_string( pn_message_correlation_id( response_msg ) );
-                if (cid.size == 0 || strncmp( uuid_str, cid.start, cid.size )) {
+                char cid_key[MSG_ID_KEY_SIZE];
+                if (MessageIdKey( pn_message_correlation_id( response_msg ),
+                                  cid_key, sizeof(cid_key) )
+                    || strcmp( id_key, cid_key )) {
                     LOG( "Correlation Id mismatch!  Ignoring this response!\n" );
                 } else {
                     process_reply( messenger, response_msg );
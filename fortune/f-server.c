@@ -19,6 +19,7 @@
  */
 
 #include "common.h"
+#include "stats.h"
 #include "proton/message.h"
 #include "proton/messenger.h"
 #include "proton/error.h"
@@ -45,6 +46,29 @@ typedef enum {
     GET_COMMAND
 } command_t;
 
+// live statistics, see stats-top
+enum {
+    STAT_REQUESTS,
+    STAT_REPLIES,
+    STAT_INVALID,
+    STAT_RETRANSMITS,
+    STAT_DUP_HITS,
+    STAT_DUP_MISSES,
+    STAT_DUP_SIZE,
+    STAT_REPLIES_PENDING,
+    STAT_COUNT
+};
+static const StatsDef_t stat_defs[STAT_COUNT] = {
+    { "requests", STATS_COUNTER },
+    { "replies", STATS_COUNTER },
+    { "invalid", STATS_COUNTER },
+    { "retransmits", STATS_COUNTER },
+    { "dup-hits", STATS_COUNTER },
+    { "dup-misses", STATS_COUNTER },
+    { "dup-size", STATS_GAUGE },
+    { "replies-pending", STATS_GAUGE }
+};
+
 static void usage(int rc)
 {
     printf("Usage: f-server [OPTIONS] \n"
@@ -185,6 +209,9 @@ int main(int argc, char** argv)
 
     parse_options( argc, argv, &opts );
 
+    Stats_t *stats = StatsNew( "f-server", stat_defs, STAT_COUNT, 1 );
+    uint64_t *stat = StatsSlot( stats, 0 );
+
     // no need to track outstanding messages.
     pn_messenger_set_outgoing_window( messenger, 0 );
     pn_messenger_set_incoming_window( messenger, 0 );
@@ -222,31 +249,35 @@ int main(int argc, char** argv)
 
             rc = pn_messenger_get( messenger, request_msg );
             check(rc == 0, "pn_messenger_get() failed");
+            StatsAdd( stat, STAT_REQUESTS, 1 );
 
             // decode the message
             command_t command = GET_COMMAND;
             char *new_fortune = NULL;
             const char *result = NULL;
-            pn_bytes_t id = pn_data_get_string( pn_message_id( request_msg ) );
-            if (id.size == 0 || id.size > 37) {
-                LOG("Invalid message received - does not contain a valid msg id (uuid expected)\n" );
+            char msg_id[MSG_ID_KEY_SIZE];
+            if (MessageIdKey( pn_message_id( request_msg ), msg_id, sizeof(msg_id) )) {
+                LOG("Invalid message received - does not contain a valid msg id (ulong, uuid, binary or string expected)\n" );
                 result = "FAILED: invalid msg identifier";
+                StatsAdd( stat, STAT_INVALID, 1 );
             } else if (decode_request( request_msg, &command, &new_fortune )) {
                 LOG("Invalid request message received!\n");
                 result = "FAILED: invalid request";
+                StatsAdd( stat, STAT_INVALID, 1 );
             } else {
                 LOG("Message contains a valid request.\n");
 
                 // before processing it, check for a duplicate
-                char msg_id[37];    // sizeof uuid as string of hex
                 bool duplicate = false;
-                memcpy( msg_id, id.start, id.size );
-                msg_id[36] = 0;
                 if (pn_message_get_delivery_count( request_msg ) != 0) {
                     LOG("Received retransmitted message\n");
+                    StatsAdd( stat, STAT_RETRANSMITS, 1 );
                     if (DeduplicationIsDuplicate( dupDb, msg_id, NULL )) {
                         LOG("Duplicate found, skipping command.\n");
                         duplicate = true;
+                        StatsAdd( stat, STAT_DUP_HITS, 1 );
+                    } else {
+                        StatsAdd( stat, STAT_DUP_MISSES, 1 );
                     }
                 }
 
@@ -275,9 +306,12 @@ int main(int argc, char** argv)
                                   pn_message_correlation_id(request_msg) );
                     rc = pn_messenger_put( messenger, response_msg );
                     check(rc == 0, "pn_messenger_put() failed");
+                    StatsAdd( stat, STAT_REPLIES, 1 );
                 }
             }
         }
+        StatsSet( stat, STAT_DUP_SIZE, DeduplicationSize( dupDb ) );
+        StatsSet( stat, STAT_REPLIES_PENDING, pn_messenger_outgoing( messenger ) );
     }
 
     rc = pn_messenger_stop(messenger);
@@ -285,6 +319,7 @@ int main(int argc, char** argv)
     check_messenger(messenger);
 
     DeduplicationDbDelete( dupDb );
+    StatsFree( stats );
 
     pn_messenger_free(messenger);
     pn_message_free( request_msg );
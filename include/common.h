@@ -28,6 +28,7 @@ void LOG( const char *fmt, ... );
 void DIE( const char *file, int line, const char *fmt, ... );
 char *_strdup( const char *src );
 pn_timestamp_t _now();
+uint64_t _now_usec();
 
 #define check( expression, message )  \
   { if (!(expression)) DIE(__FILE__,__LINE__, message); }
@@ -56,4 +57,37 @@ bool DeduplicationIsDuplicate( DeduplicationDb_t *, const char *key,
 
 pn_timestamp_t DeduplicationPurgeExpired( DeduplicationDb_t * );
 
+// number of messages remembered
+size_t DeduplicationSize( DeduplicationDb_t * );
+
+
+// Cheap, unique message identifiers: a random per-process prefix
+// combined with an atomic sequence counter.  Safe to call from
+// multiple threads.
+//
+typedef enum {
+    MSG_ID_STRING,    // "<prefix>-<sequence>" as hex, 33 characters
+    MSG_ID_ULONG,     // 32 bits of prefix + 32 bits of sequence
+    MSG_ID_UUID,      // 16 bytes: prefix + sequence
+    MSG_ID_BINARY     // same as uuid, but encoded as AMQP binary
+} MessageIdFormat_t;
+
+typedef struct {
+    uint64_t prefix;
+    uint64_t sequence;
+} MessageId_t;
+
+// large enough for any key generated by MessageIdKey()
+#define MSG_ID_KEY_SIZE 40
+
+bool MessageIdParseFormat( const char *name, MessageIdFormat_t *format );
+void MessageIdNext( MessageId_t *id );
+int MessageIdPut( pn_data_t *data, const MessageId_t *id,
+                  MessageIdFormat_t format );
+
+// Convert a message-id or correlation-id (ulong, uuid, binary or string)
+// into a printable key suitable for hashing/comparing.  Returns 0 on
+// success, else the id is not a supported type or is too long.
+int MessageIdKey( pn_data_t *data, char *key, size_t size );
+
 
@@ -0,0 +1,105 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef PROTON_TOOLS_EVLOOP_H
+#define PROTON_TOOLS_EVLOOP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "proton/types.h"
+#include "proton/engine.h"
+#include "proton/event.h"
+
+// An epoll based event loop for the Proton engine - an alternative to
+// pn_messenger_t for apps that need many connections or want to control
+// their own I/O.
+//
+// The loop owns non-blocking sockets and moves bytes between them and
+// each connection's pn_transport_t.  The events collected from the
+// connection are passed to the connection's handler, and the
+// pn_transport_tick() deadlines are kept in a timer heap.  SASL
+// ANONYMOUS is used in both directions.
+//
+// The loop runs on one or more threads.  Each connection is pinned to
+// one thread for its lifetime, so a connection's handler is never
+// called concurrently and per-connection state needs no locking.  Only
+// EvLoopStop(), EvLoopConnect() and EvConnectionWake() may be called
+// from other threads.
+
+typedef struct EvLoop_s EvLoop_t;
+typedef struct EvConnection_s EvConnection_t;
+
+typedef enum {
+    EV_OPENED,      // the socket is connected (or accepted), event is NULL
+    EV_PROTON,      // event was collected from the connection
+    EV_WAKE,        // EvConnectionWake() was called, event is NULL
+    EV_CLOSED       // the socket is closed, last call for the connection
+} EvType_t;
+
+// Called on the connection's thread.  context is the one given to
+// EvLoopConnect()/EvLoopListen().
+typedef void EvHandler_t( EvConnection_t *conn, EvType_t type,
+                          pn_event_t *event, void *context );
+
+// name is the container id for the connections, threads >= 1
+EvLoop_t *EvLoopNew( const char *name, unsigned int threads );
+void EvLoopFree( EvLoop_t * );
+
+// Runs the loop threads (the caller is thread 0) until EvLoopStop() is
+// called or no connections or listeners remain.
+void EvLoopRun( EvLoop_t * );
+void EvLoopStop( EvLoop_t * );
+
+// Connections are pinned to threads round-robin.  Returns NULL if the
+// address does not resolve.  The pn_connection_t may be set up (links
+// opened, etc) before the EV_OPENED call only if the loop is not running.
+EvConnection_t *EvLoopConnect( EvLoop_t *, const char *host, const char *port,
+                               EvHandler_t *handler, void *context );
+
+// Accepted connections are pinned to threads round-robin.  Returns 0 on
+// success, else -1 with errno set.
+int EvLoopListen( EvLoop_t *, const char *host, const char *port,
+                  EvHandler_t *handler, void *context );
+
+pn_connection_t *EvConnectionProton( EvConnection_t * );
+unsigned int EvConnectionThread( EvConnection_t * );
+bool EvConnectionIsServer( EvConnection_t * );
+void *EvConnectionGetContext( EvConnection_t * );
+void EvConnectionSetContext( EvConnection_t *, void *context );
+
+// Called on the connection's thread with each chunk of bytes read from
+// the socket, before the transport processes it - eg. to capture the
+// traffic.  Set it from the handler, at EV_OPENED.
+typedef void EvInputTap_t( EvConnection_t *conn, const char *data, size_t size,
+                           void *context );
+void EvConnectionSetInputTap( EvConnection_t *, EvInputTap_t *tap, void *context );
+
+// Call the handler with EV_WAKE on the connection's thread, eg. to send
+// data produced by another thread.  Must not be called after EV_CLOSED.
+void EvConnectionWake( EvConnection_t * );
+
+// Split "amqp[s]://[~]host[:port][/name]" into its parts.  port defaults
+// to 5672, name to "" and a leading '~' (listen) is dropped.  Returns 0
+// on success, -1 if a part does not fit.
+int EvAddressParse( const char *address, char *host, size_t host_size,
+                    char *port, size_t port_size, const char **name );
+
+#endif
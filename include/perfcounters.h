@@ -0,0 +1,56 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef PROTON_TOOLS_PERFCOUNTERS_H
+#define PROTON_TOOLS_PERFCOUNTERS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// CPU event counters around a measured section, see perf_event_open(2).
+//
+// The hardware counters - cycles, instructions, cache misses and branch
+// misses - are used where the PMU is exposed.  Where it is not (eg. in
+// most VMs), or the kernel does not permit it, the software counters -
+// task clock, context switches and page faults - are used instead.  If
+// kernel events may not be counted (perf_event_paranoid), only user
+// space is.
+//
+// The counters follow the calling thread and any thread or process it
+// creates after PerfCountersNew(); the counts of those are included
+// once they have exited, so call PerfCountersStop() after joining them.
+// A section may be measured in pieces: the counts of each
+// PerfCountersStart()/PerfCountersStop() pair are added up.
+
+typedef struct PerfCounters_s PerfCounters_t;
+
+// returns NULL (and logs why) if no counters can be opened
+PerfCounters_t *PerfCountersNew( void );
+void PerfCountersFree( PerfCounters_t * );
+
+void PerfCountersStart( PerfCounters_t * );
+void PerfCountersStop( PerfCounters_t * );
+
+// the costs per message of the measured section: a line of text, and
+// " <counter>_per_msg=<value>" pairs to append to a RESULT line
+void PerfCountersReport( PerfCounters_t *, uint64_t messages, FILE *out );
+void PerfCountersResult( PerfCounters_t *, uint64_t messages, FILE *out );
+
+#endif
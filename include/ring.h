@@ -0,0 +1,51 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef PROTON_TOOLS_RING_H
+#define PROTON_TOOLS_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A single-producer/single-consumer byte ring.
+//
+// The ring lives entirely in the memory given to RingInit(), so it may
+// be placed in memory shared between processes (eg. mmap MAP_SHARED
+// before a fork).  One thread may write while another reads, without
+// locks or system calls; the head and tail counters are kept on their
+// own cache lines.  Neither side ever blocks: a full (or empty) ring
+// transfers zero bytes.
+
+typedef struct Ring_s Ring_t;
+
+// bytes of memory needed for a ring of capacity bytes (a power of 2)
+size_t RingMemorySize( size_t capacity );
+
+Ring_t *RingInit( void *memory, size_t capacity );
+
+// copy up to size bytes in/out, returns the number of bytes copied
+size_t RingWrite( Ring_t *, const void *data, size_t size );
+size_t RingRead( Ring_t *, void *data, size_t size );
+
+// bytes available to read, and space available to write
+size_t RingReadable( Ring_t * );
+size_t RingWritable( Ring_t * );
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef PROTON_TOOLS_STATS_H
+#define PROTON_TOOLS_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Live statistics, published in shared memory.
+//
+// A process declares a set of named counters and gauges, which are kept
+// in a POSIX shared memory segment named "/proton-stats.<pid>" for as
+// long as it runs.  The stats-top tool (see stats/) attaches to the
+// segment and prints them, so a running server can be watched without
+// restarting it.
+//
+// The values are kept in slots, one per thread: a slot is a cache line
+// aligned row holding one value of each statistic, and is only ever
+// updated by its own thread, with plain stores.  The message path thus
+// takes no locks, issues no atomic read-modify-writes and shares no
+// cache lines.  Readers add up the slots.  Counters only go up and are
+// shown as rates, gauges are shown as they are.
+//
+// StatsNew() returns NULL if the segment cannot be created, and all the
+// update functions accept a NULL slot: statistics are then simply off.
+
+typedef enum {
+    STATS_COUNTER,
+    STATS_GAUGE
+} StatsKind_t;
+
+typedef struct {
+    const char *name;
+    StatsKind_t kind;
+} StatsDef_t;
+
+typedef struct Stats_s Stats_t;
+
+// 'process' is shown by stats-top, eg. argv[0]
+Stats_t *StatsNew( const char *process, const StatsDef_t *defs,
+                   unsigned int count, unsigned int slots );
+void StatsFree( Stats_t * );
+
+// the values of slot i, for the exclusive use of one thread
+uint64_t *StatsSlot( Stats_t *, unsigned int i );
+
+static inline void StatsAdd( uint64_t *slot, unsigned int id, uint64_t n )
+{
+    if (slot) __atomic_store_n( &slot[id], slot[id] + n, __ATOMIC_RELAXED );
+}
+
+static inline void StatsSet( uint64_t *slot, unsigned int id, uint64_t value )
+{
+    if (slot) __atomic_store_n( &slot[id], value, __ATOMIC_RELAXED );
+}
+
+
+// Reader side: attach read-only to the segment of a running process.
+// Returns NULL if there is none.
+Stats_t *StatsAttach( pid_t pid );
+
+// call 'found' for each segment, with the pid and whether the process
+// still exists
+void StatsList( void (*found)( pid_t pid, const char *process, int running,
+                               void *context ),
+                void *context );
+
+const char *StatsProcess( Stats_t * );
+unsigned int StatsCount( Stats_t * );
+unsigned int StatsSlots( Stats_t * );
+const char *StatsName( Stats_t *, unsigned int id );
+StatsKind_t StatsKind( Stats_t *, unsigned int id );
+
+// a statistic, summed over all the slots, or from one slot
+uint64_t StatsRead( Stats_t *, unsigned int id );
+uint64_t StatsReadSlot( Stats_t *, unsigned int slot, unsigned int id );
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#ifndef PROTON_TOOLS_TRACE_H
+#define PROTON_TOOLS_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// A low overhead in-memory trace of per-message stage timestamps.
+//
+// Each record holds one timestamp (microseconds, see _now_usec()) per
+// stage.  Records are kept in a fixed size ring - once full, the oldest
+// record is reused - so tracing never allocates or does I/O on the
+// message path.  Not thread safe: use one Trace_t per thread.
+//
+// TraceDump() prints a latency histogram for the time between each
+// pair of consecutive stages, and for the first to last stage.  Stages
+// left at zero in a record are skipped.
+
+typedef struct Trace_s Trace_t;
+
+Trace_t *TraceNew( unsigned int stages, const char * const *names, size_t capacity );
+void TraceFree( Trace_t * );
+
+// returns the zeroed timestamp slots of a new record
+uint64_t *TraceNext( Trace_t * );
+
+void TraceDump( Trace_t *, FILE *out );
+
+#endif
@@ -91,6 +91,17 @@ pn_timestamp_t _now()
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// same as _now(), but microseconds
+//
+uint64_t _now_usec()
+{
+  struct timeval now;
+  if (gettimeofday(&now, NULL)) abort();
+  return ((uint64_t)now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Send a message and confirm receipt by remote.
 //
@@ -248,3 +259,138 @@ pn_timestamp_t DeduplicationPurgeExpired( DeduplicationDb_t *db )
     return next_call;
 }
 
+size_t DeduplicationSize( DeduplicationDb_t *db )
+{
+    return g_hash_table_size( db->hTable );
+}
+
+
+
+static uint64_t id_prefix;
+static uint64_t id_sequence;
+
+// the prefix is generated once per process.  If two threads race to
+// create it, the first to store its value wins.
+//
+static uint64_t message_id_prefix()
+{
+    uint64_t prefix = id_prefix;
+    if (!prefix) {
+        FILE *f = fopen( "/dev/urandom", "rb" );
+        if (f) {
+            if (fread( &prefix, sizeof(prefix), 1, f ) != 1) prefix = 0;
+            fclose( f );
+        }
+        if (!prefix) {
+            prefix = (((uint64_t) getpid()) << 40) ^ (uint64_t) _now();
+        }
+        if (!prefix) prefix = 1;  // zero means "not yet generated"
+        __sync_bool_compare_and_swap( &id_prefix, 0, prefix );
+        prefix = id_prefix;
+    }
+    return prefix;
+}
+
+bool MessageIdParseFormat( const char *name, MessageIdFormat_t *format )
+{
+    if (strcmp( name, "string" ) == 0) *format = MSG_ID_STRING;
+    else if (strcmp( name, "ulong" ) == 0) *format = MSG_ID_ULONG;
+    else if (strcmp( name, "uuid" ) == 0) *format = MSG_ID_UUID;
+    else if (strcmp( name, "binary" ) == 0) *format = MSG_ID_BINARY;
+    else return false;
+    return true;
+}
+
+void MessageIdNext( MessageId_t *id )
+{
+    id->prefix = message_id_prefix();
+    id->sequence = __sync_add_and_fetch( &id_sequence, 1 );
+}
+
+// network (big endian) byte order, so the wire format doesn't depend
+// on the host
+static void message_id_bytes( const MessageId_t *id, char *bytes )
+{
+    int i;
+    for (i = 0; i < 8; ++i) {
+        bytes[i] = (char) (id->prefix >> (56 - 8 * i));
+        bytes[8 + i] = (char) (id->sequence >> (56 - 8 * i));
+    }
+}
+
+int MessageIdPut( pn_data_t *data, const MessageId_t *id,
+                  MessageIdFormat_t format )
+{
+    char buf[MSG_ID_KEY_SIZE];
+    pn_uuid_t uuid;
+
+    pn_data_clear( data );
+    switch (format) {
+    case MSG_ID_ULONG:
+        return pn_data_put_ulong( data, (id->prefix & 0xFFFFFFFF00000000ULL)
+                                  | (id->sequence & 0xFFFFFFFFULL) );
+    case MSG_ID_UUID:
+        message_id_bytes( id, uuid.bytes );
+        return pn_data_put_uuid( data, uuid );
+    case MSG_ID_BINARY:
+        message_id_bytes( id, buf );
+        return pn_data_put_binary( data, pn_bytes( 16, buf ) );
+    case MSG_ID_STRING:
+    default:
+        snprintf( buf, sizeof(buf), "%016llX-%016llX",
+                  (unsigned long long) id->prefix,
+                  (unsigned long long) id->sequence );
+        return pn_data_put_string( data, pn_bytes( strlen(buf), buf ) );
+    }
+}
+
+static int hex_key( char type, const char *bytes, size_t count,
+                    char *key, size_t size )
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+
+    if (size < 2 * count + 2) return -1;
+    *key++ = type;
+    for (i = 0; i < count; ++i) {
+        *key++ = digits[(bytes[i] >> 4) & 0x0F];
+        *key++ = digits[bytes[i] & 0x0F];
+    }
+    *key = 0;
+    return 0;
+}
+
+int MessageIdKey( pn_data_t *data, char *key, size_t size )
+{
+    pn_bytes_t b;
+    pn_uuid_t uuid;
+
+    pn_data_rewind( data );
+    if (!pn_data_next( data )) return -1;
+
+    switch (pn_data_type( data )) {
+    case PN_ULONG:
+        if (size < 18) return -1;
+        snprintf( key, size, "u%016llx",
+                  (unsigned long long) pn_data_get_ulong( data ) );
+        return 0;
+    case PN_UUID:
+        uuid = pn_data_get_uuid( data );
+        return hex_key( 'U', uuid.bytes, 16, key, size );
+    case PN_BINARY:
+        b = pn_data_get_binary( data );
+        if (b.size == 0 || b.size > 16) return -1;
+        return hex_key( 'b', b.start, b.size, key, size );
+    case PN_STRING:
+        // older clients include the terminating NUL in the id
+        b = pn_data_get_string( data );
+        if (b.size && b.start[b.size - 1] == 0) b.size--;
+        if (b.size == 0 || b.size + 2 > size) return -1;
+        key[0] = 's';
+        memcpy( &key[1], b.start, b.size );
+        key[b.size + 1] = 0;
+        return 0;
+    default:
+        return -1;
+    }
+}
@@ -0,0 +1,853 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "evloop.h"
+
+#include "proton/sasl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define EV_MAX_EVENTS    256   // per epoll_wait()
+#define EV_ACCEPT_BATCH  32    // accepts per listener wakeup
+#define EV_IO_BATCH      16    // reads (or writes) per connection wakeup
+#define EV_PASSES        8     // dispatch/write rounds per connection wakeup
+
+typedef enum {
+    SOURCE_WAKE,
+    SOURCE_LISTENER,
+    SOURCE_CONNECTION
+} SourceKind_t;
+
+// the epoll data of every registered fd points at one of these
+typedef struct {
+    SourceKind_t kind;
+    int fd;
+} Source_t;
+
+typedef struct EvThread_s EvThread_t;
+
+typedef struct EvListener_s {
+    Source_t source;        // must be first
+    struct EvListener_s *next;
+    EvHandler_t *handler;
+    void *context;
+} EvListener_t;
+
+struct EvConnection_s {
+    Source_t source;        // must be first
+    EvLoop_t *loop;
+    EvThread_t *thread;
+    EvConnection_t *next;   // thread's connections
+    EvConnection_t *prev;
+    EvConnection_t *next_adopt;
+    EvConnection_t *next_woken;
+    EvConnection_t *next_ready;
+
+    EvHandler_t *handler;
+    void *context;
+    void *user_context;
+    EvInputTap_t *tap;
+    void *tap_context;
+
+    pn_connection_t *connection;
+    pn_transport_t *transport;
+    pn_collector_t *collector;
+
+    bool server;
+    bool connecting;        // non-blocking connect() in progress
+    bool tail_closed;
+    bool head_closed;
+    bool ready;             // on the thread's ready list
+    bool closed;
+    volatile int woken;     // on the thread's woken list
+    uint32_t interest;      // registered epoll events
+
+    pn_timestamp_t deadline;
+    size_t heap_index;      // position in the timer heap, if deadline
+};
+
+struct EvThread_s {
+    EvLoop_t *loop;
+    unsigned int index;
+    pthread_t thread;
+    int epfd;
+    Source_t wake;          // eventfd
+
+    pthread_mutex_t lock;   // protects adopt and woken
+    EvConnection_t *adopt;
+    EvConnection_t *woken;
+
+    EvConnection_t *connections;
+    EvConnection_t *ready;
+    EvConnection_t *dead;   // closed, freed at the end of the iteration
+    EvListener_t *listeners;
+
+    // min-heap of connections by deadline
+    EvConnection_t **heap;
+    size_t heap_size;
+    size_t heap_capacity;
+};
+
+struct EvLoop_s {
+    char *name;
+    unsigned int thread_count;
+    EvThread_t *threads;
+    volatile int stopping;
+    volatile int live;          // connections + listeners
+    volatile unsigned int next_thread;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// timer heap
+//
+
+static void heap_set( EvThread_t *t, size_t i, EvConnection_t *conn )
+{
+    t->heap[i] = conn;
+    conn->heap_index = i;
+}
+
+static void heap_up( EvThread_t *t, size_t i )
+{
+    EvConnection_t *conn = t->heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (t->heap[parent]->deadline <= conn->deadline) break;
+        heap_set( t, i, t->heap[parent] );
+        i = parent;
+    }
+    heap_set( t, i, conn );
+}
+
+static void heap_down( EvThread_t *t, size_t i )
+{
+    EvConnection_t *conn = t->heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= t->heap_size) break;
+        if (child + 1 < t->heap_size &&
+            t->heap[child + 1]->deadline < t->heap[child]->deadline)
+            child++;
+        if (conn->deadline <= t->heap[child]->deadline) break;
+        heap_set( t, i, t->heap[child] );
+        i = child;
+    }
+    heap_set( t, i, conn );
+}
+
+static void heap_remove( EvThread_t *t, EvConnection_t *conn )
+{
+    size_t i = conn->heap_index;
+    EvConnection_t *last = t->heap[--t->heap_size];
+    conn->deadline = 0;
+    if (last != conn) {
+        heap_set( t, i, last );
+        heap_up( t, i );
+        heap_down( t, last->heap_index );
+    }
+}
+
+// deadline 0 cancels the timer
+static void timer_schedule( EvThread_t *t, EvConnection_t *conn,
+                            pn_timestamp_t deadline )
+{
+    if (deadline == conn->deadline) return;
+    if (conn->deadline) heap_remove( t, conn );
+    if (!deadline) return;
+    if (t->heap_size == t->heap_capacity) {
+        t->heap_capacity = t->heap_capacity ? 2 * t->heap_capacity : 64;
+        t->heap = (EvConnection_t **) realloc( t->heap, t->heap_capacity * sizeof(EvConnection_t *) );
+        check( t->heap, "Out of memory." );
+    }
+    conn->deadline = deadline;
+    heap_set( t, t->heap_size++, conn );
+    heap_up( t, conn->heap_index );
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// connections
+//
+
+static void thread_wake( EvThread_t *t )
+{
+    uint64_t one = 1;
+    ssize_t rc = write( t->wake.fd, &one, sizeof(one) );
+    (void) rc;  // EAGAIN: counter saturated, a wakeup is pending anyway
+}
+
+static void set_interest( EvConnection_t *conn, uint32_t interest )
+{
+    struct epoll_event ev;
+    if (interest == conn->interest) return;
+    memset( &ev, 0, sizeof(ev) );
+    ev.events = interest;
+    ev.data.ptr = &conn->source;
+    if (epoll_ctl( conn->thread->epfd, EPOLL_CTL_MOD, conn->source.fd, &ev ))
+        DIE( __FILE__, __LINE__, "epoll_ctl: %s\n", strerror(errno) );
+    conn->interest = interest;
+}
+
+static EvConnection_t *connection_new( EvLoop_t *loop, int fd, bool server,
+                                       const char *hostname,
+                                       EvHandler_t *handler, void *context )
+{
+    EvConnection_t *conn = (EvConnection_t *) calloc( 1, sizeof(EvConnection_t) );
+    check( conn, "Out of memory." );
+    conn->source.kind = SOURCE_CONNECTION;
+    conn->source.fd = fd;
+    conn->loop = loop;
+    conn->handler = handler;
+    conn->context = context;
+    conn->server = server;
+
+    conn->connection = pn_connection();
+    conn->collector = pn_collector();
+    conn->transport = pn_transport();
+    check( conn->connection && conn->collector && conn->transport, "Out of memory." );
+    pn_connection_set_container( conn->connection, loop->name );
+    if (hostname) pn_connection_set_hostname( conn->connection, hostname );
+    pn_connection_collect( conn->connection, conn->collector );
+
+    pn_sasl_t *sasl = pn_sasl( conn->transport );
+    pn_sasl_mechanisms( sasl, "ANONYMOUS" );
+    if (server) {
+        pn_sasl_server( sasl );
+        pn_sasl_done( sasl, PN_SASL_OK );
+    } else {
+        pn_sasl_client( sasl );
+    }
+    pn_transport_bind( conn->transport, conn->connection );
+
+    __sync_add_and_fetch( &loop->live, 1 );
+    return conn;
+}
+
+static void connection_free( EvConnection_t *conn )
+{
+    pn_transport_unbind( conn->transport );
+    pn_transport_free( conn->transport );
+    pn_connection_free( conn->connection );
+    pn_collector_free( conn->collector );
+    free( conn );
+}
+
+// hand a new connection to its thread
+static void connection_assign( EvLoop_t *loop, EvConnection_t *conn )
+{
+    unsigned int i = __sync_fetch_and_add( &loop->next_thread, 1 ) % loop->thread_count;
+    EvThread_t *t = &loop->threads[i];
+    conn->thread = t;
+    pthread_mutex_lock( &t->lock );
+    conn->next_adopt = t->adopt;
+    t->adopt = conn;
+    pthread_mutex_unlock( &t->lock );
+    thread_wake( t );
+}
+
+static void connection_close( EvConnection_t *conn )
+{
+    EvThread_t *t = conn->thread;
+    if (conn->closed) return;
+    conn->closed = true;
+    timer_schedule( t, conn, 0 );
+    epoll_ctl( t->epfd, EPOLL_CTL_DEL, conn->source.fd, NULL );
+    close( conn->source.fd );
+    if (conn->next) conn->next->prev = conn->prev;
+    if (conn->prev) conn->prev->next = conn->next;
+    else t->connections = conn->next;
+    conn->handler( conn, EV_CLOSED, NULL, conn->context );
+    conn->next = t->dead;
+    t->dead = conn;
+    if (__sync_sub_and_fetch( &conn->loop->live, 1 ) == 0)
+        EvLoopStop( conn->loop );
+}
+
+static void connection_ready( EvConnection_t *conn )
+{
+    if (conn->ready) return;
+    conn->ready = true;
+    conn->next_ready = conn->thread->ready;
+    conn->thread->ready = conn;
+}
+
+static void connection_read( EvConnection_t *conn )
+{
+    int i;
+    for (i = 0; i < EV_IO_BATCH && !conn->tail_closed; ++i) {
+        ssize_t capacity = pn_transport_capacity( conn->transport );
+        if (capacity < 0) {
+            conn->tail_closed = true;
+            break;
+        }
+        if (capacity == 0) break;   // resumed once output drains
+        ssize_t n = recv( conn->source.fd, pn_transport_tail( conn->transport ),
+                          capacity, 0 );
+        if (n > 0) {
+            if (conn->tap)
+                conn->tap( conn, pn_transport_tail( conn->transport ), n,
+                           conn->tap_context );
+            pn_transport_process( conn->transport, n );
+            if (n < capacity) break;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            LOG( "evloop: connection %s\n", n ? strerror(errno) : "closed by peer" );
+            pn_transport_close_tail( conn->transport );
+            conn->tail_closed = true;
+        }
+    }
+}
+
+// returns true if anything was written
+static bool connection_write( EvConnection_t *conn )
+{
+    bool wrote = false;
+    int i;
+    for (i = 0; i < EV_IO_BATCH && !conn->head_closed; ++i) {
+        ssize_t pending = pn_transport_pending( conn->transport );
+        if (pending < 0) {
+            shutdown( conn->source.fd, SHUT_WR );
+            conn->head_closed = true;
+            break;
+        }
+        if (pending == 0) break;
+        ssize_t n = send( conn->source.fd, pn_transport_head( conn->transport ),
+                          pending, MSG_NOSIGNAL );
+        if (n > 0) {
+            pn_transport_pop( conn->transport, n );
+            wrote = true;
+            if (n < pending) break;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            LOG( "evloop: write failed: %s\n", strerror(errno) );
+            pn_transport_close_head( conn->transport );
+            conn->head_closed = true;
+            // nothing more will be read either
+            if (!conn->tail_closed) {
+                pn_transport_close_tail( conn->transport );
+                conn->tail_closed = true;
+            }
+        }
+    }
+    return wrote;
+}
+
+static bool connection_dispatch( EvConnection_t *conn )
+{
+    pn_event_t *event = pn_collector_peek( conn->collector );
+    bool any = event != NULL;
+    while (event) {
+        conn->handler( conn, EV_PROTON, event, conn->context );
+        pn_collector_pop( conn->collector );
+        event = pn_collector_peek( conn->collector );
+    }
+    return any;
+}
+
+// Move data in both directions, tick the transport and dispatch the
+// events until the connection is quiet (or has used its turn).
+static void connection_service( EvConnection_t *conn, bool readable,
+                                pn_timestamp_t now )
+{
+    int pass;
+    bool busy = true;
+
+    if (conn->closed) return;
+    if (readable) connection_read( conn );
+    timer_schedule( conn->thread, conn, pn_transport_tick( conn->transport, now ) );
+
+    for (pass = 0; pass < EV_PASSES && busy; ++pass) {
+        busy = connection_dispatch( conn );
+        busy = connection_write( conn ) || busy;
+    }
+    if (busy) connection_ready( conn );
+
+    if (conn->tail_closed && conn->head_closed) {
+        connection_close( conn );
+        return;
+    }
+
+    uint32_t interest = 0;
+    if (!conn->tail_closed && pn_transport_capacity( conn->transport ) > 0)
+        interest |= EPOLLIN;
+    if (!conn->head_closed && pn_transport_pending( conn->transport ) != 0)
+        interest |= EPOLLOUT;
+    set_interest( conn, interest );
+}
+
+static void connection_connected( EvConnection_t *conn, pn_timestamp_t now )
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    conn->connecting = false;
+    if (getsockopt( conn->source.fd, SOL_SOCKET, SO_ERROR, &error, &len ) || error) {
+        LOG( "evloop: connect failed: %s\n", strerror(error ? error : errno) );
+        conn->tail_closed = conn->head_closed = true;
+        connection_close( conn );
+        return;
+    }
+    conn->handler( conn, EV_OPENED, NULL, conn->context );
+    connection_service( conn, false, now );
+}
+
+static void thread_adopt( EvThread_t *t, pn_timestamp_t now )
+{
+    EvConnection_t *conn, *woken;
+    pthread_mutex_lock( &t->lock );
+    conn = t->adopt;
+    woken = t->woken;
+    t->adopt = t->woken = NULL;
+    pthread_mutex_unlock( &t->lock );
+
+    while (conn) {
+        EvConnection_t *next = conn->next_adopt;
+        struct epoll_event ev;
+        memset( &ev, 0, sizeof(ev) );
+        conn->interest = ev.events = conn->connecting ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = &conn->source;
+        if (epoll_ctl( t->epfd, EPOLL_CTL_ADD, conn->source.fd, &ev ))
+            DIE( __FILE__, __LINE__, "epoll_ctl: %s\n", strerror(errno) );
+        conn->next = t->connections;
+        conn->prev = NULL;
+        if (t->connections) t->connections->prev = conn;
+        t->connections = conn;
+        if (!conn->connecting) {
+            conn->handler( conn, EV_OPENED, NULL, conn->context );
+            connection_service( conn, false, now );
+        }
+        conn = next;
+    }
+
+    while (woken) {
+        EvConnection_t *next = woken->next_woken;
+        __sync_lock_release( &woken->woken );
+        if (!woken->closed) {
+            woken->handler( woken, EV_WAKE, NULL, woken->context );
+            connection_service( woken, false, now );
+        }
+        woken = next;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// listeners
+//
+
+static void listener_accept( EvLoop_t *loop, EvListener_t *l )
+{
+    int i;
+    for (i = 0; i < EV_ACCEPT_BATCH; ++i) {
+        int fd = accept4( l->source.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG( "evloop: accept failed: %s\n", strerror(errno) );
+            return;
+        }
+        int one = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+        connection_assign( loop, connection_new( loop, fd, true, NULL,
+                                                 l->handler, l->context ) );
+    }
+}
+
+static struct addrinfo *resolve( const char *host, const char *port, bool passive )
+{
+    struct addrinfo hints, *addr = NULL;
+    memset( &hints, 0, sizeof(hints) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (passive) hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo( host, port, &hints, &addr );
+    if (rc) {
+        LOG( "evloop: cannot resolve %s:%s: %s\n", host, port, gai_strerror(rc) );
+        return NULL;
+    }
+    return addr;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// loop
+//
+
+static void *thread_run( void *arg )
+{
+    EvThread_t *t = (EvThread_t *) arg;
+    EvLoop_t *loop = t->loop;
+    struct epoll_event events[EV_MAX_EVENTS];
+
+    while (!loop->stopping) {
+        pn_timestamp_t now = _now();
+        int timeout = -1;
+        int i, n;
+        size_t expired;
+
+        if (t->ready) {
+            timeout = 0;
+        } else if (t->heap_size) {
+            pn_timestamp_t next = t->heap[0]->deadline;
+            timeout = next > now ? (int) (next - now) : 0;
+        }
+        n = epoll_wait( t->epfd, events, EV_MAX_EVENTS, timeout );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            DIE( __FILE__, __LINE__, "epoll_wait: %s\n", strerror(errno) );
+        }
+        now = _now();
+
+        for (i = 0; i < n; ++i) {
+            Source_t *source = (Source_t *) events[i].data.ptr;
+            uint32_t revents = events[i].events;
+            if (source->kind == SOURCE_WAKE) {
+                uint64_t count;
+                ssize_t rc = read( source->fd, &count, sizeof(count) );
+                (void) rc;
+                thread_adopt( t, now );
+            } else if (source->kind == SOURCE_LISTENER) {
+                listener_accept( loop, (EvListener_t *) source );
+            } else {
+                EvConnection_t *conn = (EvConnection_t *) source;
+                if (conn->connecting) {
+                    connection_connected( conn, now );
+                } else {
+                    connection_service( conn, (revents & (EPOLLIN|EPOLLHUP|EPOLLERR)) != 0,
+                                        now );
+                }
+            }
+        }
+
+        // transport timers - each expired timer is serviced at most once
+        // per iteration, even if the tick does not move its deadline
+        for (expired = t->heap_size;
+             expired > 0 && t->heap_size && t->heap[0]->deadline <= now; --expired) {
+            EvConnection_t *conn = t->heap[0];
+            timer_schedule( t, conn, 0 );
+            connection_service( conn, false, now );
+        }
+
+        // connections that did not finish their work last time around
+        if (t->ready) {
+            EvConnection_t *conn = t->ready;
+            t->ready = NULL;
+            while (conn) {
+                EvConnection_t *next = conn->next_ready;
+                conn->ready = false;
+                connection_service( conn, false, now );
+                conn = next;
+            }
+        }
+
+        while (t->dead) {
+            EvConnection_t *conn = t->dead;
+            t->dead = conn->next;
+            if (conn->ready) {
+                // unlink from the ready list
+                EvConnection_t **p = &t->ready;
+                while (*p != conn) p = &(*p)->next_ready;
+                *p = conn->next_ready;
+            }
+            if (conn->woken) {
+                EvConnection_t **p;
+                pthread_mutex_lock( &t->lock );
+                for (p = &t->woken; *p; p = &(*p)->next_woken) {
+                    if (*p == conn) {
+                        *p = conn->next_woken;
+                        break;
+                    }
+                }
+                pthread_mutex_unlock( &t->lock );
+            }
+            connection_free( conn );
+        }
+    }
+
+    // flush what the handlers produced before the stop, eg. the
+    // dispositions of the last messages
+    for (EvConnection_t *conn = t->connections; conn; conn = conn->next)
+        connection_write( conn );
+    return NULL;
+}
+
+EvLoop_t *EvLoopNew( const char *name, unsigned int threads )
+{
+    EvLoop_t *loop = (EvLoop_t *) calloc( 1, sizeof(EvLoop_t) );
+    unsigned int i;
+    check( loop, "Out of memory." );
+    loop->name = _strdup( name );
+    loop->thread_count = threads ? threads : 1;
+    loop->threads = (EvThread_t *) calloc( loop->thread_count, sizeof(EvThread_t) );
+    check( loop->name && loop->threads, "Out of memory." );
+
+    for (i = 0; i < loop->thread_count; ++i) {
+        EvThread_t *t = &loop->threads[i];
+        struct epoll_event ev;
+        t->loop = loop;
+        t->index = i;
+        pthread_mutex_init( &t->lock, NULL );
+        t->epfd = epoll_create1( EPOLL_CLOEXEC );
+        check( t->epfd >= 0, "epoll_create1 failed." );
+        t->wake.kind = SOURCE_WAKE;
+        t->wake.fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        check( t->wake.fd >= 0, "eventfd failed." );
+        memset( &ev, 0, sizeof(ev) );
+        ev.events = EPOLLIN;
+        ev.data.ptr = &t->wake;
+        check( epoll_ctl( t->epfd, EPOLL_CTL_ADD, t->wake.fd, &ev ) == 0,
+               "epoll_ctl failed." );
+    }
+    return loop;
+}
+
+void EvLoopFree( EvLoop_t *loop )
+{
+    unsigned int i;
+    if (!loop) return;
+    for (i = 0; i < loop->thread_count; ++i) {
+        EvThread_t *t = &loop->threads[i];
+        EvConnection_t *conn;
+        while (t->connections) {
+            conn = t->connections;
+            connection_close( conn );
+        }
+        // connections handed over but never adopted
+        for (conn = t->adopt; conn; conn = conn->next_adopt) {
+            conn->closed = true;
+            close( conn->source.fd );
+            conn->handler( conn, EV_CLOSED, NULL, conn->context );
+            conn->next = t->dead;
+            t->dead = conn;
+        }
+        while (t->dead) {
+            conn = t->dead;
+            t->dead = conn->next;
+            connection_free( conn );
+        }
+        while (t->listeners) {
+            EvListener_t *l = t->listeners;
+            t->listeners = l->next;
+            close( l->source.fd );
+            free( l );
+        }
+        close( t->wake.fd );
+        close( t->epfd );
+        pthread_mutex_destroy( &t->lock );
+        free( t->heap );
+    }
+    free( loop->threads );
+    free( loop->name );
+    free( loop );
+}
+
+void EvLoopRun( EvLoop_t *loop )
+{
+    unsigned int i;
+    loop->stopping = loop->live == 0;
+    for (i = 1; i < loop->thread_count; ++i) {
+        if (pthread_create( &loop->threads[i].thread, NULL, thread_run, &loop->threads[i] ))
+            DIE( __FILE__, __LINE__, "pthread_create failed\n" );
+    }
+    thread_run( &loop->threads[0] );
+    for (i = 1; i < loop->thread_count; ++i)
+        pthread_join( loop->threads[i].thread, NULL );
+}
+
+void EvLoopStop( EvLoop_t *loop )
+{
+    unsigned int i;
+    loop->stopping = 1;
+    for (i = 0; i < loop->thread_count; ++i)
+        thread_wake( &loop->threads[i] );
+}
+
+EvConnection_t *EvLoopConnect( EvLoop_t *loop, const char *host, const char *port,
+                               EvHandler_t *handler, void *context )
+{
+    struct addrinfo *addr = resolve( host, port, false );
+    struct addrinfo *a;
+    int fd = -1;
+    bool connecting = false;
+
+    if (!addr) return NULL;
+    for (a = addr; a; a = a->ai_next) {
+        fd = socket( a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     a->ai_protocol );
+        if (fd < 0) continue;
+        if (connect( fd, a->ai_addr, a->ai_addrlen ) == 0) break;
+        if (errno == EINPROGRESS) {
+            connecting = true;
+            break;
+        }
+        close( fd );
+        fd = -1;
+    }
+    freeaddrinfo( addr );
+    if (fd < 0) {
+        LOG( "evloop: cannot connect to %s:%s: %s\n", host, port, strerror(errno) );
+        return NULL;
+    }
+    int one = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+    EvConnection_t *conn = connection_new( loop, fd, false, host, handler, context );
+    conn->connecting = connecting;
+    connection_assign( loop, conn );
+    return conn;
+}
+
+int EvLoopListen( EvLoop_t *loop, const char *host, const char *port,
+                  EvHandler_t *handler, void *context )
+{
+    struct addrinfo *addr = resolve( host, port, true );
+    struct epoll_event ev;
+    int fd, one = 1;
+
+    if (!addr) {
+        errno = EINVAL;
+        return -1;
+    }
+    fd = socket( addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 addr->ai_protocol );
+    if (fd < 0 ||
+        setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) ) ||
+        bind( fd, addr->ai_addr, addr->ai_addrlen ) ||
+        listen( fd, 1024 )) {
+        int error = errno;
+        if (fd >= 0) close( fd );
+        freeaddrinfo( addr );
+        errno = error;
+        return -1;
+    }
+    freeaddrinfo( addr );
+
+    // the listener lives on thread 0 and deals out its connections
+    EvThread_t *t = &loop->threads[0];
+    EvListener_t *l = (EvListener_t *) calloc( 1, sizeof(EvListener_t) );
+    check( l, "Out of memory." );
+    l->source.kind = SOURCE_LISTENER;
+    l->source.fd = fd;
+    l->handler = handler;
+    l->context = context;
+    memset( &ev, 0, sizeof(ev) );
+    ev.events = EPOLLIN;
+    ev.data.ptr = &l->source;
+    check( epoll_ctl( t->epfd, EPOLL_CTL_ADD, fd, &ev ) == 0, "epoll_ctl failed." );
+    pthread_mutex_lock( &t->lock );
+    l->next = t->listeners;
+    t->listeners = l;
+    pthread_mutex_unlock( &t->lock );
+    __sync_add_and_fetch( &loop->live, 1 );
+    return 0;
+}
+
+pn_connection_t *EvConnectionProton( EvConnection_t *conn )
+{
+    return conn->connection;
+}
+
+unsigned int EvConnectionThread( EvConnection_t *conn )
+{
+    return conn->thread->index;
+}
+
+bool EvConnectionIsServer( EvConnection_t *conn )
+{
+    return conn->server;
+}
+
+void *EvConnectionGetContext( EvConnection_t *conn )
+{
+    return conn->user_context;
+}
+
+void EvConnectionSetContext( EvConnection_t *conn, void *context )
+{
+    conn->user_context = context;
+}
+
+void EvConnectionSetInputTap( EvConnection_t *conn, EvInputTap_t *tap, void *context )
+{
+    conn->tap = tap;
+    conn->tap_context = context;
+}
+
+void EvConnectionWake( EvConnection_t *conn )
+{
+    EvThread_t *t = conn->thread;
+    if (__sync_lock_test_and_set( &conn->woken, 1 )) return;  // already queued
+    pthread_mutex_lock( &t->lock );
+    conn->next_woken = t->woken;
+    t->woken = conn;
+    pthread_mutex_unlock( &t->lock );
+    thread_wake( t );
+}
+
+int EvAddressParse( const char *address, char *host, size_t host_size,
+                    char *port, size_t port_size, const char **name )
+{
+    const char *p = strstr( address, "://" );
+    const char *end, *colon;
+    size_t len;
+
+    p = p ? p + 3 : address;
+    if (*p == '~') p++;
+    end = p + strcspn( p, "/" );
+    *name = *end ? end + 1 : end;
+
+    colon = memchr( p, ':', end - p );
+    len = (colon ? colon : end) - p;
+    if (len >= host_size) return -1;
+    memcpy( host, p, len );
+    host[len] = '\0';
+
+    if (colon) {
+        len = end - colon - 1;
+        if (len >= port_size) return -1;
+        memcpy( port, colon + 1, len );
+        port[len] = '\0';
+    } else {
+        if (port_size < sizeof("5672")) return -1;
+        strcpy( port, "5672" );
+    }
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "perfcounters.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_MAX_EVENTS 4
+
+typedef struct {
+    const char *name;       // for the report
+    const char *key;        // for the RESULT line
+    uint32_t type;
+    uint64_t config;
+} PerfEvent_t;
+
+static const PerfEvent_t hardware_events[] = {
+    { "cycles", "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache misses", "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch misses", "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+static const PerfEvent_t software_events[] = {
+    { "task clock ns", "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "context switches", "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "page faults", "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+};
+
+struct PerfCounters_s {
+    const PerfEvent_t *events;
+    unsigned int count;
+    bool hardware;
+    bool user_only;
+    int fds[PERF_MAX_EVENTS];
+    uint64_t start[PERF_MAX_EVENTS];
+    uint64_t values[PERF_MAX_EVENTS];   // sum of the measured sections
+};
+
+
+static int open_event( const PerfEvent_t *event, bool user_only )
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.inherit = 1;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    // the PMU may be shared between more events than it has counters
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+// all of a set of events, or none
+static bool open_events( PerfCounters_t *pc, const PerfEvent_t *events,
+                         unsigned int count, bool user_only )
+{
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        pc->fds[i] = open_event( &events[i], user_only );
+        if (pc->fds[i] < 0) {
+            int error = errno;
+            while (i > 0) close( pc->fds[--i] );
+            errno = error;
+            return false;
+        }
+    }
+    pc->events = events;
+    pc->count = count;
+    pc->user_only = user_only;
+    return true;
+}
+
+// the count so far, scaled up for the time the event was not scheduled
+static uint64_t read_event( int fd )
+{
+    uint64_t data[3];   // value, time enabled, time running
+    if (read( fd, data, sizeof(data) ) != sizeof(data) || !data[2])
+        return 0;
+    if (data[2] < data[1])
+        return (uint64_t) ((double) data[0] * data[1] / data[2]);
+    return data[0];
+}
+
+PerfCounters_t *PerfCountersNew( void )
+{
+    PerfCounters_t *pc = (PerfCounters_t *) calloc( 1, sizeof(PerfCounters_t) );
+    check( pc, "Out of memory." );
+    unsigned int hw = sizeof(hardware_events) / sizeof(hardware_events[0]);
+    unsigned int sw = sizeof(software_events) / sizeof(software_events[0]);
+
+    if (open_events( pc, hardware_events, hw, false )
+        || open_events( pc, hardware_events, hw, true )) {
+        pc->hardware = true;
+        return pc;
+    }
+    LOG( "perfcounters: no hardware counters (%s), using software counters\n",
+         strerror(errno) );
+    if (open_events( pc, software_events, sw, false )
+        || open_events( pc, software_events, sw, true ))
+        return pc;
+    LOG( "perfcounters: perf_event_open failed: %s\n", strerror(errno) );
+    free( pc );
+    return NULL;
+}
+
+void PerfCountersFree( PerfCounters_t *pc )
+{
+    unsigned int i;
+    if (!pc) return;
+    for (i = 0; i < pc->count; ++i) close( pc->fds[i] );
+    free( pc );
+}
+
+void PerfCountersStart( PerfCounters_t *pc )
+{
+    unsigned int i;
+    if (!pc) return;
+    for (i = 0; i < pc->count; ++i) pc->start[i] = read_event( pc->fds[i] );
+}
+
+void PerfCountersStop( PerfCounters_t *pc )
+{
+    unsigned int i;
+    if (!pc) return;
+    for (i = 0; i < pc->count; ++i) {
+        uint64_t value = read_event( pc->fds[i] );
+        if (value > pc->start[i]) pc->values[i] += value - pc->start[i];
+    }
+}
+
+void PerfCountersReport( PerfCounters_t *pc, uint64_t messages, FILE *out )
+{
+    unsigned int i;
+    if (!pc || !messages) return;
+    fprintf( out, "Per message:" );
+    for (i = 0; i < pc->count; ++i)
+        fprintf( out, "%s %.2f %s", i ? "," : "",
+                 (double) pc->values[i] / messages, pc->events[i].name );
+    // instructions per cycle
+    if (pc->hardware && pc->values[0])
+        fprintf( out, " (IPC %.2f)", (double) pc->values[1] / pc->values[0] );
+    fprintf( out, "%s%s\n", pc->hardware ? "" : " [software counters]",
+             pc->user_only ? " [user space only]" : "" );
+}
+
+void PerfCountersResult( PerfCounters_t *pc, uint64_t messages, FILE *out )
+{
+    unsigned int i;
+    if (!pc || !messages) return;
+    for (i = 0; i < pc->count; ++i)
+        fprintf( out, " %s_per_msg=%f", pc->events[i].key,
+                 (double) pc->values[i] / messages );
+}
@@ -0,0 +1,102 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "common.h"
+#include "ring.h"
+
+#include <string.h>
+
+#define RING_CACHE_LINE 64
+
+// head and tail count the bytes ever written and read; only the
+// producer stores head, only the consumer stores tail
+struct Ring_s {
+    volatile uint64_t head;
+    char pad1[RING_CACHE_LINE - sizeof(uint64_t)];
+    volatile uint64_t tail;
+    char pad2[RING_CACHE_LINE - sizeof(uint64_t)];
+    uint64_t capacity;
+    uint64_t mask;
+    char pad3[RING_CACHE_LINE - 2 * sizeof(uint64_t)];
+    char data[];
+};
+
+
+size_t RingMemorySize( size_t capacity )
+{
+    return sizeof(Ring_t) + capacity;
+}
+
+Ring_t *RingInit( void *memory, size_t capacity )
+{
+    Ring_t *ring = (Ring_t *) memory;
+    check( capacity && (capacity & (capacity - 1)) == 0,
+           "Ring capacity must be a power of 2." );
+    memset( ring, 0, sizeof(Ring_t) );
+    ring->capacity = capacity;
+    ring->mask = capacity - 1;
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    return ring;
+}
+
+size_t RingReadable( Ring_t *ring )
+{
+    return __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE ) - ring->tail;
+}
+
+size_t RingWritable( Ring_t *ring )
+{
+    return ring->capacity - (ring->head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ));
+}
+
+size_t RingWrite( Ring_t *ring, const void *data, size_t size )
+{
+    uint64_t head = ring->head;
+    size_t space = ring->capacity - (head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ));
+    size_t offset = head & ring->mask;
+    size_t first;
+
+    if (size > space) size = space;
+    if (!size) return 0;
+    // copy in up to two pieces, around the end of the buffer
+    first = ring->capacity - offset;
+    if (first > size) first = size;
+    memcpy( ring->data + offset, data, first );
+    memcpy( ring->data, (const char *) data + first, size - first );
+    __atomic_store_n( &ring->head, head + size, __ATOMIC_RELEASE );
+    return size;
+}
+
+size_t RingRead( Ring_t *ring, void *data, size_t size )
+{
+    uint64_t tail = ring->tail;
+    size_t avail = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE ) - tail;
+    size_t offset = tail & ring->mask;
+    size_t first;
+
+    if (size > avail) size = avail;
+    if (!size) return 0;
+    first = ring->capacity - offset;
+    if (first > size) first = size;
+    memcpy( data, ring->data + offset, first );
+    memcpy( (char *) data + first, ring->data, size - first );
+    __atomic_store_n( &ring->tail, tail + size, __ATOMIC_RELEASE );
+    return size;
+}
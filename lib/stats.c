@@ -0,0 +1,263 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STATS_MAGIC        0x53544154   // "STAT"
+#define STATS_PREFIX       "proton-stats."
+#define STATS_SHM_DIR      "/dev/shm"
+#define STATS_NAME_SIZE    32
+#define STATS_PROCESS_SIZE 64
+#define STATS_CACHE_LINE   64
+
+// Segment layout: the header, an entry per statistic, then the slots,
+// each starting on a cache line.  The creator sets magic last.
+typedef struct {
+    volatile uint32_t magic;
+    uint32_t count;
+    uint32_t slots;
+    uint32_t stride;          // values per slot
+    int32_t pid;
+    char process[STATS_PROCESS_SIZE];
+} StatsHeader_t;
+
+typedef struct {
+    char name[STATS_NAME_SIZE];
+    uint32_t kind;
+} StatsEntry_t;
+
+struct Stats_s {
+    StatsHeader_t *header;
+    StatsEntry_t *entries;
+    uint64_t *values;
+    size_t size;
+    bool owner;
+    char segment[64];
+};
+
+
+static size_t round_up( size_t n )
+{
+    return (n + STATS_CACHE_LINE - 1) & ~(size_t)(STATS_CACHE_LINE - 1);
+}
+
+static size_t values_offset( unsigned int count )
+{
+    return round_up( sizeof(StatsHeader_t) + count * sizeof(StatsEntry_t) );
+}
+
+static bool is_running( pid_t pid )
+{
+    return kill( pid, 0 ) == 0 || errno == EPERM;
+}
+
+// map a segment, checking that it is complete
+static Stats_t *map_segment( const char *segment, bool owner, size_t size )
+{
+    int fd = shm_open( segment, owner ? O_RDWR : O_RDONLY, 0 );
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (!owner) {
+        if (fstat( fd, &st ) || (size_t) st.st_size < sizeof(StatsHeader_t)) {
+            close( fd );
+            return NULL;
+        }
+        size = st.st_size;
+    }
+    void *memory = mmap( NULL, size, owner ? PROT_READ | PROT_WRITE : PROT_READ,
+                         MAP_SHARED, fd, 0 );
+    close( fd );
+    if (memory == MAP_FAILED) return NULL;
+
+    Stats_t *stats = (Stats_t *) calloc( 1, sizeof(Stats_t) );
+    check( stats, "Out of memory." );
+    stats->header = (StatsHeader_t *) memory;
+    stats->entries = (StatsEntry_t *) &stats->header[1];
+    stats->size = size;
+    stats->owner = owner;
+    snprintf( stats->segment, sizeof(stats->segment), "%s", segment );
+    if (!owner) {
+        StatsHeader_t *h = stats->header;
+        if (h->magic != STATS_MAGIC
+            || values_offset( h->count ) + (size_t) h->slots * h->stride * sizeof(uint64_t) > size) {
+            StatsFree( stats );
+            return NULL;
+        }
+        __atomic_thread_fence( __ATOMIC_ACQUIRE );
+        stats->values = (uint64_t *) ((char *) memory + values_offset( h->count ));
+    }
+    return stats;
+}
+
+static void segment_name( pid_t pid, char *name, size_t size )
+{
+    snprintf( name, size, "/" STATS_PREFIX "%ld", (long) pid );
+}
+
+void StatsList( void (*found)( pid_t pid, const char *process, int running,
+                               void *context ),
+                void *context )
+{
+    DIR *dir = opendir( STATS_SHM_DIR );
+    struct dirent *entry;
+    if (!dir) return;
+    while ((entry = readdir( dir ))) {
+        long pid;
+        char *end;
+        if (strncmp( entry->d_name, STATS_PREFIX, strlen(STATS_PREFIX) )) continue;
+        pid = strtol( entry->d_name + strlen(STATS_PREFIX), &end, 10 );
+        if (*end || pid <= 0) continue;
+        Stats_t *stats = StatsAttach( (pid_t) pid );
+        found( (pid_t) pid, stats ? StatsProcess( stats ) : "?",
+               is_running( (pid_t) pid ), context );
+        StatsFree( stats );
+    }
+    closedir( dir );
+}
+
+// a process killed by a signal leaves its segment behind
+static void remove_stale( pid_t pid, const char *process, int running, void *context )
+{
+    char segment[64];
+    if (running) return;
+    segment_name( pid, segment, sizeof(segment) );
+    LOG( "stats: removing %s, left by %s\n", segment, process );
+    shm_unlink( segment );
+}
+
+Stats_t *StatsNew( const char *process, const StatsDef_t *defs,
+                   unsigned int count, unsigned int slots )
+{
+    char segment[64];
+    unsigned int i;
+    int fd;
+
+    StatsList( remove_stale, NULL );
+
+    unsigned int stride = round_up( count * sizeof(uint64_t) ) / sizeof(uint64_t);
+    size_t size = values_offset( count ) + (size_t) slots * stride * sizeof(uint64_t);
+    segment_name( getpid(), segment, sizeof(segment) );
+    fd = shm_open( segment, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if (fd < 0 || ftruncate( fd, size )) {
+        LOG( "stats: cannot create %s: %s\n", segment, strerror(errno) );
+        if (fd >= 0) {
+            close( fd );
+            shm_unlink( segment );
+        }
+        return NULL;
+    }
+    close( fd );
+    Stats_t *stats = map_segment( segment, true, size );
+    if (!stats) {
+        LOG( "stats: cannot map %s: %s\n", segment, strerror(errno) );
+        shm_unlink( segment );
+        return NULL;
+    }
+
+    StatsHeader_t *h = stats->header;
+    h->count = count;
+    h->slots = slots;
+    h->stride = stride;
+    h->pid = getpid();
+    snprintf( h->process, sizeof(h->process), "%s", process );
+    for (i = 0; i < count; ++i) {
+        snprintf( stats->entries[i].name, STATS_NAME_SIZE, "%s", defs[i].name );
+        stats->entries[i].kind = defs[i].kind;
+    }
+    stats->values = (uint64_t *) ((char *) h + values_offset( count ));
+    __atomic_store_n( &h->magic, STATS_MAGIC, __ATOMIC_RELEASE );
+    return stats;
+}
+
+Stats_t *StatsAttach( pid_t pid )
+{
+    char segment[64];
+    segment_name( pid, segment, sizeof(segment) );
+    return map_segment( segment, false, 0 );
+}
+
+void StatsFree( Stats_t *stats )
+{
+    if (!stats) return;
+    munmap( stats->header, stats->size );
+    if (stats->owner) shm_unlink( stats->segment );
+    free( stats );
+}
+
+uint64_t *StatsSlot( Stats_t *stats, unsigned int i )
+{
+    if (!stats) return NULL;
+    check( i < stats->header->slots, "Invalid statistics slot." );
+    return stats->values + (size_t) i * stats->header->stride;
+}
+
+const char *StatsProcess( Stats_t *stats )
+{
+    return stats->header->process;
+}
+
+unsigned int StatsCount( Stats_t *stats )
+{
+    return stats->header->count;
+}
+
+unsigned int StatsSlots( Stats_t *stats )
+{
+    return stats->header->slots;
+}
+
+const char *StatsName( Stats_t *stats, unsigned int id )
+{
+    return stats->entries[id].name;
+}
+
+StatsKind_t StatsKind( Stats_t *stats, unsigned int id )
+{
+    return (StatsKind_t) stats->entries[id].kind;
+}
+
+uint64_t StatsReadSlot( Stats_t *stats, unsigned int slot, unsigned int id )
+{
+    return __atomic_load_n( &stats->values[(size_t) slot * stats->header->stride + id],
+                            __ATOMIC_RELAXED );
+}
+
+uint64_t StatsRead( Stats_t *stats, unsigned int id )
+{
+    uint64_t total = 0;
+    unsigned int i;
+    for (i = 0; i < stats->header->slots; ++i)
+        total += StatsReadSlot( stats, i, id );
+    return total;
+}
@@ -0,0 +1,153 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "common.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_BUCKETS 40   // log2 buckets: up to ~2^40 usec
+
+typedef struct Trace_s {
+    unsigned int stages;
+    const char * const *names;
+    uint64_t *records;     // capacity * stages timestamps
+    size_t capacity;
+    size_t next;           // slot for the next record
+    uint64_t total;        // records ever traced
+} Trace_t;
+
+
+Trace_t *TraceNew( unsigned int stages, const char * const *names, size_t capacity )
+{
+    Trace_t *trace = (Trace_t *) calloc( 1, sizeof(Trace_t) );
+    check( trace, "Out of memory." );
+    trace->stages = stages;
+    trace->names = names;
+    trace->capacity = capacity ? capacity : 1;
+    trace->records = (uint64_t *) calloc( trace->capacity * stages, sizeof(uint64_t) );
+    check( trace->records, "Out of memory." );
+    return trace;
+}
+
+void TraceFree( Trace_t *trace )
+{
+    if (trace) {
+        free( trace->records );
+        free( trace );
+    }
+}
+
+uint64_t *TraceNext( Trace_t *trace )
+{
+    uint64_t *record = &trace->records[trace->next * trace->stages];
+    memset( record, 0, trace->stages * sizeof(uint64_t) );
+    if (++trace->next == trace->capacity) trace->next = 0;
+    trace->total++;
+    return record;
+}
+
+
+static int compare_u64( const void *a, const void *b )
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static unsigned int bucket_of( uint64_t usec )
+{
+    unsigned int b = 0;
+    while (usec > 1 && b < TRACE_BUCKETS - 1) {
+        usec >>= 1;
+        b++;
+    }
+    return b;
+}
+
+static void dump_interval( Trace_t *trace, FILE *out, unsigned int from,
+                           unsigned int to, uint64_t *deltas )
+{
+    size_t used = trace->total < trace->capacity ? trace->total : trace->capacity;
+    size_t count = 0;
+    size_t i;
+    uint64_t sum = 0;
+    uint64_t buckets[TRACE_BUCKETS];
+    uint64_t peak = 0;
+    unsigned int b, lo = TRACE_BUCKETS, hi = 0;
+
+    for (i = 0; i < used; ++i) {
+        const uint64_t *r = &trace->records[i * trace->stages];
+        // clocks of different hosts may disagree, clamp at zero
+        if (r[from] && r[to])
+            deltas[count++] = r[to] > r[from] ? r[to] - r[from] : 0;
+    }
+
+    fprintf( out, "%s -> %s:", trace->names[from], trace->names[to] );
+    if (!count) {
+        fprintf( out, " no samples\n" );
+        return;
+    }
+
+    qsort( deltas, count, sizeof(uint64_t), compare_u64 );
+    memset( buckets, 0, sizeof(buckets) );
+    for (i = 0; i < count; ++i) {
+        sum += deltas[i];
+        b = bucket_of( deltas[i] );
+        buckets[b]++;
+        if (b < lo) lo = b;
+        if (b > hi) hi = b;
+    }
+    fprintf( out, " %lu samples, usec: min %lu p50 %lu p90 %lu p99 %lu max %lu mean %.1f\n",
+             (unsigned long) count,
+             (unsigned long) deltas[0],
+             (unsigned long) deltas[count / 2],
+             (unsigned long) deltas[(count * 9) / 10],
+             (unsigned long) deltas[(count * 99) / 100],
+             (unsigned long) deltas[count - 1],
+             (double) sum / count );
+
+    for (b = lo; b <= hi; ++b)
+        if (buckets[b] > peak) peak = buckets[b];
+    for (b = lo; b <= hi; ++b) {
+        int width = (int) ((buckets[b] * 50 + peak - 1) / peak);
+        fprintf( out, "  < %12lu usec %10lu |%.*s\n",
+                 (unsigned long) (2ULL << b), (unsigned long) buckets[b], width,
+                 "##################################################" );
+    }
+}
+
+void TraceDump( Trace_t *trace, FILE *out )
+{
+    size_t used = trace->total < trace->capacity ? trace->total : trace->capacity;
+    uint64_t *deltas = (uint64_t *) malloc( (used ? used : 1) * sizeof(uint64_t) );
+    unsigned int s;
+
+    check( deltas, "Out of memory." );
+    fprintf( out, "Per-stage latency (last %lu of %lu traced):\n",
+             (unsigned long) used, (unsigned long) trace->total );
+    for (s = 0; s + 1 < trace->stages; ++s)
+        dump_interval( trace, out, s, s + 1, deltas );
+    if (trace->stages > 2)
+        dump_interval( trace, out, 0, trace->stages - 1, deltas );
+    fflush( out );
+    free( deltas );
+}
@@ -0,0 +1,457 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "proton/message.h"
+#include "proton/engine.h"
+#include "proton/event.h"
+#include "ring.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+//
+// Connects a sending and a receiving pn_transport_t through two
+// single-producer/single-consumer rings in shared memory, so the cost of
+// the protocol engine (message encode, framing, decode and settlement)
+// can be measured without the kernel socket path.  The two sides run on
+// two threads, or in two processes (-m fork).  The data path makes no
+// system calls: an idle side spins, and only yields the CPU after a
+// while without progress.  The CPU time reported per side is the busy
+// time; the time spent spinning is reported separately.
+//
+
+void die(const char *file, int line, const char *message)
+{
+  fprintf(stderr, "%s:%i: %s\n", file, line, message);
+  exit(1);
+}
+
+// spins without progress before yielding the CPU
+#define IDLE_SPINS 1000
+
+#define NEED_INIT   (PN_LOCAL_UNINIT | PN_REMOTE_ACTIVE)
+
+typedef struct options_t {
+  uint64_t msg_count;
+  uint32_t msg_size;
+  uint32_t ring_kb;
+  int credit;
+  int fork;
+  int presettled;
+} options_t;
+
+// results of each side, in the shared memory
+typedef struct side_result_t {
+  uint64_t messages;
+  uint64_t cpu_nsec;      // excluding the idle iterations
+  uint64_t idle_nsec;
+  uint64_t idle_spins;
+} side_result_t;
+
+typedef struct shared_t {
+  volatile int ready;
+  side_result_t sender;
+  side_result_t receiver;
+} shared_t;
+
+typedef struct side_t {
+  const options_t *opts;
+  shared_t *shared;
+  Ring_t *in;
+  Ring_t *out;
+  pn_connection_t *connection;
+  pn_transport_t *transport;
+  pn_collector_t *collector;
+  pn_link_t *link;
+  pn_message_t *message;
+  char *buffer;
+  size_t buffer_size;
+  uint64_t sent;
+  uint64_t done;        // acked (sender) or received (receiver)
+} side_t;
+
+static void usage(int rc)
+{
+  printf("Usage: perf-loopback [options]\n");
+  printf("-c    \tNumber of messages to send [1000000]\n");
+  printf("-s    \tSize of message body in bytes [1024]\n");
+  printf("-r    \tCredit granted by the receiver [1024]\n");
+  printf("-b    \tSize of each ring in KB, a power of 2 [256]\n");
+  printf("-m    \tthreads|fork: run the receiver on a thread or in a child process [threads]\n");
+  printf("-P    \tSend presettled (no acknowledgements)\n");
+  exit(rc);
+}
+
+static void parse_options( int argc, char **argv, options_t *opts )
+{
+  int c;
+  opterr = 0;
+
+  memset( opts, 0, sizeof(*opts) );
+  opts->msg_count = 1000000;
+  opts->msg_size = 1024;
+  opts->credit = 1024;
+  opts->ring_kb = 256;
+
+  while((c = getopt(argc, argv, "hc:s:r:b:m:P")) != -1) {
+    switch(c) {
+    case 'c':
+      if (sscanf( optarg, "%" SCNu64, &opts->msg_count ) != 1) {
+        fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
+    case 's':
+      if (sscanf( optarg, "%u", &opts->msg_size ) != 1) {
+        fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
+    case 'r':
+      if (sscanf( optarg, "%d", &opts->credit ) != 1 || opts->credit <= 0) {
+        fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
+    case 'b':
+      if (sscanf( optarg, "%u", &opts->ring_kb ) != 1
+          || !opts->ring_kb || (opts->ring_kb & (opts->ring_kb - 1))) {
+        fprintf(stderr, "Option -%c requires a power of 2.\n", optopt);
+        usage(1);
+      }
+      break;
+    case 'm':
+      if (!strcmp(optarg, "fork")) opts->fork = 1;
+      else if (!strcmp(optarg, "threads")) opts->fork = 0;
+      else usage(1);
+      break;
+    case 'P': opts->presettled = 1; break;
+    case 'h': usage(0); break;
+    default:
+      usage(1);
+    }
+  }
+}
+
+static uint64_t clock_nsec(clockid_t clock)
+{
+  struct timespec ts;
+  if (clock_gettime(clock, &ts)) abort();
+  return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static void side_init(side_t *side, const options_t *opts, shared_t *shared,
+                      Ring_t *in, Ring_t *out)
+{
+  memset(side, 0, sizeof(*side));
+  side->opts = opts;
+  side->shared = shared;
+  side->in = in;
+  side->out = out;
+  side->connection = pn_connection();
+  side->collector = pn_collector();
+  side->transport = pn_transport();
+  side->message = pn_message();
+  side->buffer_size = opts->msg_size + 1024;
+  side->buffer = malloc(side->buffer_size);
+  if (!side->connection || !side->collector || !side->transport
+      || !side->message || !side->buffer)
+    die(__FILE__, __LINE__, "Out of memory");
+  pn_connection_collect(side->connection, side->collector);
+  pn_transport_bind(side->transport, side->connection);
+}
+
+static void side_free(side_t *side)
+{
+  pn_transport_unbind(side->transport);
+  pn_transport_free(side->transport);
+  pn_connection_free(side->connection);
+  pn_collector_free(side->collector);
+  pn_message_free(side->message);
+  free(side->buffer);
+}
+
+// move bytes between the rings and the transport, returns true if any moved
+static int side_io(side_t *side)
+{
+  int progress = 0;
+  ssize_t capacity = pn_transport_capacity(side->transport);
+  if (capacity > 0) {
+    size_t n = RingRead(side->in, pn_transport_tail(side->transport), capacity);
+    if (n) {
+      pn_transport_process(side->transport, n);
+      progress = 1;
+    }
+  }
+  ssize_t pending = pn_transport_pending(side->transport);
+  if (pending > 0) {
+    size_t n = RingWrite(side->out, pn_transport_head(side->transport), pending);
+    if (n) {
+      pn_transport_pop(side->transport, n);
+      progress = 1;
+    }
+  }
+  return progress;
+}
+
+static void sender_pump(side_t *side)
+{
+  const options_t *opts = side->opts;
+  while (side->sent < opts->msg_count && pn_link_credit(side->link) > 0) {
+    size_t size = side->buffer_size;
+    int rc = pn_message_encode(side->message, side->buffer, &size);
+    if (rc == PN_OVERFLOW) {
+      side->buffer_size *= 2;
+      side->buffer = realloc(side->buffer, side->buffer_size);
+      if (!side->buffer) die(__FILE__, __LINE__, "Out of memory");
+      continue;
+    }
+    if (rc) die(__FILE__, __LINE__, "pn_message_encode() failed");
+    uint64_t tag = side->sent++;
+    pn_delivery_t *dlv = pn_delivery(side->link, pn_dtag((const char *) &tag, sizeof(tag)));
+    pn_link_send(side->link, side->buffer, size);
+    pn_link_advance(side->link);
+    if (opts->presettled) {
+      pn_delivery_settle(dlv);
+      side->done++;
+    }
+  }
+}
+
+static void sender_event(side_t *side, pn_event_t *event)
+{
+  pn_delivery_t *dlv = pn_event_delivery(event);
+  if (dlv && pn_delivery_updated(dlv)) {
+    pn_delivery_settle(dlv);
+    side->done++;
+  }
+  if (pn_event_link(event)) sender_pump(side);
+}
+
+static void receiver_event(side_t *side, pn_event_t *event)
+{
+  pn_delivery_t *dlv = pn_event_delivery(event);
+  pn_link_t *link = pn_event_link(event);
+  pn_session_t *ssn = pn_event_session(event);
+
+  if (dlv) {
+    if (!pn_delivery_readable(dlv) || pn_delivery_partial(dlv)) return;
+    size_t size = pn_delivery_pending(dlv);
+    if (size > side->buffer_size) {
+      side->buffer_size = size;
+      side->buffer = realloc(side->buffer, size);
+      if (!side->buffer) die(__FILE__, __LINE__, "Out of memory");
+    }
+    ssize_t n = pn_link_recv(link, side->buffer, size);
+    pn_link_advance(link);
+    if (n < 0 || pn_message_decode(side->message, side->buffer, n))
+      die(__FILE__, __LINE__, "pn_message_decode() failed");
+    if (!pn_delivery_settled(dlv)) pn_delivery_update(dlv, PN_ACCEPTED);
+    pn_delivery_settle(dlv);
+    side->done++;
+    int credit = pn_link_credit(link);
+    if (credit < side->opts->credit / 2)
+      pn_link_flow(link, side->opts->credit - credit);
+  } else if (link) {
+    if ((pn_link_state(link) & NEED_INIT) == NEED_INIT) {
+      pn_terminus_copy(pn_link_source(link), pn_link_remote_source(link));
+      pn_terminus_copy(pn_link_target(link), pn_link_remote_target(link));
+      pn_link_open(link);
+      pn_link_flow(link, side->opts->credit);
+    }
+  } else if (ssn) {
+    if ((pn_session_state(ssn) & NEED_INIT) == NEED_INIT) pn_session_open(ssn);
+  } else if ((pn_connection_state(side->connection) & NEED_INIT) == NEED_INIT) {
+    pn_connection_open(side->connection);
+  }
+}
+
+static void run_side(side_t *side, int sender, side_result_t *result)
+{
+  uint64_t count = side->opts->msg_count;
+  uint64_t idle = 0;
+  uint64_t idle_nsec = 0;
+  uint64_t idle_from = 0;   // CPU time at which the side went idle
+  int spins = 0;
+  // keep going until the last frames the peer waits for are out: the
+  // transfers when presettled, else the dispositions
+  int flush = sender ? side->opts->presettled : !side->opts->presettled;
+
+  // start together
+  __sync_add_and_fetch(&side->shared->ready, 1);
+  while (side->shared->ready < 2) cpu_relax();
+  uint64_t cpu_start = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+
+  while (side->done < count
+         || (flush && pn_transport_pending(side->transport) > 0)) {
+    // only read the clock while idle, when it costs nothing
+    uint64_t top = idle_from ? clock_nsec(CLOCK_THREAD_CPUTIME_ID) : 0;
+    int progress = side_io(side);
+    pn_event_t *event;
+    while ((event = pn_collector_peek(side->collector))) {
+      if (sender) sender_event(side, event);
+      else receiver_event(side, event);
+      pn_collector_pop(side->collector);
+      progress = 1;
+    }
+    if (progress) {
+      if (idle_from) {
+        idle_nsec += top - idle_from;
+        idle_from = 0;
+      }
+      spins = 0;
+    } else {
+      if (!idle_from) idle_from = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+      if (++spins < IDLE_SPINS) {
+        idle++;
+        cpu_relax();
+      } else {
+        spins = 0;
+        sched_yield();
+      }
+    }
+  }
+  uint64_t cpu_end = clock_nsec(CLOCK_THREAD_CPUTIME_ID);
+  if (idle_from) idle_nsec += cpu_end - idle_from;
+  result->cpu_nsec = cpu_end - cpu_start - idle_nsec;
+  result->idle_nsec = idle_nsec;
+  result->messages = side->done;
+  result->idle_spins = idle;
+}
+
+typedef struct receiver_arg_t {
+  const options_t *opts;
+  shared_t *shared;
+  Ring_t *in;
+  Ring_t *out;
+} receiver_arg_t;
+
+static void *receiver_main(void *context)
+{
+  receiver_arg_t *arg = (receiver_arg_t *) context;
+  side_t side;
+  side_init(&side, arg->opts, arg->shared, arg->in, arg->out);
+  run_side(&side, 0, &arg->shared->receiver);
+  side_free(&side);
+  return NULL;
+}
+
+int main(int argc, char** argv)
+{
+  options_t opts;
+  parse_options( argc, argv, &opts );
+
+  // one shared mapping: results, then a ring in each direction
+  size_t capacity = (size_t) opts.ring_kb * 1024;
+  size_t ring_size = (RingMemorySize(capacity) + 63) & ~(size_t) 63;
+  size_t shared_size = ((sizeof(shared_t) + 63) & ~(size_t) 63) + 2 * ring_size;
+  char *memory = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) die(__FILE__, __LINE__, "mmap failed");
+  shared_t *shared = (shared_t *) memory;
+  char *rings = memory + ((sizeof(shared_t) + 63) & ~(size_t) 63);
+  Ring_t *to_receiver = RingInit(rings, capacity);
+  Ring_t *to_sender = RingInit(rings + ring_size, capacity);
+
+  receiver_arg_t arg = { &opts, shared, to_receiver, to_sender };
+  pthread_t thread;
+  pid_t child = 0;
+  if (opts.fork) {
+    child = fork();
+    if (child < 0) die(__FILE__, __LINE__, "fork failed");
+    if (child == 0) {
+      receiver_main(&arg);
+      _exit(0);
+    }
+  } else if (pthread_create(&thread, NULL, receiver_main, &arg)) {
+    die(__FILE__, __LINE__, "pthread_create failed");
+  }
+
+  // the sender runs here
+  side_t side;
+  side_init(&side, &opts, shared, to_sender, to_receiver);
+  pn_connection_open(side.connection);
+  pn_session_t *ssn = pn_session(side.connection);
+  pn_session_open(ssn);
+  side.link = pn_sender(ssn, "loopback");
+  pn_terminus_set_address(pn_link_target(side.link), "loopback");
+  pn_link_open(side.link);
+  pn_data_t *body = pn_message_body(side.message);
+  char *data = calloc(1, opts.msg_size);
+  pn_data_put_binary(body, pn_bytes(opts.msg_size, data));
+  free(data);
+
+  uint64_t start = clock_nsec(CLOCK_MONOTONIC);
+  run_side(&side, 1, &shared->sender);
+
+  if (opts.fork) {
+    int status;
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status))
+      die(__FILE__, __LINE__, "receiver process failed");
+  } else {
+    pthread_join(thread, NULL);
+  }
+  uint64_t end = clock_nsec(CLOCK_MONOTONIC) - start;
+  side_free(&side);
+
+  uint64_t count = shared->receiver.messages;
+  double secs = end / 1000000000.0;
+  double wall_ns = count ? (double) end / count : 0.0;
+  double send_ns = count ? (double) shared->sender.cpu_nsec / count : 0.0;
+  double recv_ns = count ? (double) shared->receiver.cpu_nsec / count : 0.0;
+  fprintf(stdout, "Total time %f sec (%f msgs/sec), %.0f ns/msg\n",
+          secs, count / secs, wall_ns);
+  fprintf(stdout, "Busy CPU (idle spinning excluded): sender %.0f ns/msg (encode, send%s),"
+          " receiver %.0f ns/msg (recv, decode%s)\n",
+          send_ns, opts.presettled ? "" : ", settle",
+          recv_ns, opts.presettled ? "" : ", accept");
+  fprintf(stdout, "Idle: sender %" PRIu64 " spins %f sec CPU, receiver %" PRIu64
+          " spins %f sec CPU\n",
+          shared->sender.idle_spins, shared->sender.idle_nsec / 1000000000.0,
+          shared->receiver.idle_spins, shared->receiver.idle_nsec / 1000000000.0);
+  // machine readable summary, see benchmark/README.txt
+  fprintf(stdout, "RESULT role=loopback msgs=%" PRIu64 " secs=%f throughput=%f"
+          " ns_per_msg=%f sender_ns=%f receiver_ns=%f sender_idle_secs=%f"
+          " receiver_idle_secs=%f\n",
+          count, secs, count / secs, wall_ns, send_ns, recv_ns,
+          shared->sender.idle_nsec / 1000000000.0,
+          shared->receiver.idle_nsec / 1000000000.0);
+
+  munmap(memory, shared_size);
+  return count == opts.msg_count ? 0 : 1;
+}
@@ -18,23 +18,32 @@
  *
  */
 
+#define _XOPEN_SOURCE 600
+
 #include "proton/message.h"
 #include "proton/messenger.h"
+#include "proton/error.h"
+#include "evloop.h"
+#include "perfcounters.h"
+#include "stats.h"
 
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <sys/time.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 
-#define check(messenger)                                         \
-  {                                                              \
-    if(pn_messenger_errno(messenger))                            \
-    {                                                            \
-      die(__FILE__, __LINE__, pn_messenger_error(messenger));    \
-    }                                                            \
-  }                                                              \
+#define check(messenger)                                                       \
+  {                                                                            \
+    if(pn_messenger_errno(messenger))                                          \
+    {                                                                          \
+      die(__FILE__, __LINE__, pn_error_text(pn_messenger_error(messenger)));   \
+    }                                                                          \
+  }                                                                            \
 
 void die(const char *file, int line, const char *message)
 {
@@ -42,26 +51,61 @@ void die(const char *file, int line, const char *message)
   exit(1);
 }
 
+#define MAX_ADDRESSES 64
+
+// message property set by perf-send: the time the message was put
+#define PUT_PROPERTY "put-usec"
+
+// maximum number of latency samples kept for computing percentiles
+#define MAX_LATENCY_SAMPLES (1024 * 1024)
+
+// live statistics, see stats-top
+enum {
+  STAT_RECEIVED,
+  STAT_BYTES,
+  STAT_DECODE_ERRORS,
+  STAT_COUNT
+};
+static const StatsDef_t stat_defs[STAT_COUNT] = {
+  { "received", STATS_COUNTER },
+  { "bytes", STATS_COUNTER },
+  { "decode-errors", STATS_COUNTER }
+};
+
 typedef struct options_t {
-  char *address;
+  const char *addresses[MAX_ADDRESSES];
+  int address_count;
   uint64_t msg_count;
   int32_t credit;
   int window;
   char *certificate;
   char *privatekey;
   char *password;
+  char *ready_text;
+  int event_loop;
+  unsigned int threads;
+  const char *capture;
+  int counters;
 } options_t;
 
 static void usage(int rc)
 {
   printf("Usage: recv [options] <addr>\n");
   printf("-a    \tAddress to listen on [amqp://~0.0.0.0]\n");
+  printf("      \t(may be repeated)\n");
   printf("-c    \tNumber of messages to receive [0=forever]\n");
   printf("-r    \t# messages per call to recv [2048]\n");
   printf("-w    \tSize for incoming window\n");
   printf("-C    \tPath to the certificate file.\n");
   printf("-K    \tPath to the private key file.\n");
   printf("-P    \tPassword for the private key.\n");
+  printf("-X    \tPrint this text to stdout once listening.\n");
+  printf("-E    \tUse the epoll event loop instead of Messenger\n");
+  printf("      \t(-r is then the credit per link, -w and -C/-K/-P are ignored)\n");
+  printf("-T    \t# event loop threads, with -E [1]\n");
+  printf("-W    \tWrite the raw input of the first connection to this file,\n");
+  printf("      \twith -E (for perf-replay)\n");
+  printf("-H    \tCount CPU events (cycles, instructions, misses) per message\n");
   exit(rc);
 }
 
@@ -71,14 +115,20 @@ static void parse_options( int argc, char **argv, options_t *opts )
   opterr = 0;
 
   memset( opts, 0, sizeof(*opts) );
-  opts->address = "amqp://~0.0.0.0";
   opts->credit = 2048;
+  opts->threads = 1;
 
-  while((c = getopt(argc, argv, "ha:c:r:w:C:K:P:")) != -1)
+  while((c = getopt(argc, argv, "ha:c:r:w:C:K:P:X:ET:W:H")) != -1)
   {
     switch(c)
     {
-    case 'a': opts->address = optarg; break;
+    case 'a':
+      if (opts->address_count == MAX_ADDRESSES) {
+        fprintf(stderr, "Too many addresses (max %d).\n", MAX_ADDRESSES);
+        usage(1);
+      }
+      opts->addresses[opts->address_count++] = optarg;
+      break;
     case 'c':
       if (sscanf( optarg, "%lu", &opts->msg_count ) != 1) {
         fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
@@ -101,22 +151,347 @@ static void parse_options( int argc, char **argv, options_t *opts )
     case 'C': opts->certificate = optarg; break;
     case 'K': opts->privatekey = optarg; break;
     case 'P': opts->password = optarg; break;
+    case 'X': opts->ready_text = optarg; break;
+    case 'E': opts->event_loop = 1; break;
+    case 'W': opts->capture = optarg; break;
+    case 'H': opts->counters = 1; break;
+    case 'T':
+      if (sscanf( optarg, "%u", &opts->threads ) != 1 || opts->threads == 0) {
+        fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
 
     default:
       usage(1);
     }
   }
+
+  if (opts->address_count == 0) {
+    opts->addresses[opts->address_count++] = "amqp://~0.0.0.0";
+  }
+  if (opts->capture && !opts->event_loop) {
+    fprintf(stderr, "Option -W requires -E.\n");
+    usage(1);
+  }
 }
 
-//sigh
-pn_timestamp_t pn_i_now()
+static uint64_t now_usec()
 {
   struct timeval now;
   if (gettimeofday(&now, NULL)) abort();
-  return ((pn_timestamp_t)now.tv_sec) * 1000 + (now.tv_usec / 1000);
+  return ((uint64_t)now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+static uint64_t get_put_usec(pn_message_t *message)
+{
+  pn_data_t *props = pn_message_properties(message);
+  uint64_t put_usec = 0;
+
+  pn_data_rewind(props);
+  if (!pn_data_next(props) || pn_data_type(props) != PN_MAP) return 0;
+  pn_data_enter(props);
+  while (pn_data_next(props)) {
+    bool match = false;
+    if (pn_data_type(props) == PN_STRING) {
+      pn_bytes_t key = pn_data_get_string(props);
+      match = (key.size == sizeof(PUT_PROPERTY) - 1
+               && memcmp(key.start, PUT_PROPERTY, key.size) == 0);
+    }
+    if (!pn_data_next(props)) break;
+    if (match && pn_data_type(props) == PN_ULONG) {
+      put_usec = pn_data_get_ulong(props);
+      break;
+    }
+  }
+  pn_data_exit(props);
+  return put_usec;
+}
+
+// Latency samples, in usecs.  Once full, reservoir sampling keeps a
+// uniform random sample of all the latencies seen.
+typedef struct latency_t {
+  uint32_t *samples;
+  size_t capacity;
+  size_t count;
+  uint64_t seen;
+  double total;
+  uint32_t max;
+  unsigned short xsubi[3];
+} latency_t;
+
+static void latency_add(latency_t *lat, uint64_t put_usec, uint64_t now)
+{
+  uint32_t usec = (now > put_usec) ? (uint32_t)(now - put_usec) : 0;
+  lat->seen++;
+  lat->total += usec;
+  if (usec > lat->max) lat->max = usec;
+  if (lat->count < lat->capacity) {
+    lat->samples[lat->count++] = usec;
+  } else {
+    uint64_t j = ((uint64_t)nrand48(lat->xsubi) << 31 | nrand48(lat->xsubi)) % lat->seen;
+    if (j < lat->capacity) lat->samples[j] = usec;
+  }
+}
+
+static void latency_init(latency_t *lat, size_t capacity)
+{
+  memset(lat, 0, sizeof(*lat));
+  lat->capacity = capacity;
+  lat->samples = malloc(capacity * sizeof(uint32_t));
+  if (!lat->samples) die(__FILE__, __LINE__, "Out of memory");
+  lat->xsubi[0] = (unsigned short)getpid();
+}
+
+// Append the samples of src to dst (sized for both).  The result is
+// only a uniform sample if neither reservoir was full.
+static void latency_merge(latency_t *dst, const latency_t *src)
+{
+  memcpy(dst->samples + dst->count, src->samples, src->count * sizeof(uint32_t));
+  dst->count += src->count;
+  dst->seen += src->seen;
+  dst->total += src->total;
+  if (src->max > dst->max) dst->max = src->max;
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// in seconds, lat->samples must be sorted
+static double latency_percentile(const latency_t *lat, double p)
+{
+  size_t i = (size_t)(p / 100.0 * lat->count);
+  if (i >= lat->count) i = lat->count - 1;
+  return lat->samples[i] / 1000000.0;
 }
 
 
+// -H: CPU counters around the measured loop
+static PerfCounters_t *counters_open(const options_t *opts)
+{
+  if (!opts->counters) return NULL;
+  PerfCounters_t *pc = PerfCountersNew();
+  if (!pc) fprintf(stderr, "CPU counters unavailable (perf_event_open failed)\n");
+  return pc;
+}
+
+static void report(uint64_t count, uint64_t end, latency_t *lat, PerfCounters_t *pc)
+{
+  double secs = end/(double)1000000.0;
+  fprintf(stdout, "Total time %f sec (%f msgs/sec)\n",
+          secs, count/secs);
+  PerfCountersReport(pc, count, stdout);
+  // machine readable summary, see benchmark/README.txt
+  if (lat->count) {
+    qsort(lat->samples, lat->count, sizeof(uint32_t), compare_uint32);
+    fprintf(stdout, "Latency (sec): %f min %f max %f avg"
+            " (p50 %f p90 %f p99 %f)\n",
+            lat->samples[0] / 1000000.0, lat->max / 1000000.0,
+            lat->total / lat->seen / 1000000.0,
+            latency_percentile(lat, 50), latency_percentile(lat, 90),
+            latency_percentile(lat, 99));
+    fprintf(stdout, "RESULT role=receiver msgs=%" PRIu64 " secs=%f throughput=%f"
+            " latency=%f latency_p50=%f latency_p90=%f latency_p99=%f"
+            " latency_max=%f",
+            count, secs, count/secs, lat->total / lat->seen / 1000000.0,
+            latency_percentile(lat, 50), latency_percentile(lat, 90),
+            latency_percentile(lat, 99), lat->max / 1000000.0);
+  } else {
+    fprintf(stdout, "RESULT role=receiver msgs=%" PRIu64 " secs=%f throughput=%f",
+            count, secs, count/secs);
+  }
+  PerfCountersResult(pc, count, stdout);
+  fprintf(stdout, "\n");
+}
+
+//
+// Event loop (-E) backend: accepts any number of connections and links,
+// granting each receiver link -r credit.  Each loop thread decodes into
+// its own message and keeps its own latency samples.
+//
+
+typedef struct recv_thread_t {
+  pn_message_t *message;
+  char *buffer;
+  size_t buffer_size;
+  latency_t lat;
+  uint64_t *stat;
+} recv_thread_t;
+
+static const options_t *ev_opts;
+static int ev_credit;
+static EvLoop_t *ev_loop;
+static recv_thread_t *ev_threads;
+static volatile uint64_t ev_count;
+static volatile uint64_t ev_start;
+static volatile uint64_t ev_end;
+static EvConnection_t *volatile ev_captured;
+static FILE *ev_capture;
+static PerfCounters_t *ev_counters;
+
+#define NEED_INIT   (PN_LOCAL_UNINIT | PN_REMOTE_ACTIVE)
+#define NEED_CLOSE  (PN_LOCAL_ACTIVE | PN_REMOTE_CLOSED)
+
+static void receive(recv_thread_t *th, pn_delivery_t *dlv)
+{
+  pn_link_t *link = pn_delivery_link(dlv);
+  size_t size = pn_delivery_pending(dlv);
+  uint64_t put_usec;
+
+  if (size > th->buffer_size) {
+    th->buffer_size = size;
+    th->buffer = realloc(th->buffer, size);
+    if (!th->buffer) die(__FILE__, __LINE__, "Out of memory");
+  }
+  ssize_t n = pn_link_recv(link, th->buffer, size);
+  pn_link_advance(link);
+  if (n < 0 || pn_message_decode(th->message, th->buffer, n))
+    StatsAdd(th->stat, STAT_DECODE_ERRORS, 1);
+  else if ((put_usec = get_put_usec(th->message)))
+    latency_add(&th->lat, put_usec, now_usec());
+  StatsAdd(th->stat, STAT_RECEIVED, 1);
+  StatsAdd(th->stat, STAT_BYTES, size);
+  pn_delivery_update(dlv, PN_ACCEPTED);
+  pn_delivery_settle(dlv);
+
+  int credit = pn_link_credit(link);
+  if (credit < ev_credit / 2)
+    pn_link_flow(link, ev_credit - credit);
+
+  uint64_t count = __sync_add_and_fetch(&ev_count, 1);
+  // like the timer, the counters start at the first message.  The
+  // counts of the other loop threads (-T) are only known once they have
+  // exited, so their work before this point is included.
+  if (count == 1 && __sync_bool_compare_and_swap(&ev_start, 0, now_usec()))
+    PerfCountersStart(ev_counters);
+  if (ev_opts->msg_count && count == ev_opts->msg_count) {
+    ev_end = now_usec();
+    EvLoopStop(ev_loop);
+  }
+}
+
+// -W: record the bytes exactly as read, so a replay decodes the same
+// frame boundaries
+static void capture(EvConnection_t *conn, const char *data, size_t size,
+                    void *context)
+{
+  if (fwrite(data, 1, size, ev_capture) != size)
+    die(__FILE__, __LINE__, "Capture write failed");
+}
+
+static void recv_handler(EvConnection_t *conn, EvType_t type, pn_event_t *event,
+                         void *context)
+{
+  if (type == EV_OPENED && ev_opts->capture
+      && __sync_bool_compare_and_swap(&ev_captured, NULL, conn)) {
+    ev_capture = fopen(ev_opts->capture, "wb");
+    if (!ev_capture) {
+      perror(ev_opts->capture);
+      exit(1);
+    }
+    EvConnectionSetInputTap(conn, capture, NULL);
+  } else if (type == EV_CLOSED && conn == ev_captured && ev_capture) {
+    if (fclose(ev_capture))
+      die(__FILE__, __LINE__, "Capture write failed");
+    ev_capture = NULL;
+  }
+  if (type != EV_PROTON) return;
+
+  // dispatch on the object of the event, by its state
+  pn_delivery_t *dlv = pn_event_delivery(event);
+  pn_link_t *link = pn_event_link(event);
+  pn_session_t *ssn = pn_event_session(event);
+  if (dlv) {
+    if (pn_delivery_readable(dlv) && !pn_delivery_partial(dlv))
+      receive(&ev_threads[EvConnectionThread(conn)], dlv);
+  } else if (link) {
+    pn_state_t state = pn_link_state(link);
+    if ((state & NEED_INIT) == NEED_INIT) {
+      pn_terminus_copy(pn_link_source(link), pn_link_remote_source(link));
+      pn_terminus_copy(pn_link_target(link), pn_link_remote_target(link));
+      pn_link_open(link);
+      if (pn_link_is_receiver(link))
+        pn_link_flow(link, ev_credit);
+    } else if ((state & NEED_CLOSE) == NEED_CLOSE) {
+      pn_link_close(link);
+    }
+  } else if (ssn) {
+    pn_state_t state = pn_session_state(ssn);
+    if ((state & NEED_INIT) == NEED_INIT)
+      pn_session_open(ssn);
+    else if ((state & NEED_CLOSE) == NEED_CLOSE)
+      pn_session_close(ssn);
+  } else {
+    pn_connection_t *c = EvConnectionProton(conn);
+    pn_state_t state = pn_connection_state(c);
+    if ((state & NEED_INIT) == NEED_INIT)
+      pn_connection_open(c);
+    else if ((state & NEED_CLOSE) == NEED_CLOSE)
+      pn_connection_close(c);
+  }
+}
+
+static int run_event_loop(const options_t *opts, const char *name)
+{
+  char host[256], port[32];
+  const char *address;
+  unsigned int t;
+
+  ev_opts = opts;
+  // credit must be bounded, unlike the Messenger -r
+  ev_credit = opts->credit > 0 ? opts->credit : 2048;
+  ev_loop = EvLoopNew(name, opts->threads);
+  ev_threads = calloc(opts->threads, sizeof(recv_thread_t));
+  if (!ev_threads) die(__FILE__, __LINE__, "Out of memory");
+  Stats_t *stats = StatsNew("perf-recv", stat_defs, STAT_COUNT, opts->threads);
+  for (t = 0; t < opts->threads; t++) {
+    ev_threads[t].stat = StatsSlot(stats, t);
+    ev_threads[t].message = pn_message();
+    latency_init(&ev_threads[t].lat, MAX_LATENCY_SAMPLES / opts->threads);
+  }
+
+  for (int i = 0; i < opts->address_count; i++) {
+    if (EvAddressParse(opts->addresses[i], host, sizeof(host), port, sizeof(port), &address)) {
+      fprintf(stderr, "Invalid address %s\n", opts->addresses[i]);
+      return 1;
+    }
+    if (EvLoopListen(ev_loop, host, port, recv_handler, NULL)) {
+      fprintf(stderr, "Cannot listen on %s:%s: %s\n", host, port, strerror(errno));
+      return 1;
+    }
+  }
+
+  if (opts->ready_text) {
+    fprintf(stdout, "%s\n", opts->ready_text);
+    fflush(stdout);
+  }
+
+  PerfCounters_t *pc = ev_counters = counters_open(opts);
+  EvLoopRun(ev_loop);
+  if (ev_start) PerfCountersStop(pc);
+  if (!ev_end) ev_end = now_usec();
+  EvLoopFree(ev_loop);
+
+  latency_t lat;
+  latency_init(&lat, MAX_LATENCY_SAMPLES);
+  for (t = 0; t < opts->threads; t++) {
+    latency_merge(&lat, &ev_threads[t].lat);
+    free(ev_threads[t].lat.samples);
+    free(ev_threads[t].buffer);
+    pn_message_free(ev_threads[t].message);
+  }
+  free(ev_threads);
+  StatsFree(stats);
+
+  report(ev_count, ev_start ? ev_end - ev_start : 0, &lat, pc);
+  PerfCountersFree(pc);
+  free(lat.samples);
+  return 0;
+}
+
 int main(int argc, char** argv)
 {
   options_t opts;
@@ -125,6 +500,10 @@ int main(int argc, char** argv)
 
   parse_options( argc, argv, &opts );
 
+  if (opts.event_loop) {
+    return run_event_loop(&opts, argv[0]);
+  }
+
   message = pn_message();
   messenger = pn_messenger(argv[0]);
 
@@ -152,17 +531,41 @@ int main(int argc, char** argv)
   pn_messenger_start(messenger);
   check(messenger);
 
-  pn_messenger_subscribe(messenger, opts.address);
-  check(messenger);
+  for (int i = 0; i < opts.address_count; i++) {
+    pn_messenger_subscribe(messenger, opts.addresses[i]);
+    check(messenger);
+  }
+
+  if (opts.ready_text) {
+    fprintf(stdout, "%s\n", opts.ready_text);
+    fflush(stdout);
+  }
 
   uint64_t count = 0;
-  pn_timestamp_t start = 0;
+  uint64_t start = 0;
+  uint64_t put_usec;
+  latency_t lat;
+  Stats_t *stats = StatsNew("perf-recv", stat_defs, STAT_COUNT, 1);
+  uint64_t *stat = StatsSlot(stats, 0);
+  PerfCounters_t *pc = counters_open(&opts);
+
+  latency_init(&lat, MAX_LATENCY_SAMPLES);
 
   if (opts.msg_count) {
     // start the timer only after receiving the first msg
     pn_messenger_recv(messenger, 1);
-    start = pn_i_now();
-    count++;
+    check(messenger);
+    start = now_usec();
+    PerfCountersStart(pc);
+    while (pn_messenger_incoming(messenger))
+    {
+      if (pn_messenger_get(messenger, message))
+        abort();
+      if ((put_usec = get_put_usec(message)))
+        latency_add(&lat, put_usec, now_usec());
+      count++;
+      StatsAdd(stat, STAT_RECEIVED, 1);
+    }
   }
 
   while (!opts.msg_count || count < opts.msg_count) {
@@ -174,20 +577,24 @@ int main(int argc, char** argv)
     {
       if (pn_messenger_get(messenger, message))
         abort();
-      // TODO: header decoding?
+      if ((put_usec = get_put_usec(message)))
+        latency_add(&lat, put_usec, now_usec());
       count++;
+      StatsAdd(stat, STAT_RECEIVED, 1);
     }
   }
 
-  pn_timestamp_t end = pn_i_now() - start;
+  PerfCountersStop(pc);
+  uint64_t end = now_usec() - start;
 
   pn_messenger_stop(messenger);
   pn_messenger_free(messenger);
   pn_message_free(message);
+  StatsFree(stats);
 
-  double secs = end/(double)1000.0;
-  fprintf(stdout, "Total time %f sec (%f msgs/sec)\n",
-          secs, opts.msg_count/secs);
+  report(count, end, &lat, pc);
+  PerfCountersFree(pc);
+  free(lat.samples);
 
   return 0;
 }
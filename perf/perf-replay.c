@@ -0,0 +1,338 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "proton/message.h"
+#include "proton/engine.h"
+#include "proton/event.h"
+#include "proton/sasl.h"
+#include "perfcounters.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//
+// Replays the raw input of a connection, as captured by perf-recv -E -W,
+// into a fresh pn_transport_t and connection as fast as it will go, to
+// benchmark frame and message decoding without any I/O.  The replies of
+// the replayed receiver (flow, dispositions) are generated and discarded.
+//
+
+void die(const char *file, int line, const char *message)
+{
+  fprintf(stderr, "%s:%i: %s\n", file, line, message);
+  exit(1);
+}
+
+#define NEED_INIT   (PN_LOCAL_UNINIT | PN_REMOTE_ACTIVE)
+#define NEED_CLOSE  (PN_LOCAL_ACTIVE | PN_REMOTE_CLOSED)
+
+typedef struct options_t {
+  const char *capture;
+  unsigned int passes;
+  int credit;
+  int no_decode;
+  int counters;
+} options_t;
+
+typedef struct replay_t {
+  const options_t *opts;
+  pn_connection_t *connection;
+  pn_transport_t *transport;
+  pn_collector_t *collector;
+  pn_message_t *message;
+  char *buffer;
+  size_t buffer_size;
+  uint64_t messages;
+} replay_t;
+
+static void usage(int rc)
+{
+  printf("Usage: perf-replay [options] <capture file>\n");
+  printf("-n    \tNumber of passes over the capture [1]\n");
+  printf("-r    \tCredit granted per link by the replayed receiver [2048]\n");
+  printf("-D    \tDo not decode the messages, only receive them\n");
+  printf("-H    \tCount CPU events (cycles, instructions, misses) per message\n");
+  exit(rc);
+}
+
+static void parse_options( int argc, char **argv, options_t *opts )
+{
+  int c;
+  opterr = 0;
+
+  memset( opts, 0, sizeof(*opts) );
+  opts->passes = 1;
+  opts->credit = 2048;
+
+  while((c = getopt(argc, argv, "hn:r:DH")) != -1) {
+    switch(c) {
+    case 'n':
+      if (sscanf( optarg, "%u", &opts->passes ) != 1 || opts->passes == 0) {
+        fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
+    case 'r':
+      if (sscanf( optarg, "%d", &opts->credit ) != 1 || opts->credit <= 0) {
+        fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
+    case 'D': opts->no_decode = 1; break;
+    case 'H': opts->counters = 1; break;
+    case 'h': usage(0); break;
+    default:
+      usage(1);
+    }
+  }
+
+  if (optind != argc - 1) usage(1);
+  opts->capture = argv[optind];
+}
+
+static uint64_t clock_nsec(clockid_t clock)
+{
+  struct timespec ts;
+  if (clock_gettime(clock, &ts)) abort();
+  return ((uint64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Walk the AMQP framing of the capture: protocol headers ("AMQP" plus
+// protocol id and version, 8 bytes) and frames (a 4 byte big-endian size
+// that includes the frame header).  A partial frame at the end, where the
+// capture was cut, is not counted.
+static uint64_t count_frames(const unsigned char *data, size_t size)
+{
+  uint64_t frames = 0;
+  size_t offset = 0;
+  while (size - offset >= 8) {
+    const unsigned char *p = data + offset;
+    if (!memcmp(p, "AMQP", 4)) {
+      offset += 8;
+      continue;
+    }
+    uint32_t frame_size = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+      | (uint32_t) p[2] << 8 | p[3];
+    if (frame_size < 8 || frame_size > size - offset) break;
+    frames++;
+    offset += frame_size;
+  }
+  return frames;
+}
+
+static void replay_init(replay_t *r, const options_t *opts, int sasl)
+{
+  r->connection = pn_connection();
+  r->collector = pn_collector();
+  r->transport = pn_transport();
+  if (!r->connection || !r->collector || !r->transport)
+    die(__FILE__, __LINE__, "Out of memory");
+  if (sasl) {
+    // as the listener that took the capture: ANONYMOUS
+    pn_sasl_t *s = pn_sasl(r->transport);
+    pn_sasl_mechanisms(s, "ANONYMOUS");
+    pn_sasl_server(s);
+    pn_sasl_done(s, PN_SASL_OK);
+  }
+  pn_connection_collect(r->connection, r->collector);
+  pn_transport_bind(r->transport, r->connection);
+}
+
+static void replay_free(replay_t *r)
+{
+  pn_transport_unbind(r->transport);
+  pn_transport_free(r->transport);
+  pn_connection_free(r->connection);
+  pn_collector_free(r->collector);
+}
+
+static void receive(replay_t *r, pn_delivery_t *dlv)
+{
+  pn_link_t *link = pn_delivery_link(dlv);
+  size_t size = pn_delivery_pending(dlv);
+
+  if (size > r->buffer_size) {
+    r->buffer_size = size;
+    r->buffer = realloc(r->buffer, size);
+    if (!r->buffer) die(__FILE__, __LINE__, "Out of memory");
+  }
+  ssize_t n = pn_link_recv(link, r->buffer, size);
+  pn_link_advance(link);
+  if (n < 0) die(__FILE__, __LINE__, "pn_link_recv() failed");
+  if (!r->opts->no_decode && pn_message_decode(r->message, r->buffer, n))
+    die(__FILE__, __LINE__, "pn_message_decode() failed");
+  if (!pn_delivery_settled(dlv)) pn_delivery_update(dlv, PN_ACCEPTED);
+  pn_delivery_settle(dlv);
+  r->messages++;
+
+  int credit = pn_link_credit(link);
+  if (credit < r->opts->credit / 2)
+    pn_link_flow(link, r->opts->credit - credit);
+}
+
+// answer the endpoints as perf-recv -E does
+static void dispatch(replay_t *r, pn_event_t *event)
+{
+  pn_delivery_t *dlv = pn_event_delivery(event);
+  pn_link_t *link = pn_event_link(event);
+  pn_session_t *ssn = pn_event_session(event);
+  if (dlv) {
+    if (pn_delivery_readable(dlv) && !pn_delivery_partial(dlv))
+      receive(r, dlv);
+  } else if (link) {
+    pn_state_t state = pn_link_state(link);
+    if ((state & NEED_INIT) == NEED_INIT) {
+      pn_terminus_copy(pn_link_source(link), pn_link_remote_source(link));
+      pn_terminus_copy(pn_link_target(link), pn_link_remote_target(link));
+      pn_link_open(link);
+      if (pn_link_is_receiver(link))
+        pn_link_flow(link, r->opts->credit);
+    } else if ((state & NEED_CLOSE) == NEED_CLOSE) {
+      pn_link_close(link);
+    }
+  } else if (ssn) {
+    pn_state_t state = pn_session_state(ssn);
+    if ((state & NEED_INIT) == NEED_INIT)
+      pn_session_open(ssn);
+    else if ((state & NEED_CLOSE) == NEED_CLOSE)
+      pn_session_close(ssn);
+  } else {
+    pn_state_t state = pn_connection_state(r->connection);
+    if ((state & NEED_INIT) == NEED_INIT)
+      pn_connection_open(r->connection);
+    else if ((state & NEED_CLOSE) == NEED_CLOSE)
+      pn_connection_close(r->connection);
+  }
+}
+
+// one pass: push the whole capture through the transport, filling all of
+// its input capacity each time
+static void replay(replay_t *r, const char *data, size_t size)
+{
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t capacity = pn_transport_capacity(r->transport);
+    if (capacity <= 0) {
+      fprintf(stderr, "Transport closed its input at byte %zu of %zu\n", offset, size);
+      exit(1);
+    }
+    size_t n = size - offset;
+    if (n > (size_t) capacity) n = capacity;
+    memcpy(pn_transport_tail(r->transport), data + offset, n);
+    pn_transport_process(r->transport, n);
+    offset += n;
+
+    pn_event_t *event;
+    while ((event = pn_collector_peek(r->collector))) {
+      dispatch(r, event);
+      pn_collector_pop(r->collector);
+    }
+    ssize_t pending = pn_transport_pending(r->transport);
+    if (pending > 0) pn_transport_pop(r->transport, pending);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  options_t opts;
+  parse_options( argc, argv, &opts );
+
+  int fd = open(opts.capture, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(opts.capture);
+    return 1;
+  }
+  size_t size = st.st_size;
+  if (size < 8) {
+    fprintf(stderr, "%s: not a capture\n", opts.capture);
+    return 1;
+  }
+  // fault it all in now, not during the first pass
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (data == MAP_FAILED) die(__FILE__, __LINE__, "mmap failed");
+  close(fd);
+
+  // "AMQP" 3 1 0 0 starts the SASL layer
+  int sasl = !memcmp(data, "AMQP\x03", 5);
+  uint64_t frames = count_frames((const unsigned char *) data, size);
+
+  replay_t r;
+  memset(&r, 0, sizeof(r));
+  r.opts = &opts;
+  r.message = pn_message();
+  r.buffer_size = 64 * 1024;
+  r.buffer = malloc(r.buffer_size);
+  if (!r.message || !r.buffer) die(__FILE__, __LINE__, "Out of memory");
+
+  PerfCounters_t *pc = NULL;
+  if (opts.counters && !(pc = PerfCountersNew()))
+    fprintf(stderr, "CPU counters unavailable (perf_event_open failed)\n");
+
+  // the counters, like the clock, only cover the replay itself, not the
+  // set up and tear down of the transport of each pass
+  uint64_t elapsed = 0;
+  for (unsigned int pass = 0; pass < opts.passes; pass++) {
+    replay_init(&r, &opts, sasl);
+    uint64_t start = clock_nsec(CLOCK_MONOTONIC);
+    PerfCountersStart(pc);
+    replay(&r, data, size);
+    PerfCountersStop(pc);
+    elapsed += clock_nsec(CLOCK_MONOTONIC) - start;
+    replay_free(&r);
+  }
+
+  uint64_t total_frames = frames * opts.passes;
+  uint64_t total_bytes = (uint64_t) size * opts.passes;
+  double secs = elapsed / 1000000000.0;
+  fprintf(stdout, "Capture %s: %zu bytes, %" PRIu64 " frames, %" PRIu64
+          " msgs per pass%s\n", opts.capture, size, frames,
+          r.messages / opts.passes, sasl ? " (SASL)" : "");
+  fprintf(stdout, "Total time %f sec for %u passes (%f msgs/sec)\n",
+          secs, opts.passes, r.messages / secs);
+  fprintf(stdout, "%f frames/sec, %f MB/sec, %.0f ns/frame, %.0f ns/msg\n",
+          total_frames / secs, total_bytes / secs / (1024 * 1024),
+          total_frames ? (double) elapsed / total_frames : 0.0,
+          r.messages ? (double) elapsed / r.messages : 0.0);
+  PerfCountersReport(pc, r.messages, stdout);
+  // machine readable summary, see benchmark/README.txt
+  fprintf(stdout, "RESULT role=replay msgs=%" PRIu64 " secs=%f throughput=%f"
+          " frames=%" PRIu64 " frames_per_sec=%f bytes=%" PRIu64 " bytes_per_sec=%f",
+          r.messages, secs, r.messages / secs, total_frames,
+          total_frames / secs, total_bytes, total_bytes / secs);
+  PerfCountersResult(pc, r.messages, stdout);
+  fprintf(stdout, "\n");
+  PerfCountersFree(pc);
+
+  pn_message_free(r.message);
+  free(r.buffer);
+  munmap((void *) data, size);
+  return 0;
+}
@@ -18,23 +18,31 @@
  *
  */
 
+#define _XOPEN_SOURCE 600
+
 #include "proton/message.h"
 #include "proton/messenger.h"
+#include "proton/error.h"
+#include "evloop.h"
+#include "perfcounters.h"
+#include "stats.h"
 
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <sys/time.h>
+#include <time.h>
 
-#define check(messenger)                                         \
-  {                                                              \
-    if(pn_messenger_errno(messenger))                            \
-    {                                                            \
-      die(__FILE__, __LINE__, pn_messenger_error(messenger));    \
-    }                                                            \
-  }                                                              \
+#define check(messenger)                                                       \
+  {                                                                            \
+    if(pn_messenger_errno(messenger))                                          \
+    {                                                                          \
+      die(__FILE__, __LINE__, pn_error_text(pn_messenger_error(messenger)));   \
+    }                                                                          \
+  }                                                                            \
 
 void die(const char *file, int line, const char *message)
 {
@@ -42,24 +50,53 @@ void die(const char *file, int line, const char *message)
   exit(1);
 }
 
+#define MAX_TARGETS 64
+
+// message property holding the time the message was put (usecs since epoch)
+#define PUT_PROPERTY "put-usec"
+
+// live statistics, see stats-top
+enum {
+  STAT_SENT,
+  STAT_BYTES,
+  STAT_ACKED,
+  STAT_COUNT
+};
+static const StatsDef_t stat_defs[STAT_COUNT] = {
+  { "sent", STATS_COUNTER },
+  { "bytes", STATS_COUNTER },
+  { "acked", STATS_COUNTER }
+};
+
 typedef struct options_t {
-  char *address;
+  const char *targets[MAX_TARGETS];
+  int target_count;
   uint64_t msg_count;
   uint32_t msg_size;
   uint32_t add_headers;
   uint32_t put_count;
   int   window;
+  uint64_t rate;
+  int event_loop;
+  unsigned int threads;
+  int counters;
 } options_t;
 
 static void usage(int rc)
 {
   printf("Usage: send [-a addr] \n");
   printf("-a     \tThe target address [amqp[s]://domain[/name]]\n");
+  printf("       \t(may be repeated, messages are sent round-robin)\n");
   printf("-c     \tNumber of messages to send [500000]\n");
   printf("-s     \tSize of message body in bytes [1024]\n");
   printf("-p     \t*TODO* Add N sample properties to each message [3]\n");
   printf("-b     \t# messages to put before calling send [1024]\n");
   printf("-w    \tSize for outgoing window\n");
+  printf("-r    \tLimit the send rate to N msgs/sec [0=unlimited]\n");
+  printf("-E    \tUse the epoll event loop instead of Messenger\n");
+  printf("      \t(-w then limits the unacked messages per target)\n");
+  printf("-T    \t# event loop threads, with -E [1]\n");
+  printf("-H    \tCount CPU events (cycles, instructions, misses) per message\n");
   exit(rc);
 }
 
@@ -69,15 +106,21 @@ static void parse_options( int argc, char **argv, options_t *opts )
   opterr = 0;
 
   memset( opts, 0, sizeof(*opts) );
-  opts->address = "amqp://0.0.0.0";
   opts->msg_count = 5000000;
   opts->msg_size  = 1024;
   opts->add_headers = 3;
   opts->put_count = 1024;
+  opts->threads = 1;
 
-  while((c = getopt(argc, argv, "a:c:s:p:b:w:")) != -1) {
+  while((c = getopt(argc, argv, "a:c:s:p:b:w:r:ET:H")) != -1) {
     switch(c) {
-    case 'a': opts->address = optarg; break;
+    case 'a':
+      if (opts->target_count == MAX_TARGETS) {
+        fprintf(stderr, "Too many targets (max %d).\n", MAX_TARGETS);
+        usage(1);
+      }
+      opts->targets[opts->target_count++] = optarg;
+      break;
     case 'c':
       if (sscanf( optarg, "%lu", &opts->msg_count ) != 1) {
         fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
@@ -95,6 +138,7 @@ static void parse_options( int argc, char **argv, options_t *opts )
         fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
         usage(1);
       }
+      break;
     case 'b':
       if (sscanf( optarg, "%u", &opts->put_count ) != 1) {
         fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
@@ -107,19 +151,289 @@ static void parse_options( int argc, char **argv, options_t *opts )
         usage(1);
       }
       break;
+    case 'r':
+      if (sscanf( optarg, "%" SCNu64, &opts->rate ) != 1) {
+        fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
+    case 'E': opts->event_loop = 1; break;
+    case 'H': opts->counters = 1; break;
+    case 'T':
+      if (sscanf( optarg, "%u", &opts->threads ) != 1 || opts->threads == 0) {
+        fprintf(stderr, "Option -%c requires a positive integer argument.\n", optopt);
+        usage(1);
+      }
+      break;
     default:
       usage(1);
     }
   }
+
+  if (opts->target_count == 0) {
+    opts->targets[opts->target_count++] = "amqp://0.0.0.0";
+  }
+  if (opts->event_loop && opts->rate) {
+    fprintf(stderr, "-r is not supported with -E.\n");
+    usage(1);
+  }
 }
 
 
-//sigh - would be nice if proton exported this:
-pn_timestamp_t pn_i_now()
+static uint64_t now_usec()
 {
   struct timeval now;
   if (gettimeofday(&now, NULL)) abort();
-  return ((pn_timestamp_t)now.tv_sec) * 1000 + (now.tv_usec / 1000);
+  return ((uint64_t)now.tv_sec) * 1000000 + now.tv_usec;
+}
+
+static void sleep_usec(uint64_t usec)
+{
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  while (nanosleep(&ts, &ts) == -1)
+    ;
+}
+
+// The properties carry the time the message was put, which perf-recv uses
+// to compute the latency.  Both must run on the same host (or have
+// synchronized clocks).
+static void set_properties(pn_data_t *props, uint64_t put_usec)
+{
+  pn_data_clear(props);
+  pn_data_put_map(props);
+  pn_data_enter(props);
+  //
+  pn_data_put_string(props, pn_bytes(6,  "string"));
+  pn_data_put_string(props, pn_bytes(10, "this is awkward"));
+  //
+  pn_data_put_string(props, pn_bytes(4,  "long"));
+  pn_data_put_long(props, 12345);
+  //
+  pn_data_put_string(props, pn_bytes(9, "timestamp"));
+  pn_data_put_timestamp(props, (pn_timestamp_t) 54321);
+  //
+  pn_data_put_string(props, pn_bytes(sizeof(PUT_PROPERTY) - 1, PUT_PROPERTY));
+  pn_data_put_ulong(props, put_usec);
+  pn_data_exit(props);
+}
+
+// -H: CPU counters around the measured loop
+static PerfCounters_t *counters_open(const options_t *opts)
+{
+  if (!opts->counters) return NULL;
+  PerfCounters_t *pc = PerfCountersNew();
+  if (!pc) fprintf(stderr, "CPU counters unavailable (perf_event_open failed)\n");
+  return pc;
+}
+
+//
+// Event loop (-E) backend: one connection per distinct host:port, one
+// sender link per target.  The messages are split evenly between the
+// targets, and sent as fast as credit (and the -w window) allows.
+//
+
+typedef struct sender_t {
+  pn_link_t *link;
+  uint64_t quota;
+  uint64_t sent;
+  uint64_t acked;
+} sender_t;
+
+typedef struct peer_t {
+  char host[256];
+  char port[32];
+  EvConnection_t *conn;
+  pn_session_t *session;
+  sender_t senders[MAX_TARGETS];
+  int sender_count;
+  int done;                 // senders that have all their acks
+  pn_message_t *message;
+  char *buffer;             // encoded message
+  size_t buffer_size;
+  uint64_t tag;
+  uint64_t *stat;           // of the connection's thread
+} peer_t;
+
+static const options_t *ev_opts;
+static volatile uint64_t ev_acked;
+static Stats_t *ev_stats;
+
+static size_t encode_message(peer_t *peer)
+{
+  size_t size;
+  int rc;
+
+  set_properties(pn_message_properties(peer->message), now_usec());
+  for (;;) {
+    size = peer->buffer_size;
+    rc = pn_message_encode(peer->message, peer->buffer, &size);
+    if (rc != PN_OVERFLOW) break;
+    peer->buffer_size *= 2;
+    peer->buffer = realloc(peer->buffer, peer->buffer_size);
+    if (!peer->buffer) die(__FILE__, __LINE__, "Out of memory");
+  }
+  if (rc) die(__FILE__, __LINE__, "pn_message_encode() failed");
+  return size;
+}
+
+static void pump(peer_t *peer, sender_t *s)
+{
+  while (s->sent < s->quota && pn_link_credit(s->link) > 0
+         && (!ev_opts->window || s->sent - s->acked < (uint64_t) ev_opts->window)) {
+    size_t size = encode_message(peer);
+    uint64_t tag = ++peer->tag;
+    pn_delivery(s->link, pn_dtag((const char *) &tag, sizeof(tag)));
+    pn_link_send(s->link, peer->buffer, size);
+    pn_link_advance(s->link);
+    s->sent++;
+    StatsAdd(peer->stat, STAT_SENT, 1);
+    StatsAdd(peer->stat, STAT_BYTES, size);
+  }
+}
+
+static void sender_done(peer_t *peer, sender_t *s)
+{
+  __sync_add_and_fetch(&ev_acked, s->acked);
+  pn_link_close(s->link);
+  if (++peer->done == peer->sender_count)
+    pn_connection_close(EvConnectionProton(peer->conn));
+}
+
+static void send_handler(EvConnection_t *conn, EvType_t type, pn_event_t *event,
+                         void *context)
+{
+  peer_t *peer = (peer_t *) EvConnectionGetContext(conn);
+
+  if (type == EV_OPENED) {
+    peer->stat = StatsSlot(ev_stats, EvConnectionThread(conn));
+    return;
+  }
+  if (type == EV_CLOSED) {
+    if (peer->done < peer->sender_count)
+      fprintf(stderr, "Connection to %s:%s lost\n", peer->host, peer->port);
+    return;
+  }
+  if (type != EV_PROTON) return;
+
+  // dispatch on the object of the event, by its state
+  pn_delivery_t *dlv = pn_event_delivery(event);
+  pn_link_t *link = pn_event_link(event);
+  if (dlv) {
+    link = pn_delivery_link(dlv);
+    if (pn_delivery_updated(dlv)) {
+      sender_t *s = (sender_t *) pn_link_get_context(link);
+      pn_delivery_settle(dlv);
+      StatsAdd(peer->stat, STAT_ACKED, 1);
+      if (++s->acked == s->quota) {
+        sender_done(peer, s);
+        return;
+      }
+    }
+  }
+  if (link && pn_link_is_sender(link) && !(pn_link_state(link) & PN_LOCAL_CLOSED)) {
+    sender_t *s = (sender_t *) pn_link_get_context(link);
+    if (pn_link_state(link) & PN_REMOTE_CLOSED) {
+      fprintf(stderr, "Target %s closed by peer\n",
+              pn_terminus_get_address(pn_link_target(link)));
+      sender_done(peer, s);
+      return;
+    }
+    pump(peer, s);
+  } else if (!link && !pn_event_session(event)) {
+    pn_connection_t *c = EvConnectionProton(conn);
+    if ((pn_connection_state(c) & (PN_LOCAL_ACTIVE | PN_REMOTE_CLOSED))
+        == (PN_LOCAL_ACTIVE | PN_REMOTE_CLOSED))
+      pn_connection_close(c);
+  }
+}
+
+static int run_event_loop(const options_t *opts, const char *name)
+{
+  peer_t *peers = calloc(opts->target_count, sizeof(peer_t));
+  int peer_count = 0;
+  char host[256], port[32];
+  const char *address;
+
+  if (!peers) die(__FILE__, __LINE__, "Out of memory");
+  ev_opts = opts;
+  EvLoop_t *loop = EvLoopNew(name, opts->threads);
+  ev_stats = StatsNew("perf-send", stat_defs, STAT_COUNT, opts->threads);
+
+  char *data = calloc(1, opts->msg_size);
+  for (int i = 0; i < opts->target_count; i++) {
+    uint64_t quota = opts->msg_count / opts->target_count
+      + ((uint64_t) i < opts->msg_count % opts->target_count ? 1 : 0);
+    // with fewer messages than targets, the last ones get none: a link
+    // (or connection) without a quota would never be done
+    if (!quota) continue;
+    if (EvAddressParse(opts->targets[i], host, sizeof(host), port, sizeof(port), &address)) {
+      fprintf(stderr, "Invalid target %s\n", opts->targets[i]);
+      return 1;
+    }
+    peer_t *peer = NULL;
+    for (int p = 0; p < peer_count; p++) {
+      if (!strcmp(peers[p].host, host) && !strcmp(peers[p].port, port))
+        peer = &peers[p];
+    }
+    if (!peer) {
+      peer = &peers[peer_count++];
+      strcpy(peer->host, host);
+      strcpy(peer->port, port);
+      peer->conn = EvLoopConnect(loop, host, port, send_handler, NULL);
+      if (!peer->conn) {
+        fprintf(stderr, "Cannot connect to %s:%s\n", host, port);
+        return 1;
+      }
+      EvConnectionSetContext(peer->conn, peer);
+      peer->message = pn_message();
+      pn_data_put_binary(pn_message_body(peer->message), pn_bytes(opts->msg_size, data));
+      peer->buffer_size = opts->msg_size + 1024;
+      peer->buffer = malloc(peer->buffer_size);
+      if (!peer->buffer) die(__FILE__, __LINE__, "Out of memory");
+      // the loop is not running yet: safe to set up the endpoints here
+      pn_connection_open(EvConnectionProton(peer->conn));
+      peer->session = pn_session(EvConnectionProton(peer->conn));
+      pn_session_open(peer->session);
+    }
+
+    sender_t *s = &peer->senders[peer->sender_count++];
+    s->link = pn_sender(peer->session, opts->targets[i]);
+    pn_terminus_set_address(pn_link_target(s->link), address);
+    pn_link_set_context(s->link, s);
+    s->quota = quota;
+    pn_link_open(s->link);
+  }
+  free(data);
+
+  PerfCounters_t *pc = counters_open(opts);
+  uint64_t start = now_usec();
+  PerfCountersStart(pc);
+  EvLoopRun(loop);
+  PerfCountersStop(pc);
+  uint64_t end = now_usec() - start;
+  EvLoopFree(loop);
+
+  for (int p = 0; p < peer_count; p++) {
+    pn_message_free(peers[p].message);
+    free(peers[p].buffer);
+  }
+  free(peers);
+  StatsFree(ev_stats);
+
+  double secs = end/(double)1000000.0;
+  fprintf(stdout, "Total time %f sec (%f msgs/sec)\n",
+          secs, ev_acked/secs);
+  PerfCountersReport(pc, ev_acked, stdout);
+  // machine readable summary, see benchmark/README.txt
+  fprintf(stdout, "RESULT role=sender msgs=%" PRIu64 " secs=%f throughput=%f"
+          " offered=%" PRIu64,
+          (uint64_t) ev_acked, secs, ev_acked/secs, opts->rate);
+  PerfCountersResult(pc, ev_acked, stdout);
+  fprintf(stdout, "\n");
+  PerfCountersFree(pc);
+  return ev_acked == opts->msg_count ? 0 : 1;
 }
 
 int main(int argc, char** argv)
@@ -130,6 +444,10 @@ int main(int argc, char** argv)
 
   parse_options( argc, argv, &opts );
 
+  if (opts.event_loop) {
+    return run_event_loop(&opts, argv[0]);
+  }
+
   message = pn_message();
   pn_data_t *body = pn_message_body(message);
   char *data = calloc(1, opts.msg_size);
@@ -138,47 +456,68 @@ int main(int argc, char** argv)
 
   // TODO: how do we effectively benchmark header processing overhead???
   pn_data_t *props = pn_message_properties(message);
-  pn_data_put_map(props);
-  pn_data_enter(props);
-  //
-  pn_data_put_string(props, pn_bytes(6,  "string"));
-  pn_data_put_string(props, pn_bytes(10, "this is awkward"));
-  //
-  pn_data_put_string(props, pn_bytes(4,  "long"));
-  pn_data_put_long(props, 12345);
-  //
-  pn_data_put_string(props, pn_bytes(9, "timestamp"));
-  pn_data_put_timestamp(props, (pn_timestamp_t) 54321);
-  pn_data_exit(props);
-  pn_message_set_address(message, opts.address);
-
 
   messenger = pn_messenger( argv[0] );
   if (opts.window) {
     pn_messenger_set_outgoing_window( messenger, opts.window );
   }
   pn_messenger_start(messenger);
+  check(messenger);
 
-  pn_timestamp_t start = pn_i_now();
+  Stats_t *stats = StatsNew("perf-send", stat_defs, STAT_COUNT, 1);
+  uint64_t *stat = StatsSlot(stats, 0);
+  PerfCounters_t *pc = counters_open(&opts);
+  uint64_t start = now_usec();
+  PerfCountersStart(pc);
 
   for (uint64_t i = 1; i <= opts.msg_count; ++i) {
 
+    if (opts.rate) {
+      // pace the messages evenly: message i is due at (i-1)/rate seconds
+      uint64_t due = start + ((i - 1) * 1000000) / opts.rate;
+      uint64_t now = now_usec();
+      if (now < due) {
+        // ahead of schedule: flush any batched messages before idling,
+        // so they are not held back by the batching
+        pn_messenger_send(messenger, -1);
+        check(messenger);
+        now = now_usec();
+        if (now < due) sleep_usec(due - now);
+      }
+    }
+
+    set_properties(props, now_usec());
+    pn_message_set_address(message, opts.targets[i % opts.target_count]);
     pn_messenger_put(messenger, message);
+    check(messenger);
+    StatsAdd(stat, STAT_SENT, 1);
     if (opts.put_count > 0 && (i % opts.put_count == 0) ) {
-      pn_messenger_send(messenger);
+      pn_messenger_send(messenger, -1);
+      check(messenger);
     }
   }
-  pn_messenger_send(messenger);
+  pn_messenger_send(messenger, -1);
+  check(messenger);
 
-  pn_timestamp_t end = pn_i_now() - start;
+  PerfCountersStop(pc);
+  uint64_t end = now_usec() - start;
 
   pn_messenger_stop(messenger);
   pn_messenger_free(messenger);
   pn_message_free(message);
+  StatsFree(stats);
 
-  double secs = end/(double)1000.0;
+  double secs = end/(double)1000000.0;
   fprintf(stdout, "Total time %f sec (%f msgs/sec)\n",
           secs, opts.msg_count/secs);
+  PerfCountersReport(pc, opts.msg_count, stdout);
+  // machine readable summary, see benchmark/README.txt
+  fprintf(stdout, "RESULT role=sender msgs=%" PRIu64 " secs=%f throughput=%f"
+          " offered=%" PRIu64,
+          opts.msg_count, secs, opts.msg_count/secs, opts.rate);
+  PerfCountersResult(pc, opts.msg_count, stdout);
+  fprintf(stdout, "\n");
+  PerfCountersFree(pc);
 
   return 0;
 }
@@ -17,8 +17,12 @@
 # under the License.
 #
 
-import socket, errno, time, heapq, select
-from proton import Transport
+import collections, uuid
+import proton
+from proton import SASL
+from sockettransport import SocketTransport
+from interconnect import EndpointEventHandler, Interconnect
+from link import Sender, Receiver
 
 class ConnectionEventHandler(object):
     def sasl_done(self, connection, result):
@@ -27,238 +31,226 @@ class ConnectionEventHandler(object):
     def connection_closed(self, connection, reason):
         pass
     def link_pending(self, connection, link):
-        # return True to accept new link,
-        # @todo False to reject
+        # return True to accept new link, False to reject.  A
+        # ReceiveEventHandler may be returned instead of True to accept
+        # a link that will receive messages.
         return True
 
 
-class Connection(object):
-    """Provides network I/O for a Proton connection via a socket-like object.
+class Connection(SocketTransport):
+    """Provides network I/O and endpoint processing for a Proton connection
+    via a socket.  Created by a Container, which runs its I/O.
     """
-    def __init__(self, socket, eventHandler, name=None):
-        """socket - Python socket. Expected to be configured and connected.
-        name - optional name for this SocketTransport
-        """
-        self._name = name
-        self._socket = socket
-        self._pn_transport = Transport()
-        self._pn_connection = Connection()
-        self._pn_transport.bind(self._pn_connection)
-        self._pn_transport.trace(proton.Transport.TRACE_FRM)
-        self._handler = eventHandler
-        self._read_done = False
-        self._write_done = False
-        self._next_tick = 0
-
-        self._sasl_done = False
-        self._pn_connection.open()
 
+    class _EndpointHandler(EndpointEventHandler):
+        def __init__(self, connection):
+            self._connection = connection
 
-    def fileno(self):
-        """Allows use of a Connection by the python select() call.
-        """
-        return self._socket.fileno()
+        def sasl_done(self, sasl):
+            self._connection._handler.sasl_done(self._connection, sasl.outcome)
 
-    @property
-    # @todo - hopefully remove
-    def transport(self):
-        return self._pn_transport
+        def link_pending(self, link):
+            self._connection._link_pending(link)
 
-    @property
-    # @todo - hopefully remove
-    def connection(self):
-        return self._pn_connection
+        def link_remote_closed(self, link):
+            self._connection._link_remote_closed(link)
 
-    @property
-    def socket(self):
-        return self._socket
+        def link_flow(self, link):
+            self._connection._link_flow(link)
 
-    @property
-    def name(self):
-        return self._name
+        def delivery_update(self, delivery):
+            self._connection._delivery_update(delivery)
 
-    @property
-    # @todo - think about server side use of this!
-    def sasl(self):
-        return self._pn_transport.sasl()
+        def connection_remote_closed(self, connection):
+            connection.close()
+            self._connection._closed("closed by peer")
 
-    def tick(self, now):
-        """Invoke the transport's tick method.  'now' is seconds since Epoch.
-        Returns the timestamp for the next tick, or zero if no next tick.
+    def __init__(self, container, name, socket, eventHandler=None,
+                 properties={}):
+        """container - the owning Container
+        socket - Python socket. Expected to be configured and connected.
+        name - name for this Connection, unique within the Container
+        properties - optional map: "server" True for an accepted
+        connection, "hostname", "trace" True to log frames.
         """
-        self._next_tick = self._pn_transport.tick(now)
-        return self._next_tick
-
-    @property
-    def next_tick(self):
-        """Timestamp for next call to tick()
-        """
-        return self._next_tick
+        super(Connection, self).__init__(socket, name)
+        self._container = container
+        self._handler = eventHandler or ConnectionEventHandler()
+        self._properties = properties
+        self._sasl = SASL(self.transport)
+        self._sasl.mechanisms("ANONYMOUS")
+        if properties.get("server"):
+            self._sasl.server()
+            self._sasl.done(SASL.OK)
+        else:
+            self._sasl.client()
+        self._interconnect = Interconnect(Connection._EndpointHandler(self),
+                                          self._sasl)
+        self._pn_connection = self._interconnect.connection
+        self._pn_connection.container = container.name
+        if "hostname" in properties:
+            self._pn_connection.hostname = properties["hostname"]
+        if properties.get("trace"):
+            self.transport.trace(proton.Transport.TRACE_FRM)
+        self.transport.bind(self._pn_connection)
+        self._pn_connection.open()
+        self._session = None
+        self._links = {}      # (name, is_sender) -> Sender or Receiver
+        self._active = collections.deque()  # links with queued work
+        self._queued = set()  # links in _active
+        self._blocked = set() # links with queued work waiting for credit
+        self._close_reason = None
+        self._local_close = False
+        self._finished = False
 
     @property
-    def need_read(self):
-        """True when the Transport requires data from the network layer.
-        """
-        return (not self._read_done) and self._pn_transport.capacity() > 0
+    # @todo - hopefully remove
+    def connection(self):
+        return self._pn_connection
 
     @property
-    def need_write(self):
-        """True when the Transport has data to write to the network layer.
-        """
-        return (not self._write_done) and self._pn_transport.pending() > 0
-
-    def read_input(self):
-        """Read from the network layer and processes all data read.  Can
-        support both blocking and non-blocking sockets.
-        """
-        if self._read_done:
-            return None
-
-        c = self._pn_transport.capacity()
-        if c < 0:
-            try:
-                self._socket.shutdown(socket.SHUT_RD)
-            except:
-                pass
-            self._read_done = True
-            return None
-
-        if c > 0:
-            try:
-                buf = self._socket.recv(c)
-                if buf:
-                    self._pn_transport.push(buf)
-                    return len(buf)
-                # else socket closed
-                self._pn_transport.close_tail()
-                self._read_done = True
-                return None
-            except socket.timeout, e:
-                raise  # let the caller handle this
-            except socket.error, e:
-                err = e.args[0]
-                if (err != errno.EAGAIN and
-                    err != errno.EWOULDBLOCK and
-                    err != errno.EINTR):
-                    # otherwise, unrecoverable:
-                    self._pn_transport.close_tail()
-                    self._read_done = True
-                raise
-            except:  # beats me...
-                self._pn_transport.close_tail()
-                self._read_done = True
-                raise
-        return 0
-
-    def write_output(self):
-        """Write data to the network layer.  Can support both blocking and
-        non-blocking sockets.
-        """
-        # @todo - KAG: need to explicitly document error return codes/exceptions!!!
-        if self._write_done:
-            return None
-
-        c = self._pn_transport.pending()
-        if c < 0:  # output done
-            try:
-                self._socket.shutdown(socket.SHUT_WR)
-            except:
-                pass
-            self._write_done = True
-            return None
-
-        if c > 0:
-            buf = self._pn_transport.peek(c)
-            try:
-                rc = self._socket.send(buf)
-                if rc > 0:
-                    self._pn_transport.pop(rc)
-                    return rc
-                # else socket closed
-                self._pn_transport.close_head()
-                self._write_done = True
-                return None
-            except socket.timeout, e:
-                raise # let the caller handle this
-            except socket.error, e:
-                err = e.args[0]
-                if (err != errno.EAGAIN and
-                    err != errno.EWOULDBLOCK and
-                    err != errno.EINTR):
-                    # otherwise, unrecoverable
-                    self._pn_transport.close_head()
-                    self._write_done = True
-                raise
-            except:
-                self._pn_transport.close_tail()
-                self._write_done = True
-                # @todo - invoke callback (?)
-                raise
-        return 0
+    def container(self):
+        return self._container
 
     @property
-    def done(self):
-        return self._write_done and self._read_done
-
-    def process_endpoints(self):
-
-        # wait until SASL has authenticated
-        if not self._sasl_done:
-            if self.sasl.state not in (SASL.STATE_PASS,
-                                       SASL.STATE_FAIL):
-                print("SASL wait.")
-                return
-
-            self._handler.sasl_done(self, self.sasl.state)
-            self._sasl_done = True
-
-        ssn = self._pn_connection.session_head(_NEED_INIT)
-        while ssn:
-            ssn.open()
-            ssn = ssn.next(_NEED_INIT)
-
-        link = self._pn_connection.link_head(_NEED_INIT)
-        while link:
-            # @todo - wrap link in the proper abstraction
-            if self._handler.link_pending(self, link):
-                link.open()
-            link = link.next(_NEED_INIT)
-
-        # @todo: any need for ACTIVE callback?
-        # process the work queue
-
-        delivery = self._pn_connection.work_head
-        while delivery:
-            !!! call back via the Link, no connection!!
-            self._endpoint_cb.delivery_update(delivery)
-            delivery = delivery.work_next
-
-        # close all endpoints closed by remotes
-
-        link = self._pn_connection.link_head(_NEED_CLOSE)
-        while link:
-            !!! Need link callback
-            self._endpoint_cb.link_remote_closed(link)
-            link = link.next(_NEED_CLOSE)
-
-        ssn = self._pn_connection.session_head(_NEED_CLOSE)
-        while ssn:
-            ssn.close()
-            ssn = ssn.next(_NEED_CLOSE)
-
-        if self._pn_connection.state == (_NEED_CLOSE):
-            # @todo determine reason, pass along
-            self._handler.connection_closed(self, None)
-
+    def links(self):
+        return self._links.values()
 
     def create_sender(self, target_address, name=None, properties={}):
         """Factory for Sender links"""
-        pass
+        pn_link = self._get_session().sender(name or uuid.uuid4().hex)
+        pn_link.target.address = target_address
+        sender = Sender(self, pn_link, properties)
+        self._add_link(sender)
+        return sender
 
-    def create_receiver(self, source_address, eventHandler, name=None,
+    def create_receiver(self, source_address, eventHandler=None, name=None,
                         properties={}):
-        """Factor for Receive links"""
-        pass
+        """Factory for Receive links"""
+        pn_link = self._get_session().receiver(name or uuid.uuid4().hex)
+        pn_link.source.address = source_address
+        receiver = Receiver(self, pn_link, eventHandler, properties)
+        self._add_link(receiver)
+        return receiver
+
+    def close(self, reason=None):
+        """Close the connection.  It is removed from the Container once the
+        close has been written, or the socket fails.
+        """
+        self._close_reason = reason
+        self._local_close = True
+        self._pn_connection.close()
+        self._container._wakeup(self)
+
+    def process(self, budget):
+        """Process endpoint and delivery state, then let links with queued
+        work do up to 'budget' units of it (e.g. messages sent), taking
+        turns.  Returns True if work is left for another pass.
+        """
+        self._interconnect.process_endpoints()
+
+        if self._blocked and not self._interconnect.event_driven:
+            # no flow events: poll the links waiting for credit
+            for link in [l for l in self._blocked if not l._blocked]:
+                self._blocked.discard(link)
+                self._activate(link, False)
+
+        while self._active and budget > 0:
+            link = self._active.popleft()
+            self._queued.discard(link)
+            done, more = link._process(budget)
+            budget -= done
+            if more:
+                self._activate(link, False)
+            elif link._blocked:
+                self._blocked.add(link)
+        return bool(self._active)
+
+    def _activate(self, link, wakeup=True):
+        """Queue a link that has work to do.
+        """
+        if link not in self._queued:
+            self._queued.add(link)
+            self._active.append(link)
+            if wakeup:
+                self._container._wakeup(self)
+
+    def _get_session(self):
+        if self._session is None:
+            self._session = self._pn_connection.session()
+            self._session.open()
+        return self._session
+
+    def _add_link(self, link):
+        self._links[(link.name, link.pn_link.is_sender)] = link
+        link._open()
+        self._container._wakeup(self)
+
+    def _remove_link(self, link):
+        key = (link.name, link.pn_link.is_sender)
+        if self._links.get(key) is link:
+            del self._links[key]
+        self._queued.discard(link)
+        self._blocked.discard(link)
+        if link in self._active:
+            self._active.remove(link)
+
+    def _close_link(self, link):
+        self._remove_link(link)
+        link.pn_link.close()
+        link._closed(None)
+        self._container._wakeup(self)
+
+    def _link_pending(self, pn_link):
+        """A link opened by the remote."""
+        result = self._handler.link_pending(self, pn_link)
+        if not result:
+            pn_link.open()
+            pn_link.close()
+            return
+        if pn_link.is_sender:
+            link = Sender(self, pn_link)
+        else:
+            link = Receiver(self, pn_link,
+                            None if result is True else result)
+        self._add_link(link)
+
+    def _link_remote_closed(self, pn_link):
+        pn_link.close()
+        link = self._links.get((pn_link.name, pn_link.is_sender))
+        if link:
+            self._remove_link(link)
+            link._closed("closed by peer")
+
+    def _link_flow(self, pn_link):
+        link = self._links.get((pn_link.name, pn_link.is_sender))
+        if link in self._blocked and not link._blocked:
+            self._blocked.discard(link)
+            self._activate(link, False)
+
+    def _delivery_update(self, delivery):
+        pn_link = delivery.link
+        link = self._links.get((pn_link.name, pn_link.is_sender))
+        if link:
+            link._handle_delivery(delivery)
+
+    def _closed(self, reason=None):
+        """The connection has closed or failed: abort all links, and
+        notify the handler once.
+        """
+        if self._finished:
+            return
+        if self._local_close:
+            reason = self._close_reason
+        self._finished = True
+        links = list(self._links.values())
+        self._links.clear()
+        self._active.clear()
+        self._queued.clear()
+        self._blocked.clear()
+        for link in links:
+            link._closed(reason)
+        self._handler.connection_closed(self, reason)
 
 
 __all__ = [
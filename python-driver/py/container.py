@@ -17,75 +17,284 @@
 # under the License.
 #
 
+import socket, errno, time
+from sockettransport import SocketTransports
+from connection import Connection, ConnectionEventHandler
+
+
+class ListenerEventHandler(object):
+    def connection_requested(self, listener, address):
+        # return a ConnectionEventHandler to accept the connection, or
+        # None to refuse it
+        return ConnectionEventHandler()
+
+
+class Listener(object):
+    """Accepts inbound connections for a Container.  Polled by the
+    Container along with its Connections.
+    """
+
+    # connections accepted per poll, so a connection storm can't starve
+    # established connections
+    ACCEPT_BATCH = 32
+
+    def __init__(self, container, name, socket, eventHandler):
+        self._container = container
+        self._name = name
+        self._socket = socket
+        self._handler = eventHandler or ListenerEventHandler()
+        self._accepted = 0
+        self._closed = False
+
+    def fileno(self):
+        return self._socket.fileno()
+
+    @property
+    def name(self):
+        return self._name
+
+    @property
+    def socket(self):
+        return self._socket
+
+    @property
+    def next_tick(self):
+        return 0
+
+    def tick(self, now):
+        return 0
+
+    @property
+    def need_read(self):
+        return not self._closed
+
+    @property
+    def need_write(self):
+        return False
+
+    @property
+    def done(self):
+        return self._closed
+
+    def read_input(self):
+        for i in range(Listener.ACCEPT_BATCH):
+            try:
+                sock, address = self._socket.accept()
+            except socket.error as e:
+                if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK, errno.EINTR):
+                    return i
+                raise
+            handler = self._handler.connection_requested(self, address)
+            if handler is None:
+                sock.close()
+                continue
+            self._accepted += 1
+            self._container._accept(self, "%s-%d" % (self._name, self._accepted),
+                                    sock, handler)
+        return Listener.ACCEPT_BATCH
+
+    def write_output(self):
+        return 0
+
+    def close(self):
+        self._container._remove_listener(self)
+
 
 class Container(object):
+    """Owns a set of outbound and inbound Connections, and runs a single
+    event loop over all of them.
+
+    Each pass of the loop does at most one read and one write per
+    connection, and gives each connection a budget of link work (e.g.
+    messages sent) shared in turn by its busy links.  Work left over by a
+    connection is resumed on the next pass, after every other connection
+    has had its turn, so a busy connection cannot starve the others.
+    """
     def __init__(self, name, properties={}):
+        """properties - optional map: "budget" units of link work per
+        connection per pass (default 64).
+        """
+        self._name = name
+        self._properties = properties
+        self._budget = properties.get("budget", 64)
         self._connections = {}
-        self._timer_heap = []  # (next_tick, connection)
+        self._listeners = {}
+        self._reactor = SocketTransports()
+        self._ready = set()  # connections with work outside of their I/O
+        self._stopped = False
+
+    @property
+    def name(self):
+        return self._name
+
+    @property
+    def connections(self):
+        return self._connections.values()
 
-    def connect(self, name, properties={}):
-        pass
+    def get_connection(self, name):
+        return self._connections.get(name)
+
+    def connect(self, name, host, port, eventHandler=None, properties={}):
+        """Start connecting to host:port.  Returns a Connection; links may
+        be created on it immediately.
+        """
+        if name in self._connections or name in self._listeners:
+            raise KeyError("Connection name clash")
+        family, socktype, proto, canonname, address = \
+            socket.getaddrinfo(host, port, 0, socket.SOCK_STREAM)[0]
+        s = socket.socket(family, socktype, proto)
+        s.setblocking(0)
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        try:
+            s.connect(address)
+        except socket.error as e:
+            if e.args[0] != errno.EINPROGRESS:
+                s.close()
+                raise
+        props = dict(properties)
+        props.setdefault("hostname", host)
+        return self._add_connection(name, s, eventHandler, props)
 
     def disconnect(self, name):
-        pass
+        connection = self._connections.get(name)
+        if connection:
+            connection.close()
+
+    def listen(self, name, host, port, eventHandler=None, backlog=128):
+        """Accept connections on host:port.  eventHandler is a
+        ListenerEventHandler.  Returns the Listener.
+        """
+        if name in self._listeners or name in self._connections:
+            raise KeyError("Listener name clash")
+        family, socktype, proto, canonname, address = \
+            socket.getaddrinfo(host, port, 0, socket.SOCK_STREAM,
+                               0, socket.AI_PASSIVE)[0]
+        s = socket.socket(family, socktype, proto)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        s.bind(address)
+        s.listen(backlog)
+        s.setblocking(0)
+        listener = Listener(self, name, s, eventHandler)
+        self._listeners[name] = listener
+        self._reactor.add(listener)
+        return listener
 
     def need_io(self):
         """Return a pair of lists containing those connections that are
         read-blocked and write-ready.
         """
-        readfd = []
-        writefd = []
-        for st in self._connections.itervalues():
-            if st.need_read:
-                readfd.append(st)
-            if st.need_write:
-                writefd.append(st)
-        return (readfd, writefd)
+        return self._reactor.need_io()
 
     def get_next_tick(self):
         """Returns the next pending timeout timestamp in seconds since Epoch,
         or 0 if no pending timeouts.  process_io() must be called at least
         once prior to the timeout.
         """
-        if not self._timer_heap:
-            return 0
-        return self._timer_heap[0][0]
+        return self._reactor.get_next_tick()
 
     def process_io(self, readable, writable):
-        """Does all I/O and timer related processing.  readble is a sequence of
-        sockettransports whose sockets are readable.  'writable' is a sequence
-        of sockettransports whose sockets are writable. This method returns a
-        set of all the SocketTransport in the container that have been
-        processed (this includes the arguments plus any that had timers
-        processed).  Use get_next_tick() to determine when process_io() must
-        be invoked again.
+        """Does all I/O, timer and protocol processing.  readble is a
+        sequence of connections whose sockets are readable.  'writable' is
+        a sequence of connections whose sockets are writable.  Returns the
+        set of connections (and listeners) that did work.
+        """
+        return self._process(self._reactor.process_io(readable, writable))
+
+    def run_once(self, deadline=None):
+        """Wait for I/O or timers until deadline (seconds since Epoch, or
+        None for no limit), then do one pass of work over all connections.
+        Does not block if a connection has work left over.  Returns the
+        number of connections and listeners that did work.
+        """
+        if self._ready:
+            deadline = time.time()
+        return len(self._process(self._reactor.do_io(deadline)))
+
+    def run_until_idle(self, timeout=0):
+        """Run until no connection has work left to do and no I/O or timer
+        events occur within 'timeout' seconds.
+        """
+        self._stopped = False
+        while not self._stopped:
+            if not self.run_once(time.time() + timeout):
+                return
+
+    def run_forever(self):
+        """Run until stop() is called.
+        """
+        self._stopped = False
+        while not self._stopped:
+            self.run_once()
+
+    def stop(self):
+        """Cause run_forever() or run_until_idle() to return after the
+        current pass.
+        """
+        self._stopped = True
+
+    def _process(self, work_list):
+        work = self._ready
+        self._ready = set()
+        work.update(c for c in work_list if isinstance(c, Connection))
+        for connection in work:
+            if connection.name not in self._connections:
+                continue
+            if connection.process(self._budget):
+                self._ready.add(connection)
+            self._service(connection)
+        return work_list | work
+
+    def _service(self, connection):
+        """Write the output of the last protocol pass without waiting for
+        the next poll, and retire the connection once its I/O is done.
         """
+        try:
+            if connection.need_write:
+                connection.write_output()
+            if connection.transport.pending() < 0:
+                connection.write_output()   # output done: shutdown
+            if connection.transport.capacity() < 0:
+                connection.read_input()     # input done: shutdown
+        except socket.error:
+            pass
+        if connection.done:
+            self._remove_connection(connection)
+        else:
+            self._reactor.mark(connection)
+
+    def _add_connection(self, name, socket, eventHandler, properties):
+        connection = Connection(self, name, socket, eventHandler, properties)
+        self._connections[name] = connection
+        self._reactor.add(connection)
+        self._ready.add(connection)
+        return connection
+
+    def _accept(self, listener, name, sock, eventHandler):
+        sock.setblocking(0)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self._add_connection(name, sock, eventHandler, {"server": True})
+
+    def _wakeup(self, connection):
+        """A connection has work to do outside of its own I/O processing.
+        """
+        self._ready.add(connection)
+
+    def _remove_connection(self, connection):
+        del self._connections[connection.name]
+        self._reactor.remove(connection.name)
+        self._ready.discard(connection)
+        connection.socket.close()
+        connection._closed("connection lost")
+
+    def _remove_listener(self, listener):
+        del self._listeners[listener.name]
+        self._reactor.remove(listener.name)
+        listener._closed = True
+        listener.socket.close()
+
 
-        work_list = set()
-        for st in readable:
-            st.read_input()
-            # check if process_read set a timer
-            if st.next_tick == 0:
-                st.tick(time.time())
-            if st.next_tick:
-                heapq.heappush(self._timer_heap, (st.next_tick, st))
-            work_list.add(st)
-
-        # process any expired transport ticks
-        while self._timer_heap and self._timer_heap[0][0] <= time.time():
-            st = heapq.heappop(self._timer_heap)
-            st.tick(time.time())
-            if st.next_tick:   # timer reset
-                heapq.heappush(self._timer_heap, (st.next_tick, st))
-            work_list.add(st)
-
-        for st in writable:
-            st.write_output()
-            # check if process_write set a timer
-            if st.next_tick == 0:
-                st.tick(time.time())
-            if st.next_tick:
-                heapq.heappush(self._timer_heap, (st.next_tick, st))
-            work_list.add(st)
-
-        return work_list
+__all__ = [
+    "ListenerEventHandler",
+    "Listener",
+    "Container"
+    ]
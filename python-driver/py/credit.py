@@ -0,0 +1,172 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+class CreditController(object):
+    """Sizes the credit window of a receiving link.
+
+    The window is kept at about twice the bandwidth-delay product of the
+    link: the rate at which messages are consumed times the round trip
+    time from granting credit to the first message it brings.  While the
+    window limits the rate (the consumer keeps up, and the rate uses most
+    of the window) it doubles with every rate sample; a consumer slower
+    than the sender shrinks it.  The window is always kept between
+    'minimum' and 'maximum', and so that the deliveries buffered plus
+    those the outstanding credit may bring cost at most 'max_bytes' (at
+    the average message size seen).
+
+    Credit is re-issued in batches: only once the outstanding credit falls
+    to 'low_water' times the window, and then back up to the full window.
+    """
+
+    SAMPLE_INTERVAL = 0.1   # seconds of consumption per rate sample
+    RTT_LIFETIME = 10.0     # seconds before the minimum rtt is re-measured
+
+    def __init__(self, initial=10, minimum=None, maximum=10000,
+                 max_bytes=4*1024*1024, low_water=0.5, alpha=0.25):
+        self._minimum = max(1, minimum if minimum is not None else initial)
+        self._maximum = max(self._minimum, maximum)
+        self._max_bytes = max_bytes
+        self._low_water = low_water
+        self._alpha = alpha
+        self._window = min(max(initial, self._minimum), self._maximum)
+        self._rate = 0.0        # messages/second, EWMA
+        self._rtt = 0.0         # seconds, recent minimum
+        self._rtt_stamp = 0.0
+        self._avg_size = 0.0    # bytes/message, EWMA
+        self._grant_time = None # when credit was granted to an idle link
+        self._sample_start = None
+        self._sample_count = 0
+        self._sample_backlog = 0    # fewest buffered during the sample
+        self._last_consumed = 0.0
+        self._buffered = 0      # deliveries arrived but not yet consumed
+
+    @property
+    def window(self):
+        """The current credit window, in messages."""
+        return self._window
+
+    @property
+    def rate(self):
+        """Consumption rate, in messages/second."""
+        return self._rate
+
+    @property
+    def rtt(self):
+        """Round trip time from credit grant to delivery, in seconds."""
+        return self._rtt
+
+    @property
+    def average_size(self):
+        """Average message size, in bytes."""
+        return self._avg_size
+
+    @property
+    def buffered(self):
+        """Deliveries arrived but not yet consumed."""
+        return self._buffered
+
+    @property
+    def buffered_bytes(self):
+        """Estimated bytes held by the buffered deliveries."""
+        return int(self._buffered * self._avg_size)
+
+    def consumed(self, count, nbytes, buffered, now):
+        """Record that 'count' messages totalling 'nbytes' have been
+        consumed, leaving 'buffered' deliveries waiting.
+        """
+        self._buffered = buffered
+        self._sample_backlog = min(self._sample_backlog, buffered)
+        if not count:
+            return
+        if self._grant_time is not None:
+            self._sample_rtt(now - self._grant_time, now)
+            self._grant_time = None
+        size = float(nbytes) / count
+        if self._avg_size:
+            self._avg_size += self._alpha * (size - self._avg_size)
+        else:
+            self._avg_size = size
+
+        # don't let idle periods count against the rate
+        if (self._sample_start is None or
+            now - self._last_consumed > CreditController.SAMPLE_INTERVAL):
+            self._sample_start = now
+            self._sample_count = 0
+            self._sample_backlog = buffered
+        self._last_consumed = now
+        self._sample_count += count
+        elapsed = now - self._sample_start
+        if elapsed >= CreditController.SAMPLE_INTERVAL:
+            rate = self._sample_count / elapsed
+            if rate > self._rate:
+                self._rate = rate   # grow fast, in case window limited
+            else:
+                self._rate += self._alpha * (rate - self._rate)
+            self._sample_start = now
+            self._sample_count = 0
+            backlog = self._sample_backlog
+            self._sample_backlog = buffered
+            if self._rtt:
+                window = int(2 * self._rate * self._rtt)
+                if (backlog == 0 and
+                    self._rate * self._rtt >= self._window * self._low_water):
+                    # the consumer caught up during the sample, so the
+                    # window limits the rate: grow quickly rather than
+                    # wait for the rate to catch up with each increase
+                    window = max(window, 2 * self._window)
+                self._resize(window)
+
+    def credit(self, outstanding, now):
+        """Return the credit to grant, given the credit still outstanding
+        on the link: zero until it falls below the low water mark.
+        """
+        target = self._window
+        if self._avg_size:
+            # stay within the byte budget, counting buffered deliveries.
+            # Once those are consumed at least one more is always allowed,
+            # else messages larger than the budget would stall the link.
+            budget = int(self._max_bytes / self._avg_size) - self._buffered
+            target = min(target, max(budget, 0 if self._buffered else 1))
+        if outstanding > target * self._low_water:
+            return 0
+        grant = target - outstanding
+        if grant <= 0:
+            return 0
+        if (outstanding <= 0 and self._grant_time is None and
+            self._last_consumed == now):
+            # the link is busy but has run out of credit: the next
+            # delivery measures the round trip
+            self._grant_time = now
+        return grant
+
+    def _sample_rtt(self, sample, now):
+        if (not self._rtt or sample < self._rtt or
+            now - self._rtt_stamp > CreditController.RTT_LIFETIME):
+            self._rtt = sample
+            self._rtt_stamp = now
+
+    def _resize(self, window):
+        if self._avg_size:
+            window = min(window, int(self._max_bytes / self._avg_size))
+        self._window = min(max(window, self._minimum), self._maximum)
+
+
+__all__ = [
+    "CreditController"
+    ]
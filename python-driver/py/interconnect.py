@@ -18,6 +18,10 @@
 #
 
 from proton import Connection, Endpoint, SASL
+try:
+    from proton import Collector, Event
+except ImportError:     # binding without events: scan the endpoint lists
+    Collector = None
 
 class EndpointEventHandler(object):
     # @todo: why need active()?  Will it use excessive cpu?
@@ -48,27 +52,52 @@ class EndpointEventHandler(object):
     def link_active(self, link):
         pass
 
-    def link_closed(self, link):
-        link.closed()
+    def link_remote_closed(self, link):
+        link.close()
+
+    def link_flow(self, link):
+        # only called when event driven
+        pass
 
     def delivery_update(self, delivery):
         pass
 
 _NEED_INIT = Endpoint.LOCAL_UNINIT
 _NEED_CLOSE = (Endpoint.LOCAL_ACTIVE|Endpoint.REMOTE_CLOSED)
+_LINK_FLOW = getattr(Event, "LINK_FLOW", None) if Collector else None
 
 class Interconnect(object):
+    """Dispatches the endpoint and delivery changes of a Proton connection
+    to an EndpointEventHandler.
+
+    Where the binding provides an event Collector only the endpoints and
+    deliveries named by events are examined, so the cost of each
+    process_endpoints() call depends on what changed, not on the number of
+    sessions, links and unsettled deliveries.  Otherwise the endpoint lists
+    and the whole delivery work list are scanned on every call.
+    """
     # @todo - Need a better name than "Interconnect"
     def __init__(self, endpoint_handler, sasl):
         # @todo - remove sasl???
         self._connection = Connection()
         self._endpoint_cb = endpoint_handler
         self.sasl = sasl
+        self._collector = None
+        if Collector:
+            self._collector = Collector()
+            self._connection.collect(self._collector)
 
     @property
     def connection(self):
         return self._connection
 
+    @property
+    def event_driven(self):
+        """True if link_flow() callbacks are made: the binding must have
+        an event Collector that reports link flow.
+        """
+        return _LINK_FLOW is not None
+
     def process_endpoints(self):
 
         # wait until SASL has authenticated
@@ -76,12 +105,52 @@ class Interconnect(object):
         if self.sasl:
             if self.sasl.state not in (SASL.STATE_PASS,
                                        SASL.STATE_FAIL):
-                print("SASL wait.")
                 return
 
             self._endpoint_cb.sasl_done(self.sasl)
             self.sasl = None
 
+        if self._collector:
+            self._dispatch_events()
+        else:
+            self._scan_endpoints()
+
+    def _dispatch_events(self):
+        cb = self._endpoint_cb
+        collector = self._collector
+        event = collector.peek()
+        while event:
+            # dispatch on the most specific object of the event, by its
+            # state, as the event types differ between proton versions
+            if event.delivery:
+                cb.delivery_update(event.delivery)
+            elif event.link:
+                link = event.link
+                state = link.state
+                if state & _NEED_INIT:
+                    cb.link_pending(link)
+                elif state & _NEED_CLOSE == _NEED_CLOSE:
+                    cb.link_remote_closed(link)
+                elif event.type == _LINK_FLOW:
+                    cb.link_flow(link)
+            elif event.session:
+                ssn = event.session
+                state = ssn.state
+                if state & _NEED_INIT:
+                    cb.session_pending(ssn)
+                elif state & _NEED_CLOSE == _NEED_CLOSE:
+                    cb.session_remote_closed(ssn)
+            elif event.connection:
+                state = self._connection.state
+                if state & _NEED_INIT:
+                    cb.connection_pending(self._connection)
+                elif state == _NEED_CLOSE:
+                    cb.connection_remote_closed(self._connection)
+            collector.pop()
+            event = collector.peek()
+
+    def _scan_endpoints(self):
+
         if self._connection.state & _NEED_INIT:
             self._endpoint_cb.connection_pending(self._connection)
 
@@ -100,8 +169,10 @@ class Interconnect(object):
 
         delivery = self._connection.work_head
         while delivery:
+            # the callback may settle the delivery, removing it from the list
+            next_delivery = delivery.work_next
             self._endpoint_cb.delivery_update(delivery)
-            delivery = delivery.work_next
+            delivery = next_delivery
 
         # close all endpoints closed by remotes
 
@@ -112,7 +183,7 @@ class Interconnect(object):
 
         ssn = self._connection.session_head(_NEED_CLOSE)
         while ssn:
-            self._endpoint_cb.session_remote_closed(link)
+            self._endpoint_cb.session_remote_closed(ssn)
             ssn = ssn.next(_NEED_CLOSE)
 
         if self._connection.state == (_NEED_CLOSE):
@@ -17,63 +17,305 @@
 # under the License.
 #
 
+import collections, time
+import proton
+from proton import Delivery
+from credit import CreditController
+
+# Message.encode() without its buffer sizing, if the binding exposes it
+_pn_message_encode = getattr(proton, "pn_message_encode", None)
+_PN_OVERFLOW = getattr(proton, "PN_OVERFLOW", None)
+
+_NOT_FOUND = object()
+
+
 class _Link(object):
-    def __init__(self, connection, address, name, properties={}):
+    """Base class for the Sender and Receiver links of a Connection.
+    """
+    def __init__(self, connection, pn_link, properties={}):
         self._connection = connection
-        self._address = target_address
-        self._name = name
+        self._pn_link = pn_link
         self._properties = properties
 
+    @property
+    def name(self):
+        return self._pn_link.name
+
+    @property
+    def connection(self):
+        return self._connection
+
+    @property
+    def pn_link(self):
+        return self._pn_link
+
+    def close(self):
+        """Close the link.  Any messages not yet sent are aborted.
+        """
+        self._connection._close_link(self)
+
+    def _open(self):
+        self._pn_link.open()
+
+    def _process(self, budget):
+        """Do up to 'budget' units of queued work.  Returns a tuple of the
+        units done and True if work was left undone because of the budget.
+        """
+        return (0, False)
+
+    @property
+    def _blocked(self):
+        """True if the link has queued work but must wait for credit.
+        """
+        return False
+
+    def _handle_delivery(self, delivery):
+        pass
+
+    def _closed(self, reason):
+        """Called once the link can no longer be used.
+        """
+        pass
+
 
 class Sender(_Link):
-    !!! need to accept a pre-available pn_sender!!!
-    def __init__(self, connection, target_address, name=None, properties={}):
-        super(Sender, self).__init__(connection, target_address,
-                                     name, properties)
-        self._pending_send = []
-        self._pending_ack = []
+    """A link for sending messages.  Messages are queued by send() and
+    written in batches, as far as credit allows, when the owning Container
+    runs.
 
+    Pre-settled messages (the default) are not tracked once written.
+    Messages sent with FLAGS_ACKED are tracked by delivery tag until the
+    remote settles them.
+    """
+
+    # send() flags
     FLAGS_NONE=0
     FLAGS_ACKED=1
-    def send(message, callback=None, timeout=None, flags=FLAGS_NONE):
-        if callback:
-            if flags & FLAGS_ACKED:
-                # invoke callback with final disposition on delivery
-                # eg. REJECTED, ACCEPTED, etc (send un-settled)
-                pass
+
+    # send() callback status, other than the final delivery state
+    # (proton.Delivery.ACCEPTED, REJECTED, etc)
+    IN_PROGRESS=-1
+    ABORTED=-2
+
+    # tag shared by all pre-settled deliveries: a tag need only be unique
+    # among the link's unsettled deliveries
+    _PRESETTLED_TAG = "0"
+
+    def __init__(self, connection, pn_link, properties={}):
+        super(Sender, self).__init__(connection, pn_link, properties)
+        self._pending_send = collections.deque() # (message, callback, flags)
+        self._pending_ack = {}    # delivery tag -> callback
+        self._next_tag = 1
+        self._encode_size = 1024  # initial encode buffer size
+        self._raw_encode = (_pn_message_encode is not None)
+
+    @property
+    def pending(self):
+        """Number of messages waiting for credit.
+        """
+        return len(self._pending_send)
+
+    @property
+    def unacked(self):
+        """Number of messages sent with FLAGS_ACKED and not yet settled.
+        """
+        return len(self._pending_ack)
+
+    def send(self, message, callback=None, timeout=None, flags=FLAGS_NONE):
+        """Queue a message for sending.  message is a proton.Message, or a
+        message already encoded as a string (e.g. to send the same message
+        many times without re-encoding it).
+
+        If FLAGS_ACKED is set the message is sent unsettled, and the
+        callback is invoked with its final delivery state (eg. ACCEPTED,
+        REJECTED) once the remote settles it.  Otherwise the message is
+        sent pre-settled, and the callback (if any) is invoked with
+        IN_PROGRESS when it has been written to the link.  Messages still
+        pending when the link closes are completed with ABORTED.
+
+        The message is encoded when it is written, not when it is queued,
+        so it must not be modified until then.
+        """
+        # @todo timeout
+        if not self._pending_send:
+            self._connection._activate(self)
+        self._pending_send.append((message, callback, flags))
+
+    def _encode(self, message):
+        """Encode a proton.Message.  Message.encode() starts each call with
+        a tiny buffer and retries with a doubled one until the message
+        fits, so large messages cost several encodes and allocations.
+        Where the binding allows, encode directly, starting from the size
+        that last worked for this link.
+        """
+        if isinstance(message, bytes):
+            return message
+        if self._raw_encode:
+            try:
+                message._pre_encode()
+                size = self._encode_size
+                while True:
+                    err, data = _pn_message_encode(message._msg, size)
+                    if err != _PN_OVERFLOW:
+                        break
+                    size *= 2
+                if err < 0:
+                    raise proton.MessageException("[%s]: %s" % (err, data))
+                self._encode_size = size
+                return data
+            except AttributeError:
+                self._raw_encode = False   # binding internals differ
+        return message.encode()
+
+    def _process(self, budget):
+        link = self._pn_link
+        count = min(len(self._pending_send), link.credit, budget)
+        if count <= 0:
+            return (0, False)
+        pending_send = self._pending_send
+        pending_ack = self._pending_ack
+        encode = self._encode
+        for i in range(count):
+            message, callback, flags = pending_send.popleft()
+            if flags & Sender.FLAGS_ACKED:
+                tag = str(self._next_tag)
+                self._next_tag += 1
+                link.delivery(tag)
+                link.send(encode(message))
+                link.advance()
+                pending_ack[tag] = callback
             else:
-                # invoke callback with IN_PROGRESS when credit has become
-                # available and message written. (send pre-settled)
-                pass
-        # need to invoke cb with ABORTED on close of connection!
+                # fast path: nothing to track
+                delivery = link.delivery(Sender._PRESETTLED_TAG)
+                link.send(encode(message))
+                link.advance()
+                delivery.settle()
+                if callback:
+                    callback(self, Sender.IN_PROGRESS)
+        return (count, bool(pending_send) and link.credit > 0)
 
-    def close(self):
-        # @todo remove from owning connection
-        pass
+    @property
+    def _blocked(self):
+        return bool(self._pending_send) and self._pn_link.credit <= 0
 
     def _handle_delivery(self, delivery):
-        pass
+        if not (delivery.updated or delivery.settled):
+            return
+        callback = self._pending_ack.pop(delivery.tag, _NOT_FOUND)
+        if callback is not _NOT_FOUND:
+            delivery.settle()
+            if callback:
+                callback(self, delivery.remote_state)
+
+    def _closed(self, reason):
+        callbacks = ([cb for m, cb, f in self._pending_send] +
+                     list(self._pending_ack.values()))
+        self._pending_send.clear()
+        self._pending_ack.clear()
+        for callback in callbacks:
+            if callback:
+                callback(self, Sender.ABORTED)
+
 
 class ReceiveEventHandler(object):
 
     def message_received(self, receiver, msg):
-        # return ACCEPTED or REJECTED
+        # return ACCEPTED or REJECTED (None means ACCEPTED)
         pass
 
     def closed(self, receiver, reason):
         pass
 
-class Receiver(object):
 
-    def __init__(self, connection, target_address, eventHandler,
-                 name=None, properties={}):
-        super(Receiver, self).__init__(connection, target_address,
-                                       name, properties)
-        self._credit = properties.get("capacity", 10)
+class Receiver(_Link):
+    """A link for receiving messages.  Each message is passed to the
+    ReceiveEventHandler, and settled with the returned outcome.
 
-        self._handler = eventHandler
+    Credit is managed by a CreditController, sized by these properties:
+    "capacity" - initial (and by default minimum) window, default 10
+    "min_capacity" - smallest window
+    "max_capacity" - largest window, default 10000
+    "max_bytes" - byte budget for buffered and in-flight deliveries,
+    default 4MB
+    """
+    def __init__(self, connection, pn_link, eventHandler=None,
+                 properties={}):
+        super(Receiver, self).__init__(connection, pn_link, properties)
+        self._handler = eventHandler or ReceiveEventHandler()
+        self._credit = CreditController(
+            initial=properties.get("capacity", 10),
+            minimum=properties.get("min_capacity"),
+            maximum=properties.get("max_capacity", 10000),
+            max_bytes=properties.get("max_bytes", 4*1024*1024))
+
+    @property
+    def window(self):
+        """Current credit window, in messages."""
+        return self._credit.window
+
+    @property
+    def credit(self):
+        """Credit outstanding at the sender."""
+        return self._pn_link.credit
+
+    @property
+    def buffered(self):
+        """Deliveries arrived but not yet passed to the handler."""
+        return self._credit.buffered
+
+    @property
+    def buffered_bytes(self):
+        """Estimated bytes held by the buffered deliveries."""
+        return self._credit.buffered_bytes
+
+    @property
+    def controller(self):
+        """The CreditController, for its rate and rtt estimates."""
+        return self._credit
+
+    def _open(self):
+        self._pn_link.open()
+        self._flow(time.time())
 
     def _handle_delivery(self, delivery):
-        pass
+        # consumed by _process(), within the connection's budget
+        self._connection._activate(self, False)
+
+    def _process(self, budget):
+        link = self._pn_link
+        handler = self._handler
+        count = 0
+        nbytes = 0
+        delivery = link.current
+        while (count < budget and delivery and delivery.readable and
+               not delivery.partial):
+            size = delivery.pending
+            msg = proton.Message()
+            msg.decode(link.recv(size))
+            link.advance()
+            status = handler.message_received(self, msg)
+            delivery.update(status or Delivery.ACCEPTED)
+            delivery.settle()
+            count += 1
+            nbytes += size
+            delivery = link.current
+        more = bool(delivery and delivery.readable and not delivery.partial)
+        now = time.time()
+        self._credit.consumed(count, nbytes, link.queued, now)
+        self._flow(now)
+        return (count, more)
+
+    def _flow(self, now):
+        grant = self._credit.credit(self._pn_link.credit, now)
+        if grant:
+            self._pn_link.flow(grant)
+
+    def _closed(self, reason):
+        self._handler.closed(self, reason)
+
 
-    
+__all__ = [
+    "Sender",
+    "ReceiveEventHandler",
+    "Receiver"
+    ]
@@ -17,23 +17,57 @@
 # under the License.
 #
 
-import socket, errno, time, heapq, select
+import socket, errno, time, select, math, collections
 from proton import Transport
+from timers import Timers
+
+# socket.sendmsg() (gathering writes) is only available from Python 3.3
+_HAVE_SENDMSG = hasattr(socket.socket, "sendmsg")
 
 
 class SocketTransport(object):
     """Provides network I/O for a Proton Transport via a socket.
+
+    By default the number of times data is copied between the socket and
+    the Transport is kept to a minimum.  Input is received into a
+    preallocated buffer (recv_into) rather than a new string per read, and
+    is pushed to the Transport from that buffer if the Proton binding
+    accepts buffer objects (it falls back to a single copy if it does not).
+    Output is taken from the Transport exactly once: peek() always returns
+    a copy of the Transport's output buffer, so the data is popped from the
+    Transport as soon as it has been peeked and is held here until the
+    socket accepts it.  A partial send therefore never causes the same
+    bytes to be copied out of the Transport again, and any queued output
+    buffers are written with a single sendmsg() call where it exists.
     """
-    def __init__(self, socket, name=None):
+
+    # read at most this much per read_input() call
+    READ_BUFFER_SIZE = 65536
+    # stop taking output from the Transport while this much is queued
+    OUTPUT_HIGH_WATER = 1024 * 1024
+    # maximum number of buffers passed to one sendmsg() call
+    MAX_IOV = 64
+
+    def __init__(self, socket, name=None, transport=None, zero_copy=True):
         """socket - Python socket. Expected to be configured and connected.
         name - optional name for this SocketTransport
+        transport - optional Transport, a new proton.Transport by default
+        zero_copy - if False, use the simple recv()/peek()/send() I/O path
+        (one new string per read and a fresh copy of the output per write).
         """
         self._name = name
         self._socket = socket
-        self._transport = Transport()
+        self._transport = transport if transport is not None else Transport()
         self._read_done = False
         self._write_done = False
         self._next_tick = 0
+        self._zero_copy = zero_copy
+        if zero_copy:
+            self._read_buffer = bytearray(self.READ_BUFFER_SIZE)
+            self._read_view = memoryview(self._read_buffer)
+            self._push_view = True  # until the binding says otherwise
+        self._output = collections.deque()  # popped but unsent output
+        self._output_bytes = 0
 
     def fileno(self):
         """Allows use of a SocketTransport by the select module.
@@ -75,7 +109,8 @@ class SocketTransport(object):
     def need_write(self):
         """True when the Transport has data to write to the network layer.
         """
-        return (not self._write_done) and self._transport.pending() > 0
+        return (not self._write_done) and (self._output_bytes > 0 or
+                                           self._transport.pending() > 0)
 
     def read_input(self):
         """Read from the network layer and processes all data read.  Can
@@ -95,17 +130,24 @@ class SocketTransport(object):
 
         if c > 0:
             try:
-                buf = self._socket.recv(c)
-                if buf:
-                    self._transport.push(buf)
-                    return len(buf)
+                if self._zero_copy:
+                    count = self._socket.recv_into(self._read_view,
+                                                   min(c, len(self._read_buffer)))
+                    if count:
+                        self._push(self._read_view[:count])
+                        return count
+                else:
+                    buf = self._socket.recv(c)
+                    if buf:
+                        self._transport.push(buf)
+                        return len(buf)
                 # else socket closed
                 self._transport.close_tail()
                 self._read_done = True
                 return None
-            except socket.timeout, e:
+            except socket.timeout as e:
                 raise  # let the caller handle this
-            except socket.error, e:
+            except socket.error as e:
                 err = e.args[0]
                 if (err != errno.EAGAIN and
                     err != errno.EWOULDBLOCK and
@@ -120,6 +162,19 @@ class SocketTransport(object):
                 raise
         return 0
 
+    def _push(self, view):
+        """Push input from the read buffer into the Transport, without an
+        intermediate string if the binding supports it.
+        """
+        if self._push_view:
+            try:
+                self._transport.push(view)
+                return
+            except TypeError:
+                # this binding only accepts strings
+                self._push_view = False
+        self._transport.push(view.tobytes())
+
     def write_output(self):
         """Write data to the network layer.  Can support both blocking and
         non-blocking sockets.
@@ -128,6 +183,70 @@ class SocketTransport(object):
         if self._write_done:
             return None
 
+        if not self._zero_copy:
+            return self._write_copy()
+
+        c = self._transport.pending()
+        if c < 0 and not self._output:  # output done
+            try:
+                self._socket.shutdown(socket.SHUT_WR)
+            except:
+                pass
+            self._write_done = True
+            return None
+
+        if c > 0 and self._output_bytes < self.OUTPUT_HIGH_WATER:
+            buf = self._transport.peek(c)
+            self._transport.pop(len(buf))
+            self._output.append(memoryview(buf))
+            self._output_bytes += len(buf)
+
+        if self._output:
+            try:
+                if _HAVE_SENDMSG and len(self._output) > 1:
+                    rc = self._socket.sendmsg(list(self._output)[:self.MAX_IOV])
+                else:
+                    rc = self._socket.send(self._output[0])
+                if rc > 0:
+                    self._consume(rc)
+                    return rc
+                # else socket closed
+                self._transport.close_head()
+                self._write_done = True
+                return None
+            except socket.timeout as e:
+                raise # let the caller handle this
+            except socket.error as e:
+                err = e.args[0]
+                if (err != errno.EAGAIN and
+                    err != errno.EWOULDBLOCK and
+                    err != errno.EINTR):
+                    # otherwise, unrecoverable
+                    self._transport.close_head()
+                    self._write_done = True
+                raise
+            except:
+                self._transport.close_tail()
+                self._write_done = True
+                raise
+        return 0
+
+    def _consume(self, count):
+        """Discard 'count' bytes written from the front of the output queue.
+        """
+        self._output_bytes -= count
+        while count:
+            head = self._output[0]
+            if len(head) > count:
+                self._output[0] = head[count:]
+                return
+            count -= len(head)
+            self._output.popleft()
+
+    def _write_copy(self):
+        """write_output() without the output queue: copies all pending output
+        from the Transport for every write.
+        """
         c = self._transport.pending()
         if c < 0:  # output done
             try:
@@ -148,9 +267,9 @@ class SocketTransport(object):
                 self._transport.close_head()
                 self._write_done = True
                 return None
-            except socket.timeout, e:
+            except socket.timeout as e:
                 raise # let the caller handle this
-            except socket.error, e:
+            except socket.error as e:
                 err = e.args[0]
                 if (err != errno.EAGAIN and
                     err != errno.EWOULDBLOCK and
@@ -170,17 +289,82 @@ class SocketTransport(object):
         return self._write_done and self._read_done
 
 
+class _SelectPoller(object):
+    """Minimal poll-like interface over select.select(), used only where
+    neither epoll nor poll are available.  Limited to FD_SETSIZE
+    descriptors.
+    """
+    def __init__(self):
+        self._fds = {}
+
+    def register(self, fd, mask):
+        self._fds[fd] = mask
+
+    def modify(self, fd, mask):
+        self._fds[fd] = mask
+
+    def unregister(self, fd):
+        del self._fds[fd]
+
+    def poll(self, timeout):
+        if timeout < 0:
+            timeout = None
+        r = [fd for fd, m in self._fds.items() if m & SocketTransports.READ]
+        w = [fd for fd, m in self._fds.items() if m & SocketTransports.WRITE]
+        if not (r or w) and timeout is None:
+            raise ValueError("Blocking forever with no descriptors to poll")
+        readable, writable, ignore = select.select(r, w, [], timeout)
+        events = dict((fd, SocketTransports.READ) for fd in readable)
+        for fd in writable:
+            events[fd] = events.get(fd, 0) | SocketTransports.WRITE
+        return events.items()
+
+
 class SocketTransports(object):
     """Container for SocketTransports.  Provides convenience methods for I/O
     and timer event processing.
+
+    The sockets are registered with the best poller available (epoll, then
+    poll, then select) for as long as they are in the container.  Their
+    interest set is only recomputed for 'dirty' transports: those processed
+    by the last process_io() call, and any passed to mark().  The cost of
+    each do_io() call therefore depends on the number of active transports,
+    not on the total.  If a transport may need I/O due to work done outside
+    of its own I/O processing (e.g. a message sent on one of its links while
+    handling another connection) call mark() on it.
     """
 
+    # interest/event flags
+    if hasattr(select, "epoll"):
+        READ, WRITE = select.EPOLLIN, select.EPOLLOUT
+        ERROR = select.EPOLLERR | select.EPOLLHUP
+    elif hasattr(select, "poll"):
+        READ, WRITE = select.POLLIN, select.POLLOUT
+        ERROR = select.POLLERR | select.POLLHUP | select.POLLNVAL
+    else:
+        READ, WRITE, ERROR = 1, 4, 0
+
     def __init__(self):
         self._transports = {}
-        self._timer_heap = [] # (next_tick, sockettransport)
+        self._timers = Timers()  # one per sockettransport, at next_tick
+        self._by_fd = {}      # fileno -> sockettransport
+        self._interest = {}   # fileno -> registered event mask
+        self._dirty = set()
+        if hasattr(select, "epoll"):
+            self._poller = select.epoll()
+            self._timeout_scale = 1.0     # epoll timeout in seconds
+        elif hasattr(select, "poll"):
+            self._poller = select.poll()
+            self._timeout_scale = 1000.0  # poll timeout in milliseconds
+        else:
+            self._poller = _SelectPoller()
+            self._timeout_scale = 1.0
 
     def __iter__(self):
-        return self._transports.itervalues()
+        return iter(self._transports.values())
+
+    def __len__(self):
+        return len(self._transports)
 
     def add(self, socket_transport):
         if not socket_transport.name:
@@ -188,31 +372,82 @@ class SocketTransports(object):
         if socket_transport.name in self._transports:
             raise KeyError('SocketTransport name clash')
         self._transports[socket_transport.name] = socket_transport
+        fd = socket_transport.fileno()
+        self._by_fd[fd] = socket_transport
+        self._interest[fd] = 0
+        self._poller.register(fd, 0)
+        self._dirty.add(socket_transport)
 
     def remove(self, name):
-        del self._transports[name]
+        st = self._transports.pop(name)
+        fd = st.fileno()
+        if self._by_fd.get(fd) is st:
+            del self._by_fd[fd]
+            if fd in self._interest:
+                del self._interest[fd]
+                try:
+                    self._poller.unregister(fd)
+                except (KeyError, IOError, OSError, ValueError):
+                    pass    # socket already closed
+        self._dirty.discard(st)
+        self._timers.cancel(st)
+
+    def mark(self, socket_transport):
+        """Flag a SocketTransport whose need for I/O may have changed, so its
+        interest set is updated by the next call to do_io().
+        """
+        self._dirty.add(socket_transport)
 
     def need_io(self):
         """Return a pair of lists containing those socket-transports that are
-        read-blocked and write-ready.
+        read-blocked and write-ready.  Note that this examines every
+        transport - do_io() is more efficient with many transports.
         """
         readfd = []
         writefd = []
-        for st in self._transports.itervalues():
+        for st in self._transports.values():
             if st.need_read:
                 readfd.append(st)
             if st.need_write:
                 writefd.append(st)
         return (readfd, writefd)
 
+    def _update_interest(self):
+        """Update the registered interest of all the dirty transports.
+        """
+        for st in self._dirty:
+            if st.name not in self._transports:
+                continue
+            fd = st.fileno()
+            if st.done:
+                # stop polling - errors/hangups would be reported forever
+                if fd in self._interest:
+                    del self._interest[fd]
+                    self._poller.unregister(fd)
+                continue
+            mask = 0
+            if st.need_read:
+                mask |= self.READ
+            if st.need_write:
+                mask |= self.WRITE
+            if mask != self._interest[fd]:
+                self._poller.modify(fd, mask)
+                self._interest[fd] = mask
+        self._dirty.clear()
+
     def get_next_tick(self):
         """Returns the next pending timeout timestamp in seconds since Epoch,
         or 0 if no pending timeouts.  process_io() must be called at least
         once prior to the timeout.
         """
-        if not self._timer_heap:
-            return 0
-        return self._timer_heap[0][0]
+        return self._timers.next_deadline()
+
+    def _update_timer(self, st, now):
+        """(Re)schedule the transport's timer after it has done I/O.
+        """
+        if st.next_tick == 0:
+            st.tick(now)
+        self._timers.schedule(st, st.next_tick)
 
     def process_io(self, readable, writable):
         """Does all I/O and timer related processing.  readble is a sequence of
@@ -221,36 +456,37 @@ class SocketTransports(object):
         set of all the SocketTransport in the container that have been
         processed (this includes the arguments plus any that had timers
         processed).  Use get_next_tick() to determine when process_io() must
-        be invoked again.
+        be invoked again.  Socket errors do not propagate: a transport that
+        fails is marked done (see SocketTransport.done).
         """
 
         work_list = set()
+        now = time.time()
         for st in readable:
-            st.read_input()
-            # check if process_read set a timer
-            if st.next_tick == 0:
-                st.tick(time.time())
-            if st.next_tick:
-                heapq.heappush(self._timer_heap, (st.next_tick, st))
+            try:
+                st.read_input()
+            except socket.error:
+                pass
+            self._update_timer(st, now)
             work_list.add(st)
 
         # process any expired transport ticks
-        while self._timer_heap and self._timer_heap[0][0] <= time.time():
-            st = heapq.heappop(self._timer_heap)
-            st.tick(time.time())
-            if st.next_tick:   # timer reset
-                heapq.heappush(self._timer_heap, (st.next_tick, st))
+        now = time.time()
+        for st in self._timers.expired(now):
+            st.tick(now)
+            self._timers.schedule(st, st.next_tick)
             work_list.add(st)
 
         for st in writable:
-            st.write_output()
-            # check if process_write set a timer
-            if st.next_tick == 0:
-                st.tick(time.time())
-            if st.next_tick:
-                heapq.heappush(self._timer_heap, (st.next_tick, st))
+            try:
+                st.write_output()
+            except socket.error:
+                pass
+            self._update_timer(st, now)
             work_list.add(st)
 
+        # the caller will process these, so their I/O needs may change:
+        self._dirty.update(work_list)
         return work_list
 
 
@@ -262,7 +498,7 @@ class SocketTransports(object):
         occurs or a timer expires.
         """
 
-        readfd, writefd = self.need_io()
+        self._update_interest()
 
         timeout = None
         next_tick = self.get_next_tick()
@@ -270,9 +506,26 @@ class SocketTransports(object):
             deadline = deadline if (deadline and deadline < next_tick) else next_tick
         if deadline:
             now = time.time()
-            deadline = 0 if deadline <= now else now - deadline
-
-        readable,writable,ignore = select.select(readfd,writefd,[],timeout)
+            timeout = 0 if deadline <= now else deadline - now
+
+        if timeout is None:
+            events = self._poller.poll(-1)
+        elif self._timeout_scale == 1.0:
+            events = self._poller.poll(timeout)
+        else:
+            # round up, so we do not spin until the deadline
+            events = self._poller.poll(int(math.ceil(timeout * self._timeout_scale)))
+
+        readable = []
+        writable = []
+        for fd, mask in events:
+            st = self._by_fd.get(fd)
+            if st is None:
+                continue
+            if mask & (self.READ | self.ERROR):
+                readable.append(st)
+            if mask & (self.WRITE | self.ERROR):
+                writable.append(st)
 
         return self.process_io(readable, writable)
 
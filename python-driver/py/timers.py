@@ -0,0 +1,116 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+import heapq, itertools
+
+
+class Timers(object):
+    """A set of timers, at most one per key (e.g. per SocketTransport).
+
+    Deadlines are held in a heap.  Rescheduling or cancelling a key only
+    marks its existing heap entry as stale - O(1) - and scheduling pushes a
+    new entry - O(log n).  Stale entries are discarded when they reach the
+    top of the heap, and the heap is rebuilt whenever stale entries
+    outnumber the live ones, so memory stays proportional to the number of
+    keys with a pending timer no matter how often they are rescheduled.
+    Keys need only be hashable; they are never compared.
+    """
+
+    _COMPACT_MIN = 64   # don't bother compacting heaps smaller than this
+
+    def __init__(self):
+        self._heap = []      # [deadline, sequence, key], key None if stale
+        self._entries = {}   # key -> its live heap entry
+        self._stale = 0
+        self._sequence = itertools.count()
+
+    def __len__(self):
+        return len(self._entries)
+
+    def __contains__(self, key):
+        return key in self._entries
+
+    def deadline(self, key):
+        """The deadline scheduled for key, or 0 if none.
+        """
+        entry = self._entries.get(key)
+        return entry[0] if entry else 0
+
+    def schedule(self, key, deadline):
+        """Set key's timer to expire at deadline (seconds since Epoch),
+        replacing any timer already set for it.  A deadline of zero
+        cancels the timer.
+        """
+        if not deadline:
+            self.cancel(key)
+            return
+        entry = self._entries.get(key)
+        if entry:
+            if entry[0] == deadline:
+                return
+            entry[2] = None
+            self._stale += 1
+        entry = [deadline, next(self._sequence), key]
+        self._entries[key] = entry
+        heapq.heappush(self._heap, entry)
+        self._maybe_compact()
+
+    def cancel(self, key):
+        """Remove key's timer, if any.
+        """
+        entry = self._entries.pop(key, None)
+        if entry:
+            entry[2] = None
+            self._stale += 1
+            self._maybe_compact()
+
+    def next_deadline(self):
+        """The earliest pending deadline, or 0 if no timers are set.
+        """
+        heap = self._heap
+        while heap and heap[0][2] is None:
+            heapq.heappop(heap)
+            self._stale -= 1
+        return heap[0][0] if heap else 0
+
+    def expired(self, now):
+        """Remove and return the keys of all timers with a deadline at or
+        before now, earliest first.
+        """
+        keys = []
+        heap = self._heap
+        while heap and heap[0][0] <= now:
+            deadline, sequence, key = heapq.heappop(heap)
+            if key is None:
+                self._stale -= 1
+            else:
+                del self._entries[key]
+                keys.append(key)
+        return keys
+
+    def _maybe_compact(self):
+        if self._stale > self._COMPACT_MIN and self._stale > len(self._entries):
+            self._heap = [e for e in self._heap if e[2] is not None]
+            heapq.heapify(self._heap)
+            self._stale = 0
+
+
+__all__ = [
+    "Timers"
+    ]
@@ -0,0 +1,71 @@
+#
+# Licensed to the Apache Software Foundation (ASF) under one
+# or more contributor license agreements.  See the NOTICE file
+# distributed with this work for additional information
+# regarding copyright ownership.  The ASF licenses this file
+# to you under the Apache License, Version 2.0 (the
+# "License"); you may not use this file except in compliance
+# with the License.  You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+#
+
+import sys
+from credit import CreditController
+
+"""
+Checks the CreditController against cases that once stalled a Receiver.
+Run with the python-driver/py directory on PYTHONPATH; exits non-zero if
+a check fails.
+"""
+
+
+def check_oversized_message():
+    # a message larger than max_bytes must not stop the credit
+    c = CreditController(max_bytes=4*1024*1024)
+    t = 1000.0
+    c.consumed(1, 5*1024*1024, 0, t)
+    grant = c.credit(0, t)
+    if grant < 1:
+        return "no credit after an oversized message (credit=%d)" % grant
+    # but while one is buffered no more may be fetched
+    c.consumed(0, 0, 1, t)
+    grant = c.credit(0, t)
+    if grant:
+        return "credit granted over the byte budget (credit=%d)" % grant
+    return None
+
+
+def check_byte_budget():
+    # 1MB messages: at most 4 fit in the default budget
+    c = CreditController(initial=10)
+    t = 1000.0
+    c.consumed(1, 1024*1024, 0, t)
+    grant = c.credit(0, t)
+    if grant != 4:
+        return "expected credit 4 within the byte budget, got %d" % grant
+    return None
+
+
+CHECKS = [check_oversized_message, check_byte_budget]
+
+
+def main():
+    failed = 0
+    for check in CHECKS:
+        error = check()
+        print("%-30s %s" % (check.__name__, error or "ok"))
+        if error:
+            failed += 1
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -201,19 +201,7 @@ def main(argv=None):
         # Poll for I/O & timers
         #
 
-        readfd, writefd = peers.need_io()
-
-        timeout = None
-        deadline = peers.get_next_tick()
-        if deadline:
-            now = time.time()
-            timeout = 0 if deadline <= now else deadline - now
-
-        print("select start (t=%s)" % str(timeout))
-        readable,writeable,ignore = select.select(readfd,writefd,[],timeout)
-        print("select return")
-
-        active_peers = peers.process_io(readable, writeable)
+        active_peers = peers.do_io()
 
         #
         # Protocol processing
@@ -0,0 +1,203 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "common.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+// Prints the live statistics of a running process (see include/stats.h),
+// vmstat style: a row per interval, counters as rates per second and
+// gauges as they are.
+
+#define HEADER_EVERY 20   // rows between repeated headers
+
+typedef struct {
+    pid_t pid;
+    double interval;      // seconds
+    unsigned int reports; // 0 = until the process exits
+    bool totals;
+    bool slots;
+} Options_t;
+
+static void usage(int rc)
+{
+    printf("Usage: stats-top [OPTIONS] [pid]\n"
+           " -i <seconds> \tInterval between reports [1]\n"
+           " -n # \tNumber of reports, 0=until the process exits [0]\n"
+           " -t \tShow counter totals instead of rates\n"
+           " -s \tAlso show each slot (thread) on its own row\n"
+           "Without a pid, list the processes publishing statistics.\n"
+           );
+    exit(rc);
+}
+
+static void parse_options( int argc, char **argv, Options_t *opts )
+{
+    int c;
+    long pid;
+    opterr = 0;
+
+    memset( opts, 0, sizeof(*opts) );
+    opts->interval = 1.0;
+
+    while ((c = getopt(argc, argv, "hi:n:ts")) != -1) {
+        switch (c) {
+        case 'i':
+            if (sscanf( optarg, "%lf", &opts->interval ) != 1 || opts->interval <= 0) {
+                fprintf(stderr, "Option -%c requires a positive number.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 'n':
+            if (sscanf( optarg, "%u", &opts->reports ) != 1) {
+                fprintf(stderr, "Option -%c requires an integer argument.\n", optopt);
+                usage(1);
+            }
+            break;
+        case 't': opts->totals = true; break;
+        case 's': opts->slots = true; break;
+        case 'h': usage(0); break;
+
+        default:
+            usage(1);
+        }
+    }
+
+    if (optind < argc) {
+        if (optind != argc - 1 || sscanf( argv[optind], "%ld", &pid ) != 1 || pid <= 0)
+            usage(1);
+        opts->pid = (pid_t) pid;
+    }
+}
+
+static void list_process( pid_t pid, const char *process, int running, void *context )
+{
+    fprintf( stdout, "%8ld  %s%s\n", (long) pid, process,
+             running ? "" : " (not running)" );
+}
+
+static double now_secs( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void print_header( Stats_t *stats, const int *widths )
+{
+    unsigned int i;
+    fprintf( stdout, "%-6s", "slot" );
+    for (i = 0; i < StatsCount( stats ); ++i)
+        fprintf( stdout, " %*s", widths[i], StatsName( stats, i ) );
+    fprintf( stdout, "\n" );
+}
+
+// one row: all slots (slot < 0) or a single one
+static void print_row( Stats_t *stats, const Options_t *opts, const int *widths,
+                       int slot, uint64_t *last, double secs )
+{
+    unsigned int i;
+    char label[16];
+    if (slot < 0) snprintf( label, sizeof(label), "all" );
+    else snprintf( label, sizeof(label), "#%d", slot );
+    fprintf( stdout, "%-6s", label );
+    for (i = 0; i < StatsCount( stats ); ++i) {
+        uint64_t value = slot < 0 ? StatsRead( stats, i ) : StatsReadSlot( stats, slot, i );
+        if (StatsKind( stats, i ) == STATS_GAUGE || opts->totals)
+            fprintf( stdout, " %*lu", widths[i], (unsigned long) value );
+        else
+            fprintf( stdout, " %*.1f", widths[i], (value - last[i]) / secs );
+        last[i] = value;
+    }
+    fprintf( stdout, "\n" );
+}
+
+int main(int argc, char** argv)
+{
+    Options_t opts;
+    unsigned int i, rows = 0, reports = 0;
+    int s;
+
+    parse_options( argc, argv, &opts );
+
+    if (!opts.pid) {
+        StatsList( list_process, NULL );
+        return 0;
+    }
+
+    Stats_t *stats = StatsAttach( opts.pid );
+    if (!stats) {
+        fprintf( stderr, "No statistics published by process %ld\n", (long) opts.pid );
+        return 1;
+    }
+    unsigned int count = StatsCount( stats );
+    unsigned int slots = StatsSlots( stats );
+    int *widths = (int *) calloc( count, sizeof(int) );
+    // the last values of each row: all slots, then each slot
+    uint64_t *last = (uint64_t *) calloc( (size_t)(slots + 1) * count, sizeof(uint64_t) );
+    check( widths && last, "Out of memory" );
+    for (i = 0; i < count; ++i) {
+        int n = strlen( StatsName( stats, i ) );
+        widths[i] = n > 12 ? n : 12;
+        last[i] = StatsRead( stats, i );
+        for (s = 0; s < (int) slots; ++s)
+            last[(s + 1) * count + i] = StatsReadSlot( stats, s, i );
+    }
+    fprintf( stdout, "%s (pid %ld), %u threads\n", StatsProcess( stats ),
+             (long) opts.pid, slots );
+
+    struct timespec delay;
+    delay.tv_sec = (time_t) opts.interval;
+    delay.tv_nsec = (long) ((opts.interval - delay.tv_sec) * 1000000000);
+    double then = now_secs();
+    while (!opts.reports || reports < opts.reports) {
+        nanosleep( &delay, NULL );
+        if (kill( opts.pid, 0 ) && errno == ESRCH) {
+            fprintf( stdout, "Process %ld has exited\n", (long) opts.pid );
+            break;
+        }
+        double now = now_secs();
+        if (rows % HEADER_EVERY == 0) print_header( stats, widths );
+        print_row( stats, &opts, widths, -1, last, now - then );
+        rows++;
+        if (opts.slots && slots > 1) {
+            for (s = 0; s < (int) slots; ++s)
+                print_row( stats, &opts, widths, s, &last[(s + 1) * count], now - then );
+        }
+        fflush( stdout );
+        then = now;
+        reports++;
+    }
+
+    StatsFree( stats );
+    free( widths );
+    free( last );
+    return 0;
+}